@@ -0,0 +1,274 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+#ifndef COMPACT_CRITBIT_TREE_H_
+#define COMPACT_CRITBIT_TREE_H_
+#include <algorithm>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "critbit-tree.h" // for detail::get_bit and detail::find_crit_bit
+
+// CompactCritBitTree is the same critbit tree as CritBitTree (see
+// critbit-tree.h), with the same Insert/LowerBound API, but laid out
+// for performance. There are no per-node heap allocations and no
+// std::variant. Internal nodes live in one contiguous array, and keys
+// in another one. Nodes link to each other via 32-bit indices, with
+// top bit telling whether it is an index of internal node or of a key
+// (i.e. leaf). So leaf is just a key in keys_ array, and internal node
+// is 12 bytes.
+//
+// Neither Insert nor LowerBound need a path stack. Insert is the
+// usual two-pass critbit insertion: first descent finds the leaf that
+// shares the longest prefix with the new key, and then second descent
+// from the root finds where the new critbit belongs. LowerBound
+// similarly re-descends and remembers the last place where we went
+// left (see there).
+//
+// As usual for critbit trees, keys must not contain '\0' bytes. And we
+// support up to 2^31 keys (and keys up to 2^28 bytes long).
+class CompactCritBitTree {
+public:
+  CompactCritBitTree() = default;
+
+  CompactCritBitTree(const CompactCritBitTree&) = delete;
+  CompactCritBitTree& operator=(const CompactCritBitTree&) = delete;
+
+  // Insert adds given key. Key must stay valid for as long as the
+  // tree is alive. Inserting a key that is already there does nothing.
+  void Insert(std::string_view key) {
+    if (keys_.empty()) {
+      root_ = AddLeaf(key);
+      return;
+    }
+
+    Link link = root_;
+    while (!IsLeaf(link)) {
+      const Node& n = nodes_[link];
+      link = n.children[detail::get_bit(key, n.critbit)];
+    }
+    std::optional<size_t> critbit = detail::find_crit_bit(key, keys_[link & ~kLeafTag]);
+    if (!critbit) {
+      return;
+    }
+    if (*critbit >= kLeafTag) {
+      fprintf(stderr, "CompactCritBitTree key is too long\n");
+      abort();
+    }
+
+    // New node goes above first node with greater critbit (or leaf)
+    // on the path of key. Note, we refer to the link we're replacing
+    // via it's parent node index, since adding nodes may move nodes_
+    // around.
+    uint32_t parent = kNoParent;
+    int direction = 0;
+    link = root_;
+    while (!IsLeaf(link) && nodes_[link].critbit < *critbit) {
+      parent = link;
+      direction = detail::get_bit(key, nodes_[link].critbit);
+      link = nodes_[link].children[direction];
+    }
+
+    Link leaf = AddLeaf(key);
+    int bit = detail::get_bit(key, *critbit);
+    Node node{static_cast<uint32_t>(*critbit), {bit ? link : leaf, bit ? leaf : link}};
+    Link new_link = nodes_.size();
+    nodes_.push_back(node);
+    if (parent == kNoParent) {
+      root_ = new_link;
+    } else {
+      nodes_[parent].children[direction] = new_link;
+    }
+  }
+
+  // LowerBound returns smallest key that is >= given key (or > key
+  // when really_upper is set). nullptr if there is none.
+  const std::string_view* LowerBound(std::string_view key, bool really_upper = false) const {
+    if (keys_.empty()) {
+      return nullptr;
+    }
+
+    Link link = root_;
+    while (!IsLeaf(link)) {
+      const Node& n = nodes_[link];
+      link = n.children[detail::get_bit(key, n.critbit)];
+    }
+    const std::string_view* found = &keys_[link & ~kLeafTag];
+    std::optional<size_t> critbit_opt = detail::find_crit_bit(key, *found);
+
+    size_t critbit;
+    int key_bit;
+    if (!critbit_opt) {
+      if (!really_upper) {
+        return found;
+      }
+      critbit = ~size_t{0};
+      key_bit = 1;
+    } else {
+      critbit = *critbit_opt;
+      key_bit = detail::get_bit(key, critbit);
+    }
+
+    // All keys in subtree we reach by following key's bits while
+    // node critbits are < critbit, share first critbit bits with
+    // key. So if key has 0 at critbit, they're all greater than key
+    // and we want smallest of them. Otherwise, they're all smaller,
+    // and we want smallest key in right sibling at deepest place
+    // where we went left.
+    Link right_of_path = kNoLink;
+    link = root_;
+    while (!IsLeaf(link) && nodes_[link].critbit < critbit) {
+      const Node& n = nodes_[link];
+      int direction = detail::get_bit(key, n.critbit);
+      if (direction == 0) {
+        right_of_path = n.children[1];
+      }
+      link = n.children[direction];
+    }
+    if (key_bit == 1) {
+      if (right_of_path == kNoLink) {
+        return nullptr;
+      }
+      link = right_of_path;
+    }
+    return MinLeaf(link);
+  }
+
+  // ForEachWithPrefix calls fn (with const std::string_view& of the
+  // key stored in the tree) for every key that starts with prefix, in
+  // increasing order. We descend once to the topmost node with critbit
+  // beyond the prefix, and then only walk that subtree.
+  template <typename Fn>
+  void ForEachWithPrefix(std::string_view prefix, Fn&& fn) const {
+    Link subtree = FindPrefixSubtree(prefix);
+    if (subtree == kNoLink) {
+      return;
+    }
+    std::vector<Link> stack{subtree};
+    while (!stack.empty()) {
+      Link link = stack.back();
+      stack.pop_back();
+      if (IsLeaf(link)) {
+        fn(keys_[link & ~kLeafTag]);
+      } else {
+        stack.push_back(nodes_[link].children[1]);
+        stack.push_back(nodes_[link].children[0]);
+      }
+    }
+  }
+
+  // CountPrefix returns number of keys that start with prefix. Note,
+  // we don't keep subtree sizes, so this walks matching subtree. A
+  // critbit subtree with k leaves has k-1 internal nodes, so it is
+  // still O(matches).
+  size_t CountPrefix(std::string_view prefix) const {
+    size_t count = 0;
+    ForEachWithPrefix(prefix, [&count] (const std::string_view&) { count++; });
+    return count;
+  }
+
+  // ValidateInvariants checks that every internal node's critbit is
+  // where keys of it's left and right subtrees first differ, and
+  // aborts if not.
+  void ValidateInvariants() const {
+    if (keys_.empty()) {
+      return;
+    }
+    if (nodes_.size() + 1 != keys_.size()) {
+      fprintf(stderr, "CompactCritBitTree: %zu nodes for %zu keys\n", nodes_.size(), keys_.size());
+      abort();
+    }
+    ValidateRec(root_);
+  }
+
+  // AccountMemory reports our 2 arrays. requested bytes are their
+  // capacities and logical bytes are parts in use. Templated on the
+  // collector type, just like CritBitTree::AccountMemory.
+  template <typename StatsT>
+  void AccountMemory(StatsT* stats) const {
+    stats->AddKeys(keys_.size());
+    stats->AddNode(nodes_.capacity() * sizeof(Node), nodes_.size() * sizeof(Node));
+    stats->AddNode(keys_.capacity() * sizeof(std::string_view), keys_.size() * sizeof(std::string_view));
+  }
+
+private:
+  using Link = uint32_t;
+  static constexpr Link kLeafTag = Link{1} << 31;
+  static constexpr Link kNoLink = ~Link{0};
+  static constexpr uint32_t kNoParent = ~uint32_t{0};
+
+  struct Node {
+    uint32_t critbit;
+    Link children[2];
+  };
+
+  static bool IsLeaf(Link link) {
+    return (link & kLeafTag) != 0;
+  }
+
+  Link AddLeaf(std::string_view key) {
+    if (keys_.size() >= kLeafTag - 1) {
+      fprintf(stderr, "CompactCritBitTree ran out of 31-bit indices\n");
+      abort();
+    }
+    keys_.push_back(key);
+    return (keys_.size() - 1) | kLeafTag;
+  }
+
+  // FindPrefixSubtree returns link to subtree that has exactly keys
+  // starting with prefix, or kNoLink if there are none. Keys of that
+  // subtree agree on all bits before it's top critbit (which is past
+  // the prefix), so any of them tells whether they all match.
+  Link FindPrefixSubtree(std::string_view prefix) const {
+    if (keys_.empty()) {
+      return kNoLink;
+    }
+    size_t prefix_bits = prefix.size() * 8;
+    Link link = root_;
+    while (!IsLeaf(link) && nodes_[link].critbit < prefix_bits) {
+      const Node& n = nodes_[link];
+      link = n.children[detail::get_bit(prefix, n.critbit)];
+    }
+    if (!MinLeaf(link)->starts_with(prefix)) {
+      return kNoLink;
+    }
+    return link;
+  }
+
+  const std::string_view* MinLeaf(Link link) const {
+    while (!IsLeaf(link)) {
+      link = nodes_[link].children[0];
+    }
+    return &keys_[link & ~kLeafTag];
+  }
+
+  // ValidateRec checks subtree and returns one of it's keys.
+  std::string_view ValidateRec(Link link) const {
+    if (IsLeaf(link)) {
+      return keys_[link & ~kLeafTag];
+    }
+    const Node& n = nodes_[link];
+    std::string_view left = ValidateRec(n.children[0]);
+    std::string_view right = ValidateRec(n.children[1]);
+    std::optional<size_t> first_diff = detail::find_crit_bit(left, right);
+    if (detail::get_bit(left, n.critbit) != 0 || detail::get_bit(right, n.critbit) != 1
+        || first_diff != n.critbit) {
+      fprintf(stderr, "CompactCritBitTree: bad critbit %u between '%.*s' and '%.*s'\n",
+              n.critbit, (int)std::min<size_t>(left.size(), 40), left.data(),
+              (int)std::min<size_t>(right.size(), 40), right.data());
+      abort();
+    }
+    return left;
+  }
+
+  Link root_ = kNoLink;
+  std::vector<Node> nodes_;
+  std::vector<std::string_view> keys_;
+};
+
+#endif  // COMPACT_CRITBIT_TREE_H_
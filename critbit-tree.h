@@ -17,7 +17,17 @@
 #include <string_view>// For std::string_view
 #include <utility>    // For std::move, std::pair
 #include <variant>    // For std::variant
-#include <vector>     // For path storage
+#include <vector>     // For AccountMemory traversal stack
+
+#include "node-pool.h" // For NodePool (used when built with USE_NODE_POOL)
+
+// Build with -DUSE_CRITBIT_LEAF_COUNTS=1 to have internal nodes cache the
+// number of leaves in their subtrees. This makes CountPrefix O(key length)
+// instead of O(key length + number of matches), at the cost of one extra word
+// per internal node.
+#ifndef USE_CRITBIT_LEAF_COUNTS
+#define USE_CRITBIT_LEAF_COUNTS 0
+#endif
 
 // --- Node Definitions ---
 
@@ -31,6 +41,15 @@ struct InternalNode;
 struct ExternalNode {
   /** The key associated with this leaf. Points to externally managed memory. */
   std::string_view key_;
+
+#if USE_NODE_POOL
+  /** Allocates leaves from NodePool slabs instead of general-purpose heap. */
+  static void* operator new([[maybe_unused]] size_t size) {
+    assert(size == sizeof(ExternalNode));
+    return NodePool<ExternalNode>::AllocateRaw();
+  }
+  static void operator delete(void* p) { NodePool<ExternalNode>::FreeRaw(p); }
+#endif
 };
 
 /**
@@ -59,6 +78,20 @@ struct InternalNode {
    * non-null unique_ptrs after the node's creation.
    */
   NodeVariant children_[2];
+
+#if USE_CRITBIT_LEAF_COUNTS
+  /** Number of leaves (keys) in this node's subtree. */
+  size_t leaf_count_;
+#endif
+
+#if USE_NODE_POOL
+  /** Allocates internal nodes from NodePool slabs instead of general-purpose heap. */
+  static void* operator new([[maybe_unused]] size_t size) {
+    assert(size == sizeof(InternalNode));
+    return NodePool<InternalNode>::AllocateRaw();
+  }
+  static void operator delete(void* p) { NodePool<InternalNode>::FreeRaw(p); }
+#endif
 };
 
 
@@ -170,17 +203,6 @@ inline std::optional<size_t> find_crit_bit(std::string_view s1,
  */
 class CritBitTree {
 private:
-  /**
-   * @brief Stores path information during tree traversals, enabling efficient
-   * insertion restructuring and successor finding in LowerBound.
-   */
-  struct PathElement {
-    /** Pointer to the parent InternalNode descended from. */
-    InternalNode* parent_node_ptr_ = nullptr;
-    /** Direction (0 or 1) taken from the parent to reach the next node. */
-    int direction_taken_ = -1;
-  };
-
   /** @brief Alias for the return type {representative_key, common_prefix_len_bits}
    * used by the recursive validation helper. */
   using ValidationInfo = std::pair<std::string_view, size_t>;
@@ -188,9 +210,6 @@ private:
   /** @brief The root of the tree, stored as an optional NodeVariant. */
   std::optional<NodeVariant> root_ = std::nullopt;
 
-  /** @brief A hint for reserving path vector capacity to potentially avoid reallocations. */
-  static constexpr size_t kMaxExpectedPathDepth = 1024;
-
 public:
   /** @brief Constructs an empty CritBitTree. */
   CritBitTree() = default;
@@ -218,26 +237,14 @@ public:
       return;
     }
 
-    // 2. Descent and Path Building: Traverse down according to key bits.
-    std::vector<PathElement> path;
-    path.reserve(kMaxExpectedPathDepth); // Pre-allocate path storage
-    NodeVariant* current_variant_ptr = &(*root_);
-
-    // Loop while the current node is internal.
-    while (std::holds_alternative<std::unique_ptr<InternalNode>>(*current_variant_ptr)) {
-      auto& internal_node_ptr = std::get<std::unique_ptr<InternalNode>>(*current_variant_ptr);
-      InternalNode* internal_node = internal_node_ptr.get(); // Assume non-null
-
-      // Determine direction and store path element before descending.
-      int direction = detail::get_bit(key, internal_node->critbit_index_);
-      path.push_back({internal_node, direction});
-      // Move to the child variant slot. Assumed valid based on invariants.
-      current_variant_ptr = &internal_node->children_[direction];
-    }
+    // 2. First Descent: Traverse down according to key bits to the leaf
+    //    sharing the longest prefix with the key. No path is recorded; the
+    //    insertion point is found by a second descent (step 5), so Insert
+    //    needs no per-call heap memory.
+    const ExternalNode& existing_leaf = *FindBestMatchLeaf(key);
 
-    // 3. Handle Existing Leaf: Descent ended, must be at an ExternalNode variant.
-    auto& existing_leaf_ptr = std::get<std::unique_ptr<ExternalNode>>(*current_variant_ptr);
-    std::string_view existing_key = existing_leaf_ptr->key_;
+    // 3. Handle Existing Leaf: Descent ended at an ExternalNode.
+    std::string_view existing_key = existing_leaf.key_;
 
     // 4. Calculate Critical Bit: Find the first difference with the existing key.
     std::optional<size_t> critbit_opt = detail::find_crit_bit(key, existing_key);
@@ -250,20 +257,21 @@ public:
     auto new_leaf_ptr = std::make_unique<ExternalNode>(ExternalNode{key});
     int new_key_bit = detail::get_bit(key, new_critbit_index);
 
-    // 5. Walk Up Path Stack: Find where the new internal node should be inserted.
-    //    It replaces the child pointer *below* the highest ancestor whose
-    //    critbit is less than the new critbit.
-    NodeVariant* insert_pos_ptr = &(*root_); // Default if new node is child of root
-    for (int i = path.size() - 1; i >= 0; --i) {
-      InternalNode* parent_node_ptr = path[i].parent_node_ptr_; // Direct pointer from path
-      int direction_taken = path[i].direction_taken_;
-
-      if (parent_node_ptr->critbit_index_ < new_critbit_index) {
-        // Found the correct ancestor. The insertion point is the variant slot
-        // for the child we originally descended into from this parent.
-        insert_pos_ptr = &parent_node_ptr->children_[direction_taken];
-        break; // Stop walking up
+    // 5. Second Descent: Find where the new internal node should be inserted.
+    //    Critbits increase along any root-to-leaf path, so the new node
+    //    replaces the first link on the key's path that points to a leaf or
+    //    to an internal node with a greater critbit.
+    NodeVariant* insert_pos_ptr = &(*root_);
+    while (std::holds_alternative<std::unique_ptr<InternalNode>>(*insert_pos_ptr)) {
+      InternalNode* internal_node = std::get<std::unique_ptr<InternalNode>>(*insert_pos_ptr).get();
+      if (internal_node->critbit_index_ > new_critbit_index) {
+        break;
       }
+#if USE_CRITBIT_LEAF_COUNTS
+      // Nodes above the insertion point gain one leaf.
+      internal_node->leaf_count_++;
+#endif
+      insert_pos_ptr = &internal_node->children_[detail::get_bit(key, internal_node->critbit_index_)];
     }
 
     // 6. Restructure: Insert the new internal node, adjusting children.
@@ -275,6 +283,9 @@ public:
       // Create the new internal node representing the split.
       auto new_internal_node = std::make_unique<InternalNode>();
       new_internal_node->critbit_index_ = new_critbit_index;
+#if USE_CRITBIT_LEAF_COUNTS
+      new_internal_node->leaf_count_ = LeafCount(&existing_node_variant_moved) + 1;
+#endif
 
       // Assign the new leaf and the moved subtree to the correct children (0 or 1)
       // based on the bit value of the *new* key at the critical bit index.
@@ -302,25 +313,8 @@ public:
   [[nodiscard]] const std::string_view* LowerBound(std::string_view key, bool really_upper = false) const {
     if (!root_) return nullptr; // Empty tree
 
-    std::vector<PathElement> path;
-    path.reserve(kMaxExpectedPathDepth); // Reserve capacity
-    const NodeVariant* current_variant = &(*root_); // Start at root
-
-    // Descend while at internal nodes, tracking the path.
-    while (std::holds_alternative<std::unique_ptr<InternalNode>>(*current_variant)) {
-      const auto& internal_node_ptr = std::get<std::unique_ptr<InternalNode>>(*current_variant);
-      const InternalNode* internal_node = internal_node_ptr.get(); // Const raw pointer
-
-      int direction = detail::get_bit(key, internal_node->critbit_index_);
-      // Store path element. const_cast is needed as PathElement stores non-const InternalNode*,
-      // but this const method will not modify the tree through it.
-      path.push_back({const_cast<InternalNode*>(internal_node), direction});
-      current_variant = &internal_node->children_[direction]; // Descend (assumed valid)
-    }
-
-    // Must have reached the ExternalNode variant containing the closest leaf.
-    const auto& found_leaf_ptr = std::get<std::unique_ptr<ExternalNode>>(*current_variant);
-    const ExternalNode& found_leaf = *found_leaf_ptr; // Assume non-null
+    // Descend to the leaf sharing the longest prefix with the key.
+    const ExternalNode& found_leaf = *FindBestMatchLeaf(key);
 
     std::optional<size_t> critbit_opt = detail::find_crit_bit(key, found_leaf.key_);
 
@@ -338,36 +332,95 @@ public:
       key_bit = detail::get_bit(key, critbit);
     }
 
-    while (!path.empty() && path.rbegin()->parent_node_ptr_->critbit_index_ > critbit) {
-      path.pop_back();
+    // Re-descend from the root along the key's bits while node critbits
+    // are below critbit. Keys in the subtree we stop at all share their
+    // first critbit bits with the key. So if the key has 0 at critbit,
+    // they are all greater than the key, and that subtree's smallest leaf
+    // is the leaf we need. Otherwise (key_bit == 1) they are all smaller,
+    // and we need the smallest leaf of the right sibling at the deepest
+    // place where we went left. We remember that sibling on the way down
+    // instead of keeping a path stack, so no heap memory is needed.
+    const NodeVariant* current_variant = &*root_;
+    const NodeVariant* right_of_path = nullptr;
+    while (std::holds_alternative<std::unique_ptr<InternalNode>>(*current_variant)) {
+      const InternalNode* internal_node = std::get<std::unique_ptr<InternalNode>>(*current_variant).get();
+      if (internal_node->critbit_index_ > critbit) {
+        break;
+      }
+      int direction = detail::get_bit(key, internal_node->critbit_index_);
+      if (direction == 0) {
+        right_of_path = &internal_node->children_[1];
+      }
+      current_variant = &internal_node->children_[direction];
     }
-    // if the insertion place for key is on the right from this
-    // current node, then this node's subtree is all smaller then key,
-    // so we want to pop up and switch to the right children.
-    //
-    // Otherwise, (i.e. key_bit == 0) then subtree's smallest leaf is
-    // the leaf we need.
     if (key_bit == 1) {
-      while (!path.empty() && path.rbegin()->direction_taken_ == 1) {
-        path.pop_back();
-      }
-      if (path.empty()) {
+      if (!right_of_path) {
         return nullptr;
       }
-      // we found the place now lets switch it from left to right
-      path.rbegin()->direction_taken_ = 1;
-    }
-    if (path.empty()) {
-      assert(key_bit == 0);
-      current_variant = &*root_;
-    } else {
-      const auto& e = *path.rbegin();
-      current_variant = &e.parent_node_ptr_->children_[e.direction_taken_];
+      current_variant = right_of_path;
     }
 
     return &FindMinLeaf(current_variant)->key_;
   }
 
+  /**
+   * @brief Calls fn for every key that starts with the given prefix, in
+   * increasing order.
+   *
+   * Descends once, down to the topmost node whose crit-bit lies beyond the
+   * prefix. All keys in that node's subtree share their first prefix-length
+   * bytes, so either all of them or none of them start with the prefix, and
+   * we only walk that subtree.
+   *
+   * @param prefix The prefix to match.
+   * @param fn Callable taking `const std::string_view&` (a reference to the
+   * key stored in the tree).
+   */
+  template <typename Fn>
+  void ForEachWithPrefix(std::string_view prefix, Fn&& fn) const {
+    const NodeVariant* subtree = FindPrefixSubtree(prefix);
+    if (!subtree) {
+      return;
+    }
+    // Explicit stack, because tree depth is bounded only by key lengths.
+    // Right child is pushed first, so that left subtree is visited first.
+    std::vector<const NodeVariant*> stack{subtree};
+    while (!stack.empty()) {
+      const NodeVariant* v = stack.back();
+      stack.pop_back();
+      if (std::holds_alternative<std::unique_ptr<InternalNode>>(*v)) {
+        const InternalNode& internal = *std::get<std::unique_ptr<InternalNode>>(*v);
+        stack.push_back(&internal.children_[1]);
+        stack.push_back(&internal.children_[0]);
+      } else {
+        fn(std::get<std::unique_ptr<ExternalNode>>(*v)->key_);
+      }
+    }
+  }
+
+  /**
+   * @brief Counts keys that start with the given prefix.
+   *
+   * With USE_CRITBIT_LEAF_COUNTS this is a single descent (see
+   * ForEachWithPrefix). Otherwise we also walk the matching subtree.
+   *
+   * @param prefix The prefix to match.
+   * @return Number of keys starting with the prefix.
+   */
+  [[nodiscard]] size_t CountPrefix(std::string_view prefix) const {
+    const NodeVariant* subtree = FindPrefixSubtree(prefix);
+    if (!subtree) {
+      return 0;
+    }
+#if USE_CRITBIT_LEAF_COUNTS
+    return LeafCount(subtree);
+#else
+    size_t count = 0;
+    ForEachWithPrefix(prefix, [&count](const std::string_view&) { count++; });
+    return count;
+#endif
+  }
+
   /**
    * @brief Validates structural and crit-bit invariants of the tree.
    *
@@ -381,14 +434,123 @@ public:
     if (root_) {
       // Start the recursive validation from the root node.
       ValidateNodeRecursive(&(*root_), node_count);
+#if USE_CRITBIT_LEAF_COUNTS
+      ValidateLeafCountsRecursive(&(*root_));
+#endif
     }
     // Optional: Can add more checks, e.g., verify node_count against expected size.
     // printf("CritBitTree::ValidateInvariants passed. Node count: %zu\n", node_count);
   }
 
+  /**
+   * @brief Reports keys and nodes owned by the tree to a memory stats collector.
+   *
+   * Every leaf holds one key. Both leaves and internal nodes are separate
+   * heap allocations of sizeof(ExternalNode) and sizeof(InternalNode) bytes
+   * respectively. Templated on the collector type so that this header does
+   * not depend on demo-helper.h (see MemoryStats there).
+   *
+   * @param stats Collector with AddKeys(count) and AddNode(bytes) methods.
+   */
+  template <typename StatsT>
+  void AccountMemory(StatsT* stats) const {
+    if (!root_) {
+      return;
+    }
+    // Explicit stack, because tree depth is bounded only by key lengths.
+    std::vector<const NodeVariant*> stack{&*root_};
+    while (!stack.empty()) {
+      const NodeVariant* v = stack.back();
+      stack.pop_back();
+      if (std::holds_alternative<std::unique_ptr<InternalNode>>(*v)) {
+        const InternalNode& internal = *std::get<std::unique_ptr<InternalNode>>(*v);
+        stats->AddNode(sizeof(InternalNode));
+        stack.push_back(&internal.children_[0]);
+        stack.push_back(&internal.children_[1]);
+      } else {
+        stats->AddKeys(1);
+        stats->AddNode(sizeof(ExternalNode));
+      }
+    }
+  }
+
 
 private: // Private helper methods
 
+  /**
+   * @brief Finds the subtree holding exactly the keys that start with the
+   * given prefix.
+   * @param prefix The prefix to match.
+   * @return Pointer to the subtree's variant, or nullptr if no key starts with
+   * the prefix.
+   */
+  const NodeVariant* FindPrefixSubtree(std::string_view prefix) const {
+    if (!root_) {
+      return nullptr;
+    }
+    const size_t prefix_bits = prefix.size() * 8;
+    const NodeVariant* current_variant = &*root_;
+    while (std::holds_alternative<std::unique_ptr<InternalNode>>(*current_variant)) {
+      const InternalNode* internal_node = std::get<std::unique_ptr<InternalNode>>(*current_variant).get();
+      if (internal_node->critbit_index_ >= prefix_bits) {
+        break;
+      }
+      current_variant = &internal_node->children_[detail::get_bit(prefix, internal_node->critbit_index_)];
+    }
+    // Keys of this subtree agree on all bits before the top crit-bit, so any
+    // of them tells whether they all start with the prefix.
+    if (!FindMinLeaf(current_variant)->key_.starts_with(prefix)) {
+      return nullptr;
+    }
+    return current_variant;
+  }
+
+#if USE_CRITBIT_LEAF_COUNTS
+  /** @brief Returns number of leaves in the given subtree. */
+  static size_t LeafCount(const NodeVariant* v) {
+    if (std::holds_alternative<std::unique_ptr<InternalNode>>(*v)) {
+      return std::get<std::unique_ptr<InternalNode>>(*v)->leaf_count_;
+    }
+    return 1;
+  }
+
+  /**
+   * @brief Recursively checks cached leaf counts. Aborts via abort() on
+   * mismatch.
+   * @return Actual number of leaves in the subtree.
+   */
+  size_t ValidateLeafCountsRecursive(const NodeVariant* v) const {
+    if (!std::holds_alternative<std::unique_ptr<InternalNode>>(*v)) {
+      return 1;
+    }
+    const InternalNode& internal = *std::get<std::unique_ptr<InternalNode>>(*v);
+    size_t count = ValidateLeafCountsRecursive(&internal.children_[0])
+                   + ValidateLeafCountsRecursive(&internal.children_[1]);
+    if (internal.leaf_count_ != count) {
+      printf("[Validation Fail] Cached leaf count %zu (expected %zu) at node critbit %zu.\n",
+             internal.leaf_count_, count, internal.critbit_index_);
+      abort();
+    }
+    return count;
+  }
+#endif
+
+  /**
+   * @brief Descends from the root following the key's bits down to a leaf.
+   * That leaf shares the longest common prefix with the key among all keys
+   * in the tree. Assumes the tree is not empty.
+   * @param key The key whose bits guide the descent.
+   * @return Pointer to the const ExternalNode reached.
+   */
+  const ExternalNode* FindBestMatchLeaf(std::string_view key) const {
+    const NodeVariant* current_variant = &*root_;
+    while (std::holds_alternative<std::unique_ptr<InternalNode>>(*current_variant)) {
+      const InternalNode* internal_node = std::get<std::unique_ptr<InternalNode>>(*current_variant).get();
+      current_variant = &internal_node->children_[detail::get_bit(key, internal_node->critbit_index_)];
+    }
+    return std::get<std::unique_ptr<ExternalNode>>(*current_variant).get();
+  }
+
   /**
    * @brief Finds the minimum element (leftmost leaf) in a given subtree.
    * Assumes the subtree structure is valid according to tree invariants.
@@ -3,17 +3,22 @@
 #define DEMO_HELPER_H_
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <fstream>
 #include <functional>
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <random>
 #include <semaphore>
+#include <span>
 #include <sstream>
 #include <string>
 #include <string_view>
 #include <thread>
+#include <vector>
 
 #include <errno.h>
 #include <signal.h>
@@ -140,6 +145,197 @@ DemoHelper MaybeSetupHeapSampling(int argc, char** argv) {
   return MaybeSetupHeapSampling({});
 }
 
+// ConsumeFlag looks for --name=value argument, removes it from argv
+// (so that remaining arguments can be handled as before, e.g. by
+// MaybeSetupHeapSampling) and returns value. name includes leading
+// dashes. Bare --name (i.e. boolean flag) gives us empty value.
+inline
+std::optional<std::string_view> ConsumeFlag(int* argc, char*** argv, std::string_view name) {
+  for (int i = 1; i < *argc; i++) {
+    std::string_view arg = (*argv)[i];
+    if (!arg.starts_with(name)) {
+      continue;
+    }
+    std::string_view rest = arg.substr(name.size());
+    if (!rest.empty() && rest[0] != '=') {
+      continue;
+    }
+    for (int j = i; j + 1 < *argc; j++) {
+      (*argv)[j] = (*argv)[j + 1];
+    }
+    (*argc)--;
+    return rest.empty() ? rest : rest.substr(1);
+  }
+  return {};
+}
+
+// MemoryStats is how suffix programs report memory footprint of
+// their data structures. Structure's AccountMemory method walks the
+// structure and reports every key and every chunk of memory it owns
+// (see AddNode). We then print per-key numbers along with what
+// tcmalloc thinks about heap usage, so that allocator overhead
+// (i.e. size-class rounding) and fragmentation are visible per
+// structure.
+//
+// Accounting walks entire structure, so we only do it when
+// DEMO_MEMORY_STATS environment variable is set.
+class MemoryStats {
+public:
+  // We snapshot allocator's numbers at construction time, so that
+  // we're able to tell how much heap was consumed since. Programs
+  // construct MemoryStats just before they start building their
+  // structure.
+  MemoryStats() : baseline_allocated_bytes_(GetAllocatorProperty("generic.current_allocated_bytes")) {}
+
+  static bool Enabled() {
+    const char* val = getenv("DEMO_MEMORY_STATS");
+    return val != nullptr && std::string_view{val} != "0";
+  }
+
+  void AddKeys(size_t count) {
+    key_count_ += count;
+  }
+
+  // requested_bytes is how much we asked malloc for. logical_bytes is
+  // part of that which actually holds keys and links (e.g. btree
+  // nodes aren't always full).
+  void AddNode(size_t requested_bytes, size_t logical_bytes) {
+    node_count_++;
+    requested_bytes_ += requested_bytes;
+    logical_bytes_ += logical_bytes;
+    node_size_freq_[requested_bytes]++;
+  }
+  void AddNode(size_t requested_bytes) {
+    AddNode(requested_bytes, requested_bytes);
+  }
+  // AddNodes is for when we only know totals (see CountingAllocator
+  // below).
+  void AddNodes(size_t count, size_t requested_bytes) {
+    node_count_ += count;
+    requested_bytes_ += requested_bytes * count;
+    logical_bytes_ += requested_bytes * count;
+    node_size_freq_[requested_bytes] += count;
+  }
+
+  size_t key_count() const { return key_count_; }
+  size_t requested_bytes() const { return requested_bytes_; }
+  size_t logical_bytes() const { return logical_bytes_; }
+
+  void Print(const char* structure_name) const {
+    double keys = std::max<size_t>(key_count_, 1);
+    printf("\nMemory stats of %s:\n", structure_name);
+    printf("keys: %zu, nodes: %zu\n", key_count_, node_count_);
+    printf("logical bytes:   %12zu (%.2f bytes/key)\n", logical_bytes_, logical_bytes_ / keys);
+    printf("requested bytes: %12zu (%.2f bytes/key)\n", requested_bytes_, requested_bytes_ / keys);
+    for (auto [size, count] : node_size_freq_) {
+      printf("node_size_freq[%zu bytes]: %zu\n", size, count);
+    }
+
+#ifdef WE_HAVE_TCMALLOC
+    size_t allocated = GetAllocatorProperty("generic.current_allocated_bytes");
+    size_t heap_size = GetAllocatorProperty("generic.heap_size");
+    size_t allocated_delta = allocated - baseline_allocated_bytes_;
+    printf("generic.current_allocated_bytes: %12zu (%zu since build start, %.2f bytes/key)\n",
+           allocated, allocated_delta, allocated_delta / keys);
+    printf("allocator overhead: %lld bytes (allocated since build start minus requested)\n",
+           static_cast<long long>(allocated_delta) - static_cast<long long>(requested_bytes_));
+    printf("generic.heap_size: %12zu, free (fragmentation + caches): %zu\n",
+           heap_size, heap_size - allocated);
+    printf("tcmalloc.pageheap_free_bytes: %zu, tcmalloc.pageheap_unmapped_bytes: %zu\n",
+           GetAllocatorProperty("tcmalloc.pageheap_free_bytes"),
+           GetAllocatorProperty("tcmalloc.pageheap_unmapped_bytes"));
+#endif
+  }
+
+private:
+  static size_t GetAllocatorProperty(const char* name) {
+    size_t value = 0;
+#ifdef WE_HAVE_TCMALLOC
+    MallocExtension::instance()->GetNumericProperty(name, &value);
+#endif
+    (void)name;
+    return value;
+  }
+
+  const size_t baseline_allocated_bytes_;
+  size_t key_count_ = 0;
+  size_t node_count_ = 0;
+  size_t logical_bytes_ = 0;
+  size_t requested_bytes_ = 0;
+  std::map<size_t, size_t> node_size_freq_;
+};
+
+// AccountBinaryTreeMemory is AccountMemory for our binary trees with
+// fixed-size nodes and left/right links (treap and splay trees). We
+// walk with explicit stack, since those trees can be arbitrarily
+// deep.
+template <typename Node>
+void AccountBinaryTreeMemory(const Node* root, MemoryStats* stats) {
+  std::vector<const Node*> stack;
+  if (root) {
+    stack.push_back(root);
+  }
+  while (!stack.empty()) {
+    const Node* n = stack.back();
+    stack.pop_back();
+    stats->AddKeys(1);
+    stats->AddNode(sizeof(Node));
+    if (n->left) { stack.push_back(n->left); }
+    if (n->right) { stack.push_back(n->right); }
+  }
+}
+
+// CountingAllocator is std::allocator that keeps track of what is
+// currently allocated through it. We use it for containers which node
+// layout we cannot walk ourselves (std::set and
+// absl::btree_set). Counts are process-wide, so it is only useful
+// when single container uses it. And we only count when memory stats
+// are enabled, so that normal runs don't pay for map updates.
+struct AllocationCounts {
+  const bool enabled = MemoryStats::Enabled();
+  // Maps allocation size to number of live allocations of this size.
+  std::map<size_t, size_t> live_by_size;
+
+  void AccountMemory(MemoryStats* stats) const {
+    for (auto [size, count] : live_by_size) {
+      if (count == 0) { continue; }
+      stats->AddNodes(count, size);
+    }
+  }
+
+  static AllocationCounts* Global() {
+    static AllocationCounts counts;
+    return &counts;
+  }
+};
+
+template <typename T>
+struct CountingAllocator {
+  using value_type = T;
+
+  CountingAllocator() = default;
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    AllocationCounts* counts = AllocationCounts::Global();
+    if (counts->enabled) {
+      counts->live_by_size[n * sizeof(T)]++;
+    }
+    return std::allocator<T>{}.allocate(n);
+  }
+  void deallocate(T* p, size_t n) {
+    AllocationCounts* counts = AllocationCounts::Global();
+    if (counts->enabled) {
+      counts->live_by_size[n * sizeof(T)]--;
+    }
+    std::allocator<T>{}.deallocate(p, n);
+  }
+
+  template <typename U>
+  bool operator==(const CountingAllocator<U>&) const { return true; }
+};
+
 inline
 void PrintOccurenceContext(std::string_view text, size_t off) {
   std::string context{text.substr(off - 32, 64)};
@@ -154,6 +350,114 @@ void PrintOccurenceContext(std::string_view text, size_t off) {
   printf("%s\n", context.c_str());
 }
 
+// SkewedSuffixOrder returns positions of all suffixes of text in the
+// order that is worst case for binary trees that insert by splitting
+// at the root (see --insert-order=skewed): upper half of suffixes in
+// increasing order, then lower half in decreasing order. Upper half
+// builds a chain as deep as it is long, and first insertion of the
+// lower half has to split along all of it.
+inline
+std::vector<size_t> SkewedSuffixOrder(std::string_view text) {
+  std::vector<size_t> order(text.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [text] (size_t a, size_t b) {
+    return text.substr(a) < text.substr(b);
+  });
+  size_t lower_half = order.size() / 2;
+  std::rotate(order.begin(), order.begin() + lower_half, order.end());
+  std::reverse(order.end() - lower_half, order.end());
+  return order;
+}
+
+// RunLookups is read-heavy benchmark behind --lookups=N flags. It
+// runs N lookups of random short substrings of the text and prints
+// lookup rate. lookup is given the probe and returns whether it found
+// a key starting with it.
+template <typename LookupFn>
+void RunLookups(std::string_view text, size_t num_lookups, LookupFn&& lookup) {
+  static constexpr size_t kProbeSize = 16;
+  std::minstd_rand rng(1);
+  size_t hits = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < num_lookups; i++) {
+    std::string_view probe = text.substr(rng() % text.size(), kProbeSize);
+    hits += lookup(probe);
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%zu lookups (%zu hits), %.0f lookups/sec\n", num_lookups, hits, num_lookups / seconds);
+}
+
+// ConcurrentReaders is how persistent structures demo serving lookups
+// from multiple threads while main thread keeps inserting. Each
+// reader thread repeatedly calls given batch function with a batch
+// of random probes (short substrings of the text). Batch function is
+// expected to grab current version of the structure and run lookups
+// of all the probes against it, returning number of hits.
+class ConcurrentReaders {
+public:
+  using BatchFn = std::function<size_t(std::span<const std::string_view> probes)>;
+
+  static constexpr size_t kBatchSize = 256;
+  static constexpr size_t kProbeSize = 16;
+
+  ConcurrentReaders(int num_readers, std::string_view text, BatchFn batch_fn)
+    : start_(std::chrono::steady_clock::now()), batch_fn_(std::move(batch_fn)),
+      stats_(num_readers) {
+    for (int i = 0; i < num_readers; i++) {
+      threads_.emplace_back([this, i, text] () {
+        std::minstd_rand rng(i + 1);
+        std::string_view probes[kBatchSize];
+        while (!stop_.load(std::memory_order_relaxed)) {
+          for (std::string_view& probe : probes) {
+            probe = text.substr(rng() % text.size(), kProbeSize);
+          }
+          stats_[i].hits += batch_fn_(probes);
+          stats_[i].lookups += kBatchSize;
+        }
+      });
+    }
+  }
+
+  ~ConcurrentReaders() {
+    Stop();
+  }
+
+  // Stop stops and joins reader threads and prints their stats.
+  void Stop() {
+    if (threads_.empty()) {
+      return;
+    }
+    stop_.store(true);
+    for (std::thread& t : threads_) {
+      t.join();
+    }
+    threads_.clear();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    size_t total_lookups = 0;
+    for (size_t i = 0; i < stats_.size(); i++) {
+      printf("reader %zu: %zu lookups (%zu hits), %.0f lookups/sec\n",
+             i, stats_[i].lookups, stats_[i].hits, stats_[i].lookups / seconds);
+      total_lookups += stats_[i].lookups;
+    }
+    printf("all %zu readers: %.0f lookups/sec\n", stats_.size(), total_lookups / seconds);
+  }
+
+private:
+  struct alignas(64) Stats {
+    size_t lookups = 0;
+    size_t hits = 0;
+  };
+
+  const std::chrono::steady_clock::time_point start_;
+  const BatchFn batch_fn_;
+  std::atomic<bool> stop_{false};
+  std::vector<Stats> stats_;
+  std::vector<std::thread> threads_;
+};
+
 struct AtomicFlag {
   std::atomic<bool> value{false};
 
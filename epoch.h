@@ -0,0 +1,125 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+#ifndef EPOCH_H_
+#define EPOCH_H_
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// EpochDomain is minimal epoch-based deferred reclamation. Readers
+// wrap accesses to shared pointers in EpochDomain::Guard. Writers
+// unlink things first, and then Retire them, which defers their
+// cleanup until every reader that could still see them has left it's
+// guard. Reclaim (or destructor) runs cleanups that are safe to run.
+//
+// We keep global epoch counter. Each Retire bumps it. Entering guard
+// records current epoch in one of kMaxThreads slots (leaving it
+// resets slot back to 0). Cleanup retired at epoch e may run once all
+// occupied slots have epochs greater than e. All the relevant
+// atomics are sequentially consistent, so reader that records epoch
+// greater than e is guaranteed to see what writer published before
+// retiring at e.
+//
+// Guards are meant to be short (e.g. just long enough to grab a
+// reference to current version of some structure). Slots aren't tied
+// to threads, so there is no thread registration, but no more than
+// kMaxThreads guards may be active at once.
+class EpochDomain {
+public:
+  static constexpr int kMaxThreads = 256;
+
+  class Guard {
+  public:
+    explicit Guard(EpochDomain* domain) : slot_(domain->Enter()) {}
+    ~Guard() {
+      slot_->store(0, std::memory_order_release);
+    }
+
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+  private:
+    std::atomic<uint64_t>* const slot_;
+  };
+
+  EpochDomain() = default;
+  ~EpochDomain() {
+    // We assume there are no more readers.
+    for (auto& [epoch, fn] : retired_) {
+      fn();
+    }
+  }
+
+  EpochDomain(const EpochDomain&) = delete;
+  EpochDomain& operator=(const EpochDomain&) = delete;
+
+  // Retire arranges for fn to be called when no reader can possibly
+  // see what was unlinked before this call.
+  void Retire(std::function<void()> fn) {
+    uint64_t epoch = global_epoch_.fetch_add(1);
+    std::lock_guard l(retired_lock_);
+    retired_.emplace_back(epoch, std::move(fn));
+  }
+
+  // Reclaim runs retired cleanups that are safe to run. Returns
+  // number of cleanups run.
+  size_t Reclaim() {
+    uint64_t min_active = UINT64_MAX;
+    for (Slot& s : slots_) {
+      uint64_t e = s.epoch.load();
+      if (e != 0) {
+        min_active = std::min(min_active, e);
+      }
+    }
+
+    std::vector<std::function<void()>> ready;
+    {
+      std::lock_guard l(retired_lock_);
+      auto it = std::stable_partition(retired_.begin(), retired_.end(),
+                                      [min_active] (const auto& r) { return r.first >= min_active; });
+      for (auto i = it; i != retired_.end(); ++i) {
+        ready.push_back(std::move(i->second));
+      }
+      retired_.erase(it, retired_.end());
+    }
+
+    for (auto& fn : ready) {
+      fn();
+    }
+    return ready.size();
+  }
+
+private:
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{0};
+  };
+
+  std::atomic<uint64_t>* Enter() {
+    // Each thread starts probing at it's own place, so that in the
+    // common case different threads get different slots (and cache
+    // lines) every time.
+    static thread_local size_t start = std::hash<std::thread::id>{}(std::this_thread::get_id());
+    for (size_t i = start;; i++) {
+      std::atomic<uint64_t>& e = slots_[i % kMaxThreads].epoch;
+      uint64_t expected = 0;
+      if (e.load(std::memory_order_relaxed) == 0
+          && e.compare_exchange_strong(expected, global_epoch_.load())) {
+        start = i;
+        return &e;
+      }
+    }
+  }
+
+  Slot slots_[kMaxThreads];
+  std::atomic<uint64_t> global_epoch_{1};
+
+  std::mutex retired_lock_;
+  std::vector<std::pair<uint64_t, std::function<void()>>> retired_;
+};
+
+#endif  // EPOCH_H_
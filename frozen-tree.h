@@ -0,0 +1,334 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+#ifndef FROZEN_TREE_H_
+#define FROZEN_TREE_H_
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "demo-helper.h"
+
+// FrozenTree is read-only copy of a binary search tree (of any of our
+// suffix AVL, treap or splay trees). Once the tree is built we only
+// query it, but it's nodes are wherever malloc placed them (in
+// reverse insertion order, which has nothing to do with lookup
+// paths). And treap and splay trees are deeper than they need to
+// be. Freezing copies the keys into one contiguous array of nodes
+// linked by 32-bit indices, which form perfectly balanced tree
+// (whatever the shape of the original). So every lookup visits at
+// most ceil(log2(N + 1)) nodes, and the original tree can be freed
+// afterwards.
+//
+// Order of nodes in the array is either BFS order (top levels of the
+// tree are packed together) or van Emde Boas order. The latter cuts
+// the tree at half of it's height, lays out top half recursively and
+// then every subtree hanging off it recursively. So any path of k
+// levels touches O(k / log(B)) blocks of B nodes, regardless of B.
+//
+// Lookups also prefetch both children of the current node before
+// comparing with it's key. By the time we know where to go next, the
+// next node is (hopefully) on the way.
+template <typename Key>
+class FrozenTree {
+public:
+  enum class Layout {
+    kBFS,
+    kVEB,
+  };
+
+  FrozenTree() = default;
+
+  // ParseLayout handles values of --freeze flag.
+  static std::optional<Layout> ParseLayout(std::string_view name) {
+    if (name == "bfs") {
+      return Layout::kBFS;
+    }
+    if (name == "veb") {
+      return Layout::kVEB;
+    }
+    return {};
+  }
+
+  // Freeze builds the copy of the tree at root. get_key, get_left and
+  // get_right tell us how to walk source nodes. We walk it with
+  // explicit stack, since neither treap nor splay tree depth is
+  // bounded.
+  template <typename Src, typename GetKey, typename GetLeft, typename GetRight>
+  static FrozenTree Freeze(const Src* root, Layout layout,
+                           GetKey&& get_key, GetLeft&& get_left, GetRight&& get_right) {
+    // First we collect nodes in order. Then every node of the frozen
+    // tree is a Range of them (see below).
+    std::vector<const Src*> sources;
+    std::vector<const Src*> stack;
+    for (const Src* n = root; n || !stack.empty(); ) {
+      while (n) {
+        stack.push_back(n);
+        n = get_left(n);
+      }
+      n = stack.back();
+      stack.pop_back();
+      if (sources.size() >= kNoNode) {
+        fprintf(stderr, "FrozenTree ran out of 32-bit indices\n");
+        abort();
+      }
+      sources.push_back(n);
+      n = get_right(n);
+    }
+
+    std::vector<Range> order;
+    order.reserve(sources.size());
+    if (!sources.empty()) {
+      Range all{0, static_cast<uint32_t>(sources.size())};
+      if (layout == Layout::kBFS) {
+        order.push_back(all);
+        for (size_t i = 0; i < order.size(); i++) {
+          for (Range child : order[i].Children()) {
+            if (!child.empty()) {
+              order.push_back(child);
+            }
+          }
+        }
+      } else {
+        std::vector<Range> frontier;
+        LayoutVEB(all, all.Height(), &order, &frontier);
+        assert(frontier.empty());
+      }
+    }
+    assert(order.size() == sources.size());
+
+    // position is indexed by in-order index of the node.
+    std::vector<uint32_t> position(sources.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      position[order[i].Middle()] = i;
+    }
+    FrozenTree tree;
+    tree.nodes_.reserve(order.size());
+    for (Range r : order) {
+      Node node{get_key(sources[r.Middle()]), {kNoNode, kNoNode}};
+      std::array<Range, 2> children = r.Children();
+      for (int dir = 0; dir < 2; dir++) {
+        if (!children[dir].empty()) {
+          node.children[dir] = position[children[dir].Middle()];
+        }
+      }
+      tree.nodes_.push_back(std::move(node));
+    }
+    return tree;
+  }
+
+  size_t size() const {
+    return nodes_.size();
+  }
+
+  // LowerBound returns smallest key that is >= given key, or nullptr
+  // if there is none.
+  const Key* LowerBound(const Key& key) const {
+    return Bound<false>(key);
+  }
+
+  // UpperBound returns smallest key that is > given key, or
+  // nullptr. I.e. it steps from found key to the next one.
+  const Key* UpperBound(const Key& key) const {
+    return Bound<true>(key);
+  }
+
+  // ValidateInvariants checks that in-order walk sees strictly
+  // increasing keys, that every node is reachable exactly once and
+  // that the tree is balanced, and aborts if not.
+  void ValidateInvariants() const {
+    std::vector<uint32_t> stack;
+    std::optional<Key> prev;
+    size_t seen = 0;
+    uint32_t i = nodes_.empty() ? kNoNode : 0;
+    while (i != kNoNode || !stack.empty()) {
+      while (i != kNoNode) {
+        stack.push_back(i);
+        if (stack.size() > static_cast<size_t>(std::bit_width(nodes_.size()))) {
+          fprintf(stderr, "FrozenTree: node %u is too deep\n", i);
+          abort();
+        }
+        i = nodes_[i].children[0];
+      }
+      i = stack.back();
+      stack.pop_back();
+      if (prev && !(*prev < nodes_[i].key)) {
+        fprintf(stderr, "FrozenTree: keys out of order at node %u\n", i);
+        abort();
+      }
+      prev.emplace(nodes_[i].key);
+      seen++;
+      i = nodes_[i].children[1];
+    }
+    if (seen != nodes_.size()) {
+      fprintf(stderr, "FrozenTree: reached %zu nodes out of %zu\n", seen, nodes_.size());
+      abort();
+    }
+  }
+
+  template <typename StatsT>
+  void AccountMemory(StatsT* stats) const {
+    stats->AddKeys(nodes_.size());
+    stats->AddNode(nodes_.capacity() * sizeof(Node), nodes_.size() * sizeof(Node));
+  }
+
+private:
+  static constexpr uint32_t kNoNode = ~uint32_t{0};
+
+  // Range is subtree of our balanced tree, which holds in-order
+  // nodes [begin, end). It's root is the middle one, and left and
+  // right children are ranges on either side of it. Left side is
+  // never smaller than the right, so height only depends on size.
+  struct Range {
+    uint32_t begin;
+    uint32_t end;
+
+    bool empty() const {
+      return begin == end;
+    }
+    uint32_t Middle() const {
+      return begin + (end - begin) / 2;
+    }
+    std::array<Range, 2> Children() const {
+      return {Range{begin, Middle()}, Range{Middle() + 1, end}};
+    }
+    uint32_t Height() const {
+      return std::bit_width(end - begin);
+    }
+  };
+
+  struct Node {
+    Key key;
+    uint32_t children[2];
+  };
+
+  void Prefetch(uint32_t i) const {
+    if (i != kNoNode) {
+      __builtin_prefetch(&nodes_[i]);
+    }
+  }
+
+  template <bool strict>
+  const Key* Bound(const Key& key) const {
+    const Key* best = nullptr;
+    uint32_t i = nodes_.empty() ? kNoNode : 0;
+    while (i != kNoNode) {
+      const Node& n = nodes_[i];
+      Prefetch(n.children[0]);
+      Prefetch(n.children[1]);
+      if (strict ? !(key < n.key) : n.key < key) {
+        i = n.children[1];
+      } else {
+        best = &n.key;
+        i = n.children[0];
+      }
+    }
+    return best;
+  }
+
+  // LayoutVEB appends top `levels' levels of subtree r to order, in
+  // van Emde Boas order. Subtrees just below those levels are
+  // appended to frontier (left to right), for the caller to lay
+  // out. Since the tree is balanced, recursion is only O(log log N)
+  // deep.
+  static void LayoutVEB(Range r, uint32_t levels,
+                        std::vector<Range>* order, std::vector<Range>* frontier) {
+    if (levels == 1) {
+      order->push_back(r);
+      for (Range child : r.Children()) {
+        if (!child.empty()) {
+          frontier->push_back(child);
+        }
+      }
+      return;
+    }
+    uint32_t top = levels / 2;
+    std::vector<Range> middle;
+    LayoutVEB(r, top, order, &middle);
+    for (Range m : middle) {
+      LayoutVEB(m, levels - top, order, frontier);
+    }
+  }
+
+  std::vector<Node> nodes_;
+};
+
+// FreezeOption is --freeze flag of our binary suffix tree programs. It
+// copies the built tree into contiguous FrozenTree and frees the
+// original. Lookups then go to the frozen copy.
+template <typename Key>
+class FreezeOption {
+public:
+  using Layout = typename FrozenTree<Key>::Layout;
+
+  // FromFlags consumes --freeze=bfs|veb flag.
+  static FreezeOption FromFlags(int* argc, char*** argv) {
+    FreezeOption rv;
+    std::optional<std::string_view> flag = ConsumeFlag(argc, argv, "--freeze");
+    if (flag && !(rv.layout_ = FrozenTree<Key>::ParseLayout(*flag))) {
+      fprintf(stderr, "--freeze can be one of the bfs or veb\n");
+      exit(1);
+    }
+    return rv;
+  }
+
+  // MaybeFreeze freezes the tree at root if --freeze was given (see
+  // FrozenTree::Freeze for get_* arguments), and then calls
+  // free_original.
+  template <typename Src, typename GetKey, typename GetLeft, typename GetRight, typename FreeOriginal>
+  void MaybeFreeze(const Src* root, const char* structure_name,
+                   GetKey&& get_key, GetLeft&& get_left, GetRight&& get_right,
+                   FreeOriginal&& free_original) {
+    if (!layout_) {
+      return;
+    }
+    MemoryStats frozen_stats;
+    frozen_.emplace(FrozenTree<Key>::Freeze(root, *layout_, get_key, get_left, get_right));
+#ifndef NDEBUG
+    frozen_->ValidateInvariants();
+#endif
+    if (MemoryStats::Enabled()) {
+      frozen_->AccountMemory(&frozen_stats);
+      frozen_stats.Print((std::string{"frozen "} + structure_name).c_str());
+    }
+    free_original();
+  }
+
+  // RunLookups runs --lookups benchmark against frozen copy, if we
+  // have one, or otherwise with given lookup function of the original
+  // tree.
+  template <typename LookupFn>
+  void RunLookups(std::string_view text, size_t num_lookups, LookupFn&& lookup) const {
+    if (!num_lookups) {
+      return;
+    }
+    if (!frozen_) {
+      ::RunLookups(text, num_lookups, lookup);
+      return;
+    }
+    ::RunLookups(text, num_lookups, [this] (std::string_view probe) {
+      const Key* key = frozen_->LowerBound(Key{probe});
+      return key && key->starts_with(probe);
+    });
+  }
+
+  // frozen returns the frozen copy, or nullptr if tree wasn't frozen.
+  const FrozenTree<Key>* frozen() const {
+    return frozen_ ? &*frozen_ : nullptr;
+  }
+
+private:
+  std::optional<Layout> layout_;
+  std::optional<FrozenTree<Key>> frozen_;
+};
+
+#endif  // FROZEN_TREE_H_
@@ -6,13 +6,21 @@ def gen!(b)
   programs = %w[trigram-index suffix-map
                 suffix-btree suffix-btree-persistent
                 suffix-avl suffix-avl-persistent
-                suffix-critbit-tree suffix-trie
+                suffix-critbit-tree suffix-trie suffix-trie-concurrent
                 suffix-splay suffix-splay-classic suffix-treap
                 coloring]
   programs.each do |name|
     extra_dep = if name == "suffix-btree" then [b.deps.absl_btree] else [] end
-    extra_hdr = if name == "suffix-critbit-tree" then ["critbit-tree.h"] else [] end
+    extra_hdr = if name == "suffix-critbit-tree" then ["critbit-tree.h", "compact-critbit-tree.h"] else [] end
     extra_hdr += if name == "coloring" then ["coloring-graph-src-inl.h"] else [] end
+    extra_hdr += if %w[suffix-map suffix-btree suffix-avl
+                       suffix-splay suffix-treap].include?(name) then ["prefixed-key.h"] else [] end
+    extra_hdr += if %w[suffix-avl suffix-splay suffix-treap].include?(name) then ["frozen-tree.h"] else [] end
+    pooled = %w[suffix-avl suffix-critbit-tree
+                suffix-splay suffix-splay-classic suffix-treap].include?(name)
+    extra_hdr += if pooled then ["node-pool.h"] else [] end
+    concurrent = %w[suffix-btree-persistent suffix-avl-persistent].include?(name)
+    extra_hdr += if concurrent || name == "suffix-trie-concurrent" then ["epoch.h"] else [] end
 
     # each of the "suffix index" programs have 2 variants. With
     # gperftools' tcmalloc and with system's native memory allocator.
@@ -27,6 +35,70 @@ def gen!(b)
                  srcs: [name + ".cc", "demo-helper.h"] + extra_hdr,
                  uses_roman_history: true,
                  no_windows: name == "coloring")
+
+    # Programs with fixed-size nodes have third variant. With tcmalloc
+    # and nodes allocated from node-pool.h slabs (and linked by 32-bit
+    # indices where program supports it).
+    if pooled
+      b.add_binary(name: name + "-pool",
+                   deps: [b.deps.cpu_profiler, b.deps.tcmalloc] + extra_dep,
+                   srcs: [name + ".cc", "demo-helper.h"] + extra_hdr,
+                   defines: ["WE_HAVE_TCMALLOC", "USE_NODE_POOL"],
+                   uses_roman_history: true)
+    end
+
+    # Persistent programs have variant with concurrent readers support
+    # (see --readers=N).
+    if concurrent
+      b.add_binary(name: name + "-concurrent",
+                   deps: [b.deps.cpu_profiler, b.deps.tcmalloc] + extra_dep,
+                   srcs: [name + ".cc", "demo-helper.h"] + extra_hdr,
+                   defines: ["WE_HAVE_TCMALLOC", "CONCURRENT_READERS"],
+                   uses_roman_history: true)
+    end
+
+    # Persistent btree has variant with key prefixes in internal nodes
+    # (see USE_BTREE_KEY_PREFIXES), which compares them with AVX2 where
+    # compiler supports it.
+    if name == "suffix-btree-persistent"
+      b.add_binary(name: name + "-prefixes",
+                   deps: [b.deps.cpu_profiler, b.deps.tcmalloc] + extra_dep,
+                   srcs: [name + ".cc", "demo-helper.h"] + extra_hdr,
+                   defines: ["WE_HAVE_TCMALLOC", "USE_BTREE_KEY_PREFIXES"],
+                   avx2: true,
+                   uses_roman_history: true)
+    end
+
+    # Critbit program has variant with array-based tree from
+    # compact-critbit-tree.h.
+    if name == "suffix-critbit-tree"
+      b.add_binary(name: name + "-compact",
+                   deps: [b.deps.cpu_profiler, b.deps.tcmalloc] + extra_dep,
+                   srcs: [name + ".cc", "demo-helper.h"] + extra_hdr,
+                   defines: ["WE_HAVE_TCMALLOC", "USE_COMPACT_CRITBIT"],
+                   uses_roman_history: true)
+      # And one where internal nodes cache leaf counts (see
+      # USE_CRITBIT_LEAF_COUNTS in critbit-tree.h).
+      b.add_binary(name: name + "-leaf-counts",
+                   deps: [b.deps.cpu_profiler, b.deps.tcmalloc] + extra_dep,
+                   srcs: [name + ".cc", "demo-helper.h"] + extra_hdr,
+                   defines: ["WE_HAVE_TCMALLOC", "USE_CRITBIT_LEAF_COUNTS"],
+                   uses_roman_history: true)
+    end
+
+    # Trie program has variants with adaptive radix tree style nodes
+    # and/or with nodes remembering key prefixes.
+    if name == "suffix-trie"
+      {"-art" => ["USE_ART_NODES"],
+       "-prefixes" => ["USE_STORED_PREFIXES"],
+       "-art-prefixes" => ["USE_ART_NODES", "USE_STORED_PREFIXES"]}.each do |suffix, defs|
+        b.add_binary(name: name + suffix,
+                     deps: [b.deps.cpu_profiler, b.deps.tcmalloc] + extra_dep,
+                     srcs: [name + ".cc", "demo-helper.h"] + extra_hdr,
+                     defines: ["WE_HAVE_TCMALLOC"] + defs,
+                     uses_roman_history: true)
+      end
+    end
   end
 
   begin
@@ -81,14 +153,32 @@ PROFILER_DEPS = select({
     "@bazel_tools//src/conditions:windows": [],
     "//conditions:default": ["@gperftools//:cpu_profiler"],
 })
+
+config_setting(
+    name = "x86_64",
+    constraint_values = ["@platforms//cpu:x86_64"],
+)
+
+config_setting(
+    name = "msvc_x86_64",
+    constraint_values = ["@platforms//cpu:x86_64"],
+    flag_values = {"@bazel_tools//tools/cpp:compiler": "msvc-cl"},
+)
+
+# For variants that have AVX2 code paths. They build fine without it.
+AVX2_COPTS = select({
+    ":msvc_x86_64": ["/arch:AVX2"],
+    ":x86_64": ["-mavx2"],
+    "//conditions:default": [],
+})
 HERE
   end
 
-  def add_binary(name:, srcs:, deps: nil, defines: nil, uses_roman_history: false, no_windows: false)
+  def add_binary(name:, srcs:, deps: nil, defines: nil, avx2: false, uses_roman_history: false, no_windows: false)
     puts "\ncc_binary("
     puts "    name = #{name.inspect},"
     puts "    srcs = #{srcs.inspect},"
-    puts "    copts = DEFAULT_COPTS,"
+    puts(avx2 ? "    copts = DEFAULT_COPTS + AVX2_COPTS," : "    copts = DEFAULT_COPTS,")
     
     if defines && !defines.empty?
       puts "    defines = #{defines.inspect},"
@@ -196,7 +286,7 @@ EXTRA_DIST = README.adoc LICENSE \
 HERE
   end
 
-  def print_prog_definition!(name:, srcs:, deps:, defines: [], uses_roman_history: false, no_windows: false)
+  def print_prog_definition!(name:, srcs:, deps:, defines: [], avx2: false, uses_roman_history: false, no_windows: false)
     u = name.gsub("-", "_")
     print_var!("#{u}_SOURCES", srcs)
     unless defines.empty?
@@ -206,10 +296,12 @@ HERE
     deps.delete :cpuprofiler
     unless deps.empty?
       cflags = deps.map {|d| "$(#{d}_CFLAGS)"}
+      cflags << "$(AVX2_CXXFLAGS)" if avx2
       libs = (deps + [:cpuprofiler]).map {|d| "$(#{d}_LIBS)"}
       print_var!("#{u}_CXXFLAGS", ["$(AM_CXXFLAGS)", *cflags])
       print_var!("#{u}_LDADD", libs)
     else
+      print_var!("#{u}_CXXFLAGS", ["$(AM_CXXFLAGS)", "$(AVX2_CXXFLAGS)"]) if avx2
       print_var!("#{u}_LDADD", ["$(cpuprofiler_LIBS)"])
     end
   end
@@ -257,9 +349,10 @@ class CompileCommandsGen
     @entries = []
   end
 
-  def add_binary(name:, srcs:, deps: nil, defines: nil, uses_roman_history: false, no_windows: false)
+  def add_binary(name:, srcs:, deps: nil, defines: nil, avx2: false, uses_roman_history: false, no_windows: false)
     return if name.end_with?("-sysmalloc") # want to index tcmalloc-ful compilations
     flags = (defines || []).map {|d| "-D#{d}"}
+    flags << "-mavx2" if avx2
     includes = %w[abseil-cpp+ gperftools+/src].map do |path_frag|
       "-Ibazel-gperftools-demo/external/#{path_frag}"
     end
@@ -301,13 +394,20 @@ class CMakeGen
     HERE
   end
 
-  def add_binary(name:, srcs:, deps: nil, defines: nil, uses_roman_history: false, no_windows: false)
+  def add_binary(name:, srcs:, deps: nil, defines: nil, avx2: false, uses_roman_history: false, no_windows: false)
     puts "\nadd_executable(#{name} #{srcs.join(' ')})"
 
     if defines && !defines.empty?
       puts "target_compile_definitions(#{name} PRIVATE #{defines.join(' ')})"
     end
 
+    if avx2
+      # See check_cxx_compiler_flag in CMakeLists.txt
+      puts "if(HAVE_MAVX2_FLAG)"
+      puts "  target_compile_options(#{name} PRIVATE -mavx2)"
+      puts "endif()"
+    end
+
     link_deps = (deps || []) + ["Threads::Threads"]
     puts "target_link_libraries(#{name} PRIVATE #{link_deps.join(' ')})"
   end
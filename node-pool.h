@@ -0,0 +1,210 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+#ifndef NODE_POOL_H_
+#define NODE_POOL_H_
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// NodePool is slab allocator for fixed-size tree nodes. Nodes are
+// carved out of slabs of kSlabSize nodes each, and are identified by
+// 32-bit index (slab number in upper bits and position in slab in
+// lower bits). Index 0 is never handed out, so it can serve as
+// nullptr.
+//
+// Pool is simply a set of static variables per node type, shared by
+// all trees with that node type (suffix-treap, for example, has
+// several live treaps with --shards and after Split). Which also
+// means that translating index into pointer is just one load from
+// static slab table. Nothing here is thread-safe.
+//
+// Freed nodes are kept on free list. And Clear releases all slabs at
+// once, without running any destructors. This is what gives us O(1)
+// (well, O(number of slabs)) teardown. But it drops nodes of every
+// tree of given type. So trees free their own nodes one by one, and
+// programs only drop entire pool explicitly at exit (see
+// e.g. Treap::ReleaseAll).
+//
+// Pool can be used in two ways. Either via indices (see PoolPtr
+// below) or via plain pointers (AllocateRaw/FreeRaw, handy for class
+// specific operator new/delete). Each mode has it's own free list, so
+// a type can use either (but see notes on Clear).
+template <typename T>
+class NodePool {
+public:
+  static constexpr int kSlabBits = 16;
+  static constexpr uint32_t kSlabSize = uint32_t{1} << kSlabBits;
+  static constexpr uint32_t kMaxSlabs = uint32_t{1} << (32 - kSlabBits);
+
+  static uint32_t Allocate() {
+    static_assert(sizeof(T) >= sizeof(uint32_t));
+    uint32_t idx = free_index_;
+    if (idx != 0) {
+      memcpy(&free_index_, static_cast<void*>(Get(idx)), sizeof(free_index_));
+      return idx;
+    }
+    return Carve();
+  }
+
+  static void Free(uint32_t idx) {
+    assert(idx != 0);
+    memcpy(static_cast<void*>(Get(idx)), &free_index_, sizeof(free_index_));
+    free_index_ = idx;
+  }
+
+  static T* Get(uint32_t idx) {
+    return slabs_[idx >> kSlabBits] + (idx & (kSlabSize - 1));
+  }
+
+  static void* AllocateRaw() {
+    static_assert(sizeof(T) >= sizeof(void*));
+    void* p = free_ptr_;
+    if (p != nullptr) {
+      memcpy(&free_ptr_, p, sizeof(free_ptr_));
+      return p;
+    }
+    return Get(Carve());
+  }
+
+  static void FreeRaw(void* p) {
+    memcpy(p, &free_ptr_, sizeof(free_ptr_));
+    free_ptr_ = p;
+  }
+
+  // Clear releases every slab. Note, destructors of live nodes are
+  // not run, so this is only suitable for nodes that own nothing
+  // other than (pooled) nodes.
+  static void Clear() {
+    for (T*& slab : slabs_) {
+      if (slab == nullptr) {
+        break;
+      }
+      (::operator delete)(slab);
+      slab = nullptr;
+    }
+    next_index_ = 1;
+    free_index_ = 0;
+    free_ptr_ = nullptr;
+  }
+
+  // AllocatedBytes is how much memory we've requested for our slabs.
+  static size_t AllocatedBytes() {
+    size_t slab_count = (next_index_ == 1) ? 0 : ((next_index_ - 1) >> kSlabBits) + 1;
+    return slab_count * kSlabSize * sizeof(T);
+  }
+
+private:
+  static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+
+  static uint32_t Carve() {
+    uint32_t idx = next_index_;
+    if (idx == 0) {
+      // We've wrapped around. I.e. all 2^32 - 1 indices are used up.
+      fprintf(stderr, "NodePool ran out of 32-bit node indices\n");
+      abort();
+    }
+    T*& slab = slabs_[idx >> kSlabBits];
+    if (slab == nullptr) {
+      slab = static_cast<T*>((::operator new)(sizeof(T) * kSlabSize));
+    }
+    next_index_ = idx + 1;
+    return idx;
+  }
+
+  static inline T* slabs_[kMaxSlabs];
+  static inline uint32_t next_index_ = 1;
+  static inline uint32_t free_index_ = 0;
+  static inline void* free_ptr_ = nullptr;
+};
+
+// PoolPtr is 32-bit "compressed" pointer to T allocated from
+// NodePool<T>. It converts to T* implicitly, so that read-only code
+// (lookups, validation) can deal with plain pointers. But links
+// between nodes have to be PoolPtr-s, so code that mutates tree
+// structure deals with PoolPtr-s (see NodeRef below).
+template <typename T>
+class PoolPtr {
+public:
+  PoolPtr() = default;
+  PoolPtr(std::nullptr_t) {}
+
+  template <typename... Args>
+  static PoolPtr Make(Args&&... args) {
+    PoolPtr p;
+    p.index_ = NodePool<T>::Allocate();
+    new (static_cast<void*>(p.Get())) T(std::forward<Args>(args)...);
+    return p;
+  }
+
+  void Destroy() {
+    Get()->~T();
+    NodePool<T>::Free(index_);
+  }
+
+  T* Get() const {
+    assert(index_ != 0);
+    return NodePool<T>::Get(index_);
+  }
+  T* operator->() const {
+    return Get();
+  }
+  T& operator*() const {
+    return *Get();
+  }
+
+  explicit operator bool() const {
+    return index_ != 0;
+  }
+  operator T*() const {
+    return index_ ? Get() : nullptr;
+  }
+
+  friend bool operator==(PoolPtr a, PoolPtr b) {
+    return a.index_ == b.index_;
+  }
+  friend bool operator==(PoolPtr a, std::nullptr_t) {
+    return a.index_ == 0;
+  }
+
+private:
+  uint32_t index_ = 0;
+};
+
+// Programs that support node pooling link their nodes via
+// NodeRef<Node> and create/destroy nodes via NewNode/DeleteNode
+// below. Normally it is just plain pointers and new/delete. Build with
+// -DUSE_NODE_POOL to have nodes allocated from NodePool and linked by
+// 32-bit indices.
+#ifndef USE_NODE_POOL
+#define USE_NODE_POOL 0
+#endif
+
+template <typename T>
+using NodeRef = std::conditional_t<USE_NODE_POOL, PoolPtr<T>, T*>;
+
+template <typename T, typename... Args>
+NodeRef<T> NewNode(Args&&... args) {
+  if constexpr (USE_NODE_POOL) {
+    return PoolPtr<T>::Make(std::forward<Args>(args)...);
+  } else {
+    return new T(std::forward<Args>(args)...);
+  }
+}
+
+template <typename T>
+void DeleteNode(T* p) {
+  delete p;
+}
+
+template <typename T>
+void DeleteNode(PoolPtr<T> p) {
+  p.Destroy();
+}
+
+#endif  // NODE_POOL_H_
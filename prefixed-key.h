@@ -0,0 +1,94 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+#ifndef PREFIXED_KEY_H_
+#define PREFIXED_KEY_H_
+#include <algorithm>
+#include <compare>
+#include <string_view>
+
+#include <stddef.h>
+#include <string.h>
+
+// PrefixedKey is a string_view key that also carries a copy of the
+// first kPrefixSize bytes of the string it points to. The idea is
+// that search tree nodes embed the key, so comparing against a node
+// compares the local prefix copy first, and only dereferences the
+// (likely not cached) text when prefixes are equal.
+//
+// Prefix is zero-padded when the string is shorter. This keeps
+// memcmp-ing prefixes consistent with string_view ordering: if
+// prefixes differ, strings compare the same way; if prefixes are
+// equal, we fall back to comparing the strings.
+//
+// PrefixedKey<0> is plain string_view with the same interface. This
+// lets programs switch prefix caching on and off at compile time (see
+// SuffixKey below).
+namespace detail {
+
+template <size_t kSize>
+struct KeyPrefixBytes {
+  char bytes[kSize];
+};
+
+template <>
+struct KeyPrefixBytes<0> {};
+
+}  // namespace detail
+
+template <size_t kPrefixSize>
+class PrefixedKey {
+public:
+  // Note, not explicit. We want keys to be constructible from
+  // string_views as easily as string_views are constructible from
+  // char pointers.
+  PrefixedKey(std::string_view data) : data_(data) {
+    if constexpr (kPrefixSize > 0) {
+      memset(prefix_.bytes, 0, kPrefixSize);
+      memcpy(prefix_.bytes, data.data(), std::min(data.size(), kPrefixSize));
+    }
+  }
+
+  std::string_view view() const { return data_; }
+
+  // string_view-like accessors, so code that deals with keys reads
+  // the same regardless of prefix caching.
+  const char* data() const { return data_.data(); }
+  size_t size() const { return data_.size(); }
+  bool starts_with(std::string_view prefix) const {
+    return data_.starts_with(prefix);
+  }
+
+  friend std::strong_ordering operator<=>(const PrefixedKey& a, const PrefixedKey& b) {
+    if constexpr (kPrefixSize > 0) {
+      int c = memcmp(a.prefix_.bytes, b.prefix_.bytes, kPrefixSize);
+      if (c != 0) {
+        return c <=> 0;
+      }
+      // Prefixes are equal. When both strings are at least as long
+      // as the prefix, we know first kPrefixSize bytes are equal and
+      // don't need to compare them again.
+      if (a.data_.size() >= kPrefixSize && b.data_.size() >= kPrefixSize) {
+        return a.data_.substr(kPrefixSize) <=> b.data_.substr(kPrefixSize);
+      }
+    }
+    return a.data_ <=> b.data_;
+  }
+
+  friend bool operator==(const PrefixedKey& a, const PrefixedKey& b) {
+    return a.data_ == b.data_;
+  }
+
+private:
+  std::string_view data_;
+  [[no_unique_address]] detail::KeyPrefixBytes<kPrefixSize> prefix_;
+};
+
+// Suffix programs use SuffixKey for keys stored in their
+// nodes. Build with -DUSE_LOCAL_DATA_PREFIX=1 to cache first 16 bytes
+// of each suffix inside the node.
+#ifndef USE_LOCAL_DATA_PREFIX
+#define USE_LOCAL_DATA_PREFIX 0
+#endif
+
+using SuffixKey = PrefixedKey<USE_LOCAL_DATA_PREFIX ? 16 : 0>;
+
+#endif  // PREFIXED_KEY_H_
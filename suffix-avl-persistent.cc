@@ -1,13 +1,28 @@
 // -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
 #include <algorithm>
+#include <atomic>
 #include <optional>
+#include <span>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include <assert.h>
 #include <stdio.h>
 
 #include "demo-helper.h"
+#include "epoch.h"
+
+#ifndef ENABLE_AVL_FASTPATH
+#define ENABLE_AVL_FASTPATH 1
+#endif
+
+// With CONCURRENT_READERS, other threads can grab published versions
+// of the tree (see AVLTree::Publish and AVLTree::Snapshot) while main
+// thread keeps inserting. Refcounting becomes atomic then.
+#ifndef CONCURRENT_READERS
+#define CONCURRENT_READERS 0
+#endif
 
 struct Node;
 
@@ -38,17 +53,29 @@ public:
   explicit operator bool() const {
     return ptr_ != nullptr;
   }
+
+  // Makes us point to p instead. Only used by insertion fast-path
+  // on links inside unshared nodes (or root).
+  void Reset(const Node* p) {
+    IncRef(p);
+    DecRef(ptr_);
+    ptr_ = p;
+  }
+
+  NodePtr& operator=(const NodePtr&) = delete;
 private:
   static void IncRef(const Node* p);
   static void DecRef(const Node* p);
-  const Node* const ptr_;
+  const Node* ptr_;
 };
 
 struct Node {
-  mutable int refcount{};
-  const int height;
-  const NodePtr left;
-  const NodePtr right;
+  mutable int refcount{}; // see LoadRefCount
+  // height and links are only mutated by insertion fast-path, which
+  // updates nodes that aren't shared.
+  mutable int height;
+  mutable NodePtr left;
+  mutable NodePtr right;
 
   const std::string_view value;
 
@@ -73,6 +100,15 @@ struct Node {
     return value < this->value;
   }
 
+  // With CONCURRENT_READERS refcount is accessed atomically (via
+  // atomic_ref, so that layout is same in both modes).
+  int LoadRefCount() const {
+    if (CONCURRENT_READERS) {
+      return std::atomic_ref<int>(refcount).load(std::memory_order_acquire);
+    }
+    return refcount;
+  }
+
   const Node* RawLeft() const {
     return left.Get();
   }
@@ -169,16 +205,31 @@ struct Node {
 };
 
 void NodePtr::IncRef(const Node* p) {
-  if (p) { p->refcount++; }
+  if (!p) return;
+  if (CONCURRENT_READERS) {
+    std::atomic_ref<int>(p->refcount).fetch_add(1, std::memory_order_relaxed);
+  } else {
+    p->refcount++;
+  }
 }
 void NodePtr::DecRef(const Node* p) {
   if (!p) return;
-  if (--p->refcount == 0) {
+  int prev;
+  if (CONCURRENT_READERS) {
+    prev = std::atomic_ref<int>(p->refcount).fetch_sub(1, std::memory_order_acq_rel);
+  } else {
+    prev = p->refcount--;
+  }
+  if (prev == 1) {
     delete p;
   }
 }
 
 struct AVLTree {
+  // AVL tree of height h has at least Fib(h+2)-1 nodes. So 64 levels
+  // is way more than enough for any tree that fits into memory.
+  static constexpr int kMaxHeight = 64;
+
   std::optional<NodePtr> root;
 
   void Insert(std::string_view value) {
@@ -205,8 +256,59 @@ struct AVLTree {
         }
         return Node::MakeAndRebalance(left, node->value, right);
       }
+
+      // TryFastPath handles the (very common) case of all nodes on
+      // the path having refcount of 1. I.e. when we're the only owner
+      // of them. Then we link new leaf in place and walk back up
+      // updating heights, until height doesn't change. At most one
+      // node needs rebalancing, and we only rebuild it's subtree
+      // (which allocates at most 3 nodes). Rebalanced subtree has the
+      // same height as before insertion, so nothing above it changes
+      // either. Returns false if it found shared node, and then
+      // nothing is changed and caller does regular path-copying
+      // insertion.
+      static bool TryFastPath(NodePtr* place, std::string_view value) {
+        // path[i] is link to i-th node on the path from root (first
+        // one being root itself).
+        NodePtr* path[kMaxHeight];
+        int depth = 0;
+        while (*place) {
+          const Node* node = place->Get();
+          if (node->LoadRefCount() != 1) {
+            return false;
+          }
+          assert(depth < kMaxHeight);
+          path[depth++] = place;
+          place = node->GreaterThan(value) ? &node->left : &node->right;
+        }
+
+        place->Reset(new Node(value));
+
+        while (depth > 0) {
+          NodePtr* link = path[--depth];
+          const Node* node = link->Get();
+          int height = std::max(Node::HeightOf(node->RawLeft()), Node::HeightOf(node->RawRight())) + 1;
+          if (height == node->height) {
+            break;
+          }
+          if (abs(Node::BalanceOf(node->RawLeft(), node->RawRight())) == 2) {
+            int old_height = node->height; (void)old_height;
+            link->Reset(Node::MakeAndRebalance(node->RawLeft(), node->value, node->RawRight()));
+            assert(link->Get()->height == old_height);
+            break;
+          }
+          node->height = height;
+        }
+        return true;
+      }
     };
 
+#if ENABLE_AVL_FASTPATH
+    if (R::TryFastPath(&*root, value)) {
+      return;
+    }
+#endif
+
     root.emplace(R::Rec(root->Get(), value));
   }
 
@@ -232,8 +334,8 @@ struct AVLTree {
         total_height += depth;
         node_count += 1;
 
-        assert(node->refcount > 0);
-        if (node->refcount < 1) { abort(); }
+        assert(node->LoadRefCount() > 0);
+        if (node->LoadRefCount() < 1) { abort(); }
 
         int left_height = Rec(node->RawLeft(), depth + 1);
 
@@ -274,15 +376,36 @@ struct AVLTree {
     return root;
   }
 
+  void AccountMemory(MemoryStats* stats) const {
+    // Note, we only keep latest version of the tree, so nodes are
+    // never shared and we're not at risk of double-counting.
+    struct R {
+      static void Rec(const Node* node, MemoryStats* stats) {
+        if (!node) {
+          return;
+        }
+        stats->AddKeys(1);
+        stats->AddNode(sizeof(Node));
+        Rec(node->RawLeft(), stats);
+        Rec(node->RawRight(), stats);
+      }
+    };
+    if (root) {
+      R::Rec(root->Get(), stats);
+    }
+  }
+
   // We find smallest node that is >= than given string, or nullptr if
   // everything is smaller than str.
   const Node* LowerBound(std::string_view str) {
     if (!root) {
       return nullptr;
     }
-    const Node* node = root->Get();
+    return LowerBound(root->Get(), str);
+  }
 
-    const Node* best = node->value >= str ? node : nullptr;
+  static const Node* LowerBound(const Node* node, std::string_view str) {
+    const Node* best = (node && node->value >= str) ? node : nullptr;
     while (node) {
       if (node->value < str) {
         node = node->RawRight();
@@ -294,9 +417,246 @@ struct AVLTree {
     return best;
   }
 
+  // Diff calls fn(key, added) for every key that is only in one of
+  // the given versions (added is true for keys that are only in
+  // new_root's version). Subtrees that are shared by both versions
+  // are skipped without looking inside, so cost is proportional to
+  // how much versions differ, not to their size.
+  template <typename Fn>
+  static void Diff(const Node* old_root, const Node* new_root, Fn fn) {
+    // We walk both versions in order, as stacks of pending items
+    // (either a key or an entire subtree). Subtree gets expanded only
+    // when it is not the same subtree as on the other side. We always
+    // expand the taller one, so that shared subtrees get a chance to
+    // meet.
+    struct Item {
+      const Node* node; // nullptr for keys
+      std::string_view key;
+    };
+    struct Stack {
+      std::vector<Item> items;
+
+      explicit Stack(const Node* root) {
+        if (root) {
+          items.push_back(Item{root, {}});
+        }
+      }
+
+      void Expand() {
+        const Node* n = items.back().node;
+        items.pop_back();
+        if (n->RawRight()) {
+          items.push_back(Item{n->RawRight(), {}});
+        }
+        items.push_back(Item{nullptr, n->value});
+        if (n->RawLeft()) {
+          items.push_back(Item{n->RawLeft(), {}});
+        }
+      }
+    };
+
+    Stack a{old_root};
+    Stack b{new_root};
+    while (!a.items.empty() && !b.items.empty()) {
+      const Item& x = a.items.back();
+      const Item& y = b.items.back();
+      if (x.node && x.node == y.node) {
+        a.items.pop_back();
+        b.items.pop_back();
+      } else if (x.node && (!y.node || x.node->height >= y.node->height)) {
+        a.Expand();
+      } else if (y.node) {
+        b.Expand();
+      } else if (x.key < y.key) {
+        fn(x.key, false);
+        a.items.pop_back();
+      } else if (y.key < x.key) {
+        fn(y.key, true);
+        b.items.pop_back();
+      } else {
+        a.items.pop_back();
+        b.items.pop_back();
+      }
+    }
+    while (!a.items.empty()) {
+      if (a.items.back().node) {
+        a.Expand();
+      } else {
+        fn(a.items.back().key, false);
+        a.items.pop_back();
+      }
+    }
+    while (!b.items.empty()) {
+      if (b.items.back().node) {
+        b.Expand();
+      } else {
+        fn(b.items.back().key, true);
+        b.items.pop_back();
+      }
+    }
+  }
+
+  // Split and Join are the usual building blocks of bulk operations
+  // on balanced trees. Just like elsewhere, they take and return
+  // naked pointers. Nodes passed in must be kept alive by the caller,
+  // and returned nodes may be fresh (with refcount of 0).
+  struct SplitRes {
+    const Node* left;
+    bool found;
+    const Node* right;
+  };
+
+  // Split returns trees of keys that are less than and greater than
+  // given key, and whether key itself was there. Only nodes on the
+  // path to key are rebuilt, everything hanging off the path is
+  // shared.
+  static SplitRes Split(const Node* node, std::string_view key) {
+    if (!node) {
+      return {nullptr, false, nullptr};
+    }
+    if (node->value == key) {
+      return {node->RawLeft(), true, node->RawRight()};
+    }
+    if (node->GreaterThan(key)) {
+      SplitRes res = Split(node->RawLeft(), key);
+      return {res.left, res.found, Join(res.right, node->value, node->RawRight())};
+    }
+    SplitRes res = Split(node->RawRight(), key);
+    return {Join(node->RawLeft(), node->value, res.left), res.found, res.right};
+  }
+
+  // Join builds tree out of left, key and right, assuming all keys in
+  // left are less than key and all keys in right are greater. It is
+  // O(height difference): we walk down the spine of the taller tree
+  // until heights match, and rebalance on the way back up.
+  static const Node* Join(const Node* left, std::string_view key, const Node* right) {
+    int diff = Node::BalanceOf(left, right);
+    if (abs(diff) < 2) {
+      return new Node(left, key, right);
+    }
+    // We rebuild taller tree's root, which may be fresh (e.g. we're
+    // called from Union). So hold it for cleanup.
+    if (diff < 0) {
+      NodePtr holder{left};
+      return Node::MakeAndRebalance(left->RawLeft(), left->value, Join(left->RawRight(), key, right));
+    }
+    NodePtr holder{right};
+    return Node::MakeAndRebalance(Join(left, key, right->RawLeft()), right->value, right->RawRight());
+  }
+
+  // Union returns version with keys of both given versions. We split
+  // b by a's root key and recurse, so when a and b share structure,
+  // Split(b) returns a's subtrees as-is and recursion stops at those
+  // (see a == b check). I.e. cost is proportional to how much
+  // versions differ. Note, result may be one of given nodes.
+  static const Node* Union(const Node* a, const Node* b) {
+    if (a == b || !b) {
+      return a;
+    }
+    if (!a) {
+      return b;
+    }
+    SplitRes split = Split(b, a->value);
+    NodePtr left_holder{split.left};
+    NodePtr right_holder{split.right};
+    return Join(Union(a->RawLeft(), split.left), a->value, Union(a->RawRight(), split.right));
+  }
+
+#if CONCURRENT_READERS
+  // Publish makes current version of the tree visible to Snapshot
+  // callers. Only the (single) writer thread calls it.
+  void Publish() {
+    const NodePtr* p = root ? new NodePtr(*root) : nullptr;
+    const NodePtr* old = published_.exchange(p);
+    if (old) {
+      // Some reader might have just loaded old pointer and is about
+      // to grab reference. So we defer dropping published reference
+      // to the old version.
+      epoch_.Retire([old] () { delete old; });
+    }
+    epoch_.Reclaim();
+  }
+
+  // Snapshot returns reference to last published version of the
+  // tree (empty NodePtr if nothing is published yet). Any thread can
+  // call it, and the version stays intact for as long as caller holds
+  // the reference. Lock-free.
+  NodePtr Snapshot() {
+    EpochDomain::Guard g{&epoch_};
+    const NodePtr* p = published_.load();
+    return p ? NodePtr{*p} : NodePtr{};
+  }
+
+  ~AVLTree() {
+    delete published_.load();
+  }
+
+private:
+  // published_ owns it's own reference to published version. Older
+  // versions are released via epoch_, once readers are done
+  // grabbing them.
+  std::atomic<const NodePtr*> published_{nullptr};
+  EpochDomain epoch_;
+#endif
 };
 
+#ifndef NDEBUG
+// CheckDiffAndUnion builds a couple of versions out of suffixes of
+// s (given tree must have all of them) and checks Diff and Union of
+// those.
+void CheckDiffAndUnion(const AVLTree& tree, std::string_view s) {
+  auto diff_size = [] (const Node* a, const Node* b) -> size_t {
+    size_t count = 0;
+    AVLTree::Diff(a, b, [&count] (std::string_view, bool) { count++; });
+    return count;
+  };
+
+  // odd has suffixes at odd positions and even at even ones.
+  AVLTree odd;
+  AVLTree even;
+  for (int pos = s.size() - 1; pos >= 0; pos--) {
+    ((pos % 2) ? odd : even).Insert(s.substr(pos));
+  }
+  odd.Validate(false);
+  even.Validate(false);
+
+  size_t added = 0;
+  AVLTree::Diff(odd.root->Get(), tree.root->Get(), [&] (std::string_view key, bool is_added) {
+    assert(is_added && (key.data() - s.data()) % 2 == 0);
+    added++;
+  });
+  assert(added == (s.size() + 1) / 2);
+  assert(diff_size(odd.root->Get(), even.root->Get()) == s.size());
+  assert(diff_size(tree.root->Get(), tree.root->Get()) == 0);
+
+  AVLTree merged;
+  merged.root.emplace(AVLTree::Union(odd.root->Get(), even.root->Get()));
+  merged.Validate(false);
+  assert(diff_size(merged.root->Get(), tree.root->Get()) == 0);
+
+  // Small change on top of big tree. Diff and Union only deal with
+  // changed paths.
+  AVLTree changed;
+  changed.root.emplace(*tree.root);
+  changed.Insert("the Roman Empire, abridged");
+  changed.Insert("the Roman Empire, revised");
+  assert(diff_size(tree.root->Get(), changed.root->Get()) == 2);
+  merged.root.emplace(AVLTree::Union(tree.root->Get(), changed.root->Get()));
+  merged.Validate(false);
+  assert(diff_size(merged.root->Get(), changed.root->Get()) == 0);
+
+  printf("diff and union checks passed\n");
+}
+#endif
+
 int main(int argc, char** argv) {
+  std::optional<std::string_view> readers_flag = ConsumeFlag(&argc, &argv, "--readers");
+  int num_readers = readers_flag ? atoi(std::string{*readers_flag}.c_str()) : 0;
+  if (num_readers && !CONCURRENT_READERS) {
+    fprintf(stderr, "--readers=N requires build with CONCURRENT_READERS (see -concurrent variant)\n");
+    exit(1);
+  }
+
   AVLTree locations; // Note, we want this destructor to run after
                      // we've dumped heap sample
 
@@ -306,12 +666,38 @@ int main(int argc, char** argv) {
   AtomicFlag stop_req;
   auto sigint_cleanup = SignalHelper::OnSIGINT(&stop_req);
 
+#if CONCURRENT_READERS
+  // Readers look up random substrings in whatever version is
+  // published while we keep inserting. We publish new version every
+  // kPublishInterval insertions.
+  static constexpr size_t kPublishInterval = 1024;
+  std::optional<ConcurrentReaders> readers;
+  if (num_readers) {
+    readers.emplace(num_readers, s, [&locations] (std::span<const std::string_view> probes) -> size_t {
+      NodePtr snapshot = locations.Snapshot();
+      size_t hits = 0;
+      for (std::string_view probe : probes) {
+        const Node* it = AVLTree::LowerBound(snapshot.Get(), probe);
+        assert(!it || it->value >= probe);
+        hits += (it && it->value.starts_with(probe));
+      }
+      return hits;
+    });
+  }
+#endif
+
+  MemoryStats memory_stats;
   for (int pos = s.size() - 1; pos >= 0; pos--) {
     locations.Insert(std::string_view{s}.substr(pos));
     if (stop_req) {
       fprintf(stderr, "interrupted insertions by seeing SIGINT\n");
       break;
     }
+#if CONCURRENT_READERS
+    if (num_readers && (s.size() - pos) % kPublishInterval == 0) {
+      locations.Publish();
+    }
+#endif
 #ifndef NDEBUG
     size_t num_inserted = s.size() - pos;
     // We want to validate often when we're at small tree, but
@@ -323,10 +709,25 @@ int main(int argc, char** argv) {
 #endif
   }
 
+#if CONCURRENT_READERS
+  if (readers) {
+    locations.Publish();
+    readers->Stop();
+  }
+#endif
+
 #ifndef NDEBUG
   locations.Validate(true);
+  if (!stop_req) {
+    CheckDiffAndUnion(locations, s);
+  }
 #endif
 
+  if (MemoryStats::Enabled()) {
+    locations.AccountMemory(&memory_stats);
+    memory_stats.Print("persistent AVL tree");
+  }
+
   printf("AVL tree height = %d\n", locations.root.value()->height);
 
   const Node* it = locations.LowerBound("the Roman Empire");
@@ -7,10 +7,9 @@
 #include <stdio.h>
 
 #include "demo-helper.h"
-
-#ifndef USE_LOCAL_DATA_PREFIX
-#define USE_LOCAL_DATA_PREFIX 0
-#endif
+#include "frozen-tree.h"
+#include "node-pool.h"
+#include "prefixed-key.h"
 
 namespace avl {
 
@@ -361,32 +360,17 @@ void tree_path::swap_grand_child(int idx) {
 }  // namespace avl
 
 struct Node : public avl::node {
-  const std::string_view data;
-
-#if USE_LOCAL_DATA_PREFIX
-  char local_data_prefix[16];
-#endif
+  // Note, with USE_LOCAL_DATA_PREFIX we place first 16 bytes of the
+  // suffix into the node. See prefixed-key.h.
+  const SuffixKey data;
 
   Node(std::string_view data) : data(data) {
     this->childs[0] = this->childs[1] = nullptr;
     this->balance = 0;
-#if USE_LOCAL_DATA_PREFIX
-    memset(local_data_prefix, 0, sizeof(local_data_prefix));
-    memcpy(local_data_prefix, data.data(), std::min(data.size(), sizeof(local_data_prefix)));
-#endif
   }
 
   bool LessThan(const Node* other) const {
-#if USE_LOCAL_DATA_PREFIX
-    int c = memcmp(local_data_prefix, other->local_data_prefix, sizeof(local_data_prefix));
-    if (c != 0) {
-      return (c < 0);
-    } else {
-      return data < other->data;
-    }
-#else
     return data < other->data;
-#endif
   }
 
   const Node* GetLeft() const {
@@ -406,6 +390,19 @@ struct Node : public avl::node {
     delete GetLeft();
     delete GetRight();
   }
+
+#if USE_NODE_POOL
+  // avl:: code links nodes by plain pointers, so we don't get
+  // compressed links here. But we still get cheap slab allocation and
+  // O(1) teardown (see main).
+  static void* operator new([[maybe_unused]] size_t size) {
+    assert(size == sizeof(Node));
+    return NodePool<Node>::AllocateRaw();
+  }
+  static void operator delete(void* p) {
+    NodePool<Node>::FreeRaw(p);
+  }
+#endif
 };
 
 using Tree = std::unique_ptr<Node>;
@@ -443,9 +440,10 @@ void Insert(Tree* tree, std::string_view data) {
 // We find smallest node that is >= than given string, or nullptr if
 // everything is smaller than str.
 const Node* LowerBound(const Node* root, std::string_view str) {
-  const Node* best = (root && root->data >= str) ? root : nullptr;
+  const SuffixKey key{str};
+  const Node* best = (root && root->data >= key) ? root : nullptr;
   while (root) {
-    if (root->data < str) {
+    if (root->data < key) {
       root = root->GetRight();
     } else {
       best = root;
@@ -455,9 +453,20 @@ const Node* LowerBound(const Node* root, std::string_view str) {
   return best;
 }
 
+void AccountMemory(const Node* node, MemoryStats* stats) {
+  // Recursion is fine, since AVL trees are balanced.
+  if (!node) {
+    return;
+  }
+  stats->AddKeys(1);
+  stats->AddNode(sizeof(Node));
+  AccountMemory(node->GetLeft(), stats);
+  AccountMemory(node->GetRight(), stats);
+}
+
 void Validate(const Node* node) {
   struct Checker {
-    std::optional<std::string_view> prev_seen;
+    std::optional<SuffixKey> prev_seen;
 
     // Checking node's subtree returns it's height
     int Rec(const Node* node) {
@@ -492,6 +501,10 @@ void Validate(const Node* node) {
 }
 
 int main(int argc, char** argv) {
+  std::optional<std::string_view> lookups_flag = ConsumeFlag(&argc, &argv, "--lookups");
+  size_t num_lookups = lookups_flag ? strtoull(std::string{*lookups_flag}.c_str(), nullptr, 10) : 0;
+  auto freeze = FreezeOption<SuffixKey>::FromFlags(&argc, &argv);
+
   // NOTE, we want this to be destroyed after heap sample dump we
   // setup just below.
   Tree locations;
@@ -502,6 +515,7 @@ int main(int argc, char** argv) {
   AtomicFlag stop_req;
   auto sigint_cleanup = SignalHelper::OnSIGINT(&stop_req);
 
+  MemoryStats memory_stats;
   for (int pos = s.size() - 1; pos >= 0; pos--) {
     Insert(&locations, std::string_view{s}.substr(pos));
     if (stop_req) {
@@ -514,16 +528,48 @@ int main(int argc, char** argv) {
   Validate(locations.get());
 #endif
 
-  auto it = LowerBound(locations.get(), "the Roman Empire");
-  if (!it) {
+  if (MemoryStats::Enabled()) {
+    AccountMemory(locations.get(), &memory_stats);
+    memory_stats.Print("AVL tree");
+  }
+
+  freeze.MaybeFreeze(
+    static_cast<const Node*>(locations.get()), "AVL tree",
+    [] (const Node* n) -> const SuffixKey& { return n->data; },
+    [] (const Node* n) { return n->GetLeft(); },
+    [] (const Node* n) { return n->GetRight(); },
+    [&] () { locations.reset(); });
+  const FrozenTree<SuffixKey>* frozen = freeze.frozen();
+
+  freeze.RunLookups(s, num_lookups, [&] (std::string_view probe) {
+    const Node* it = LowerBound(locations.get(), probe);
+    return it && it->data.starts_with(probe);
+  });
+
+  const SuffixKey* found;
+  if (frozen) {
+    found = frozen->LowerBound(SuffixKey{"the Roman Empire"});
+  } else {
+    const Node* it = LowerBound(locations.get(), "the Roman Empire");
+    found = it ? &it->data : nullptr;
+  }
+  if (!found) {
     printf("failed to find lower bound\n");
     abort();
   }
-  assert(it != nullptr);
 
-  size_t off = it->data.data() - s.data();
+  size_t off = found->data() - s.data();
   printf("off = %zu\n", off);
 
   printf("context of last(ish) occurrence of 'the Roman Empire':\n");
   PrintOccurenceContext(s, off);
+
+  if (USE_NODE_POOL) {
+    // Nodes don't own anything but other nodes, so instead of
+    // recursively deleting them, we drop entire pool at once. But
+    // heap sample has to see populated tree first.
+    sampling_cleanup.DumpHeapSampleNow();
+    (void)locations.release();
+    NodePool<Node>::Clear();
+  }
 }
@@ -1,26 +1,76 @@
 // -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
 #include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
 #include <new>
 #include <optional>
+#include <random>
 #include <span>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "demo-helper.h"
+#include "epoch.h"
 
 #ifndef ENABLE_BTREE_FASTPATH
 #define ENABLE_BTREE_FASTPATH 1
 #endif
 
-struct Node;
+// With CONCURRENT_READERS, other threads can grab published versions
+// of the tree (see BTree::Publish and BTree::Snapshot) while main
+// thread keeps inserting. Which makes refcounting atomic, since
+// readers drop their references from their own threads.
+#ifndef CONCURRENT_READERS
+#define CONCURRENT_READERS 0
+#endif
+
+// With USE_BTREE_KEY_PREFIXES internal nodes also keep first 8 bytes
+// of every key packed into a number (see KeyPrefix below), in a
+// separate array. FindInsertPos then counts how many of those numbers
+// are smaller than (or equal to) value's. Which is a couple of SIMD
+// compares when built with AVX2. And only keys with the same first 8
+// bytes as value need actual string comparisons (i.e. touching the
+// text, which is likely a cache miss).
+//
+// Leaves hold runs of adjacent suffixes, which mostly share their
+// first 8 bytes, so prefixes don't help there and we don't keep them
+// (saving us from copying them on every insertion).
+#ifndef USE_BTREE_KEY_PREFIXES
+#define USE_BTREE_KEY_PREFIXES 0
+#endif
+
+// Node geometry (see Node below) is a template parameter of all our
+// btree types. kDefaultNodeWidth is what the program uses, and
+// --sweep-widths benchmarks a bunch of other widths.
+static constexpr int kDefaultNodeWidth = 19;
+
+template <int kWidthParam> struct Node;
 
 // NodePtr is our refcounted smart pointer to Node. Similar to
 // shared_ptr, but a) immutable and non-null b) uses non-atomic ops
-// for refcounting
+// for refcounting (unless CONCURRENT_READERS is set)
+template <int kWidthParam>
 class NodePtr {
+  using Node = ::Node<kWidthParam>;
 public:
   explicit NodePtr(const Node* p) : ptr_(p) {
     IncRef(ptr_);
@@ -52,10 +102,11 @@ private:
 // happens, we can use this struct to return both leaf "halves" and
 // separation key. Similarly, when dealing with internal nodes, child
 // split adds a key, and may require internal node split.
+template <int kWidthParam>
 struct SplitRes {
-  const Node* left;
+  const Node<kWidthParam>* left;
   std::string_view key;
-  const Node* right;
+  const Node<kWidthParam>* right;
 };
 
 // Our nodes are logically immutable, and to help us construct nodes
@@ -115,8 +166,68 @@ struct ReplaceOp {
   }
 };
 
+// EraseOp holds one list of elements and position. And describes list
+// of elements with element at given position removed.
+template <typename A>
+struct EraseOp {
+  const A& elements;
+  const size_t pos;
+
+  EraseOp(const A& elements, size_t pos) : elements(elements), pos(pos) {}
+
+  decltype(auto) operator[](size_t i) const {
+    return elements[i < pos ? i : i + 1];
+  }
+
+  size_t size() const {
+    return elements.size() - 1;
+  }
+};
+
+// ConcatOp holds two lists of elements. And describes list of elements
+// of the first list followed by elements of the second list.
+template <typename A, typename B>
+struct ConcatOp {
+  const A& first;
+  const B& second;
+
+  ConcatOp(const A& first, const B& second) : first(first), second(second) {}
+
+  decltype(auto) operator[](size_t i) const {
+    if (i < first.size()) {
+      return first[i];
+    }
+    return second[i - first.size()];
+  }
+
+  size_t size() const {
+    return first.size() + second.size();
+  }
+};
+
 }  // namespace span_ops
 
+// KeyPrefix returns first 8 bytes of str (zero-padded if str is
+// shorter) as big-endian number with top bit flipped. So comparing
+// prefixes as signed numbers (which is what SIMD compares do) is the
+// same as comparing those bytes. When prefixes differ, strings compare
+// the same way, and when they're equal we need to compare strings.
+//
+// Without USE_BTREE_KEY_PREFIXES it is just 0 and doesn't touch the
+// string.
+inline int64_t KeyPrefix(std::string_view str) {
+  if (!USE_BTREE_KEY_PREFIXES) {
+    return 0;
+  }
+  unsigned char bytes[8] = {};
+  memcpy(bytes, str.data(), std::min<size_t>(str.size(), 8));
+  uint64_t rv = 0;
+  for (unsigned char b : bytes) {
+    rv = (rv << 8) | b;
+  }
+  return static_cast<int64_t>(rv ^ (uint64_t{1} << 63));
+}
+
 // Node is our refcounted immutable internal or leaf btree node.
 // Internal nodes contain up to kWidth keys and kWidth + 1 child
 // pointers. Leaf nodes contain up to kLeafWidth keys. Actual number
@@ -130,8 +241,17 @@ struct ReplaceOp {
 //
 // Another usual property of those nodes is that (other than for root
 // node) size is at least half of max. possible width.
+//
+// kWidth is a template parameter. Wider nodes mean shorter trees
+// (fewer cache misses per search), but more copying for every
+// insertion (which copies a leaf). See --sweep-widths.
+template <int kWidthParam>
 struct Node {
-  static constexpr int kWidth = 19;
+  using NodePtr = ::NodePtr<kWidthParam>;
+  using SplitRes = ::SplitRes<kWidthParam>;
+
+  static constexpr int kWidth = kWidthParam;
+  static_assert(kWidth >= 3);
   static constexpr int kInternalPointersOffset =
     kWidth * sizeof(std::string_view);
   static constexpr int kInternalSize =
@@ -140,15 +260,41 @@ struct Node {
   static constexpr int kLeafWidth =
     kInternalSize / sizeof(std::string_view);
 
-  mutable int refcount;
-  const int size;
+  // Minimum sizes of non-root nodes. Those are sizes of halves we get
+  // when splitting full node. Note, node one key short of minimum,
+  // merged with minimum-sized sibling and separator key, fits into
+  // one node.
+  static constexpr int kMinLeafSize = (kLeafWidth - 1) / 2;
+  static constexpr int kMinInternalSize = (kWidth - 1) / 2;
+
+  // Number of key prefixes we have room for. Only internal nodes keep
+  // prefixes, see USE_BTREE_KEY_PREFIXES above. Rounded up to whole
+  // 4-element (AVX2) vectors.
+  static constexpr int kPrefixSlots = (kWidth + 3) / 4 * 4;
+
+  mutable int refcount; // see LoadRefCount
+  // size is only changed by in-place operations below (see
+  // BTree::Transient).
+  int size;
   const bool is_leaf;
+  // subtree_size is number of keys in entire subtree. It is only
+  // mutated by insertion/erase fast-paths and transients, which
+  // update nodes that aren't shared.
+  mutable size_t subtree_size;
 
 private:
   // storage is where we're constructing our array of keys and array
   // of child NodePtr.
   alignas(std::string_view) char storage[kInternalSize];
 
+#if USE_BTREE_KEY_PREFIXES
+  // key_prefixes[i] is KeyPrefix of i-th key (internal nodes
+  // only). Slots past size up to whole vector are padded with
+  // INT64_MAX. It is last member, so that leaves are allocated
+  // without it (see AllocSize).
+  int64_t key_prefixes[kPrefixSlots];
+#endif
+
   // Keys are stored first in the storage
   const std::string_view* GetKeysStorage() const {
     return reinterpret_cast<const std::string_view*>(storage);
@@ -162,7 +308,7 @@ private:
 
   // Real constructors are MakeXYZ static methods below. This only
   // constructs "trivial" members.
-  Node(int size, bool is_leaf) : refcount(0), size(size), is_leaf(is_leaf) {
+  Node(int size, bool is_leaf) : refcount(0), size(size), is_leaf(is_leaf), subtree_size(size) {
     assert(size > 0);
     if (is_leaf) {
       assert(size <= kLeafWidth);
@@ -171,8 +317,56 @@ private:
     }
   }
 
-  friend class NodePtr;
+  // InitKeys copies keys (and their prefixes) into newly created
+  // node.
+  template <typename KeysT, typename PrefixesT>
+  void InitKeys(const KeysT& keys, [[maybe_unused]] const PrefixesT& prefixes) {
+    assert(keys.size() == static_cast<size_t>(size));
+    std::string_view* kp = const_cast<std::string_view*>(GetKeysStorage());
+    for (int i = 0; i < size; i++) {
+      new (static_cast<void*>(kp + i)) std::string_view(keys[i]);
+    }
+#if USE_BTREE_KEY_PREFIXES
+    assert(prefixes.size() == static_cast<size_t>(size));
+    if (is_leaf) {
+      return;
+    }
+    for (int i = 0; i < size; i++) {
+      key_prefixes[i] = prefixes[i];
+      assert(key_prefixes[i] == KeyPrefix(kp[i]));
+    }
+    PadPrefixes();
+#endif
+  }
+
+#if USE_BTREE_KEY_PREFIXES
+  void PadPrefixes() {
+    for (int i = size; i % 4 != 0; i++) {
+      key_prefixes[i] = INT64_MAX;
+    }
+  }
+#endif
+
+  // AllocSize is how many bytes we ask operator new for leaf or
+  // internal node. Leaves have no key prefixes, so we don't allocate
+  // room for them.
+  static size_t AllocSize(bool is_leaf) {
+#if USE_BTREE_KEY_PREFIXES
+    if (is_leaf) {
+      return sizeof(Node) - sizeof(key_prefixes);
+    }
+#endif
+    (void)is_leaf;
+    return sizeof(Node);
+  }
+
+  static Node* Allocate(int size, bool is_leaf) {
+    return new ((::operator new)(AllocSize(is_leaf))) Node(size, is_leaf);
+  }
+
+  friend NodePtr;
   // Node instances can only be destroyed via refcounting in NodePtr
+  // (see Delete).
   ~Node() {
     if (!is_leaf) {
       for (const NodePtr& p : GetChildren()) {
@@ -180,44 +374,53 @@ private:
       }
     }
   }
+
+  static void Delete(const Node* node) {
+    size_t alloc_size = node->AllocSize();
+    node->~Node();
+#if __cpp_sized_deallocation
+    (::operator delete)(const_cast<Node*>(node), alloc_size);
+#else
+    (::operator delete)(const_cast<Node*>(node));
+    (void)alloc_size; // unused in this config. Avoid warning.
+#endif
+  }
 public:
 
-  // MakeInternal constructs internal node from given list of keys and
-  // childs. Keys and children are assumed to be ordered
-  // appropriately.
+  // MakeInternal constructs internal node from given list of keys,
+  // their prefixes (see KeyPrefix) and childs. Keys and children are
+  // assumed to be ordered appropriately. Note, prefixes are passed
+  // along with keys, so that we copy them from existing nodes
+  // (i.e. mirroring whatever we do to keys) instead of recomputing
+  // and touching the text.
   //
   // Note, newly constructed node has refcount of 0, and it is
   // caller's responsibility to construct NodePtr from it (usually as
   // part of linking into a tree). We don't return NodePtr directly
   // because C++ implementations don't have means of returning smart
   // pointers in registers.
-  template <typename KeysT, typename ChildsT>
-  static const Node* MakeInternal(const KeysT& keys, const ChildsT& childs) {
+  template <typename KeysT, typename PrefixesT, typename ChildsT>
+  static const Node* MakeInternal(const KeysT& keys, const PrefixesT& prefixes, const ChildsT& childs) {
     int size = keys.size();
     assert(childs.size() == static_cast<size_t>(size + 1));
 
-    Node* ret = new Node(size, false);
-    std::string_view* kp = const_cast<std::string_view*>(ret->GetKeysStorage());
-    for (int i = 0; i < size; i++) {
-      new (static_cast<void*>(kp + i)) std::string_view(keys[i]);
-    }
+    Node* ret = Allocate(size, false);
+    ret->InitKeys(keys, prefixes);
     NodePtr* pp = const_cast<NodePtr*>(ret->GetPtrStorage());
     for (int i = 0; i <= size; i++) {
       new (static_cast<void*>(pp + i)) NodePtr(childs[i]);
+      ret->subtree_size += pp[i]->subtree_size;
     }
     return ret;
   }
 
-  // MakeLeaf constructs leaf node from given list of keys. See above
-  // for note about returning 'naked' Node* directly.
-  template <typename KeysT>
-  static const Node* MakeLeaf(const KeysT& keys) {
-    int size = keys.size();
-    Node* ret = new Node(size, true);
-    std::string_view* kp = const_cast<std::string_view*>(ret->GetKeysStorage());
-    for (int i = 0; i < size; i++) {
-      new (static_cast<void*>(kp + i)) std::string_view(keys[i]);
-    }
+  // MakeLeaf constructs leaf node from given list of keys and their
+  // prefixes. See above for note about returning 'naked' Node*
+  // directly.
+  template <typename KeysT, typename PrefixesT>
+  static const Node* MakeLeaf(const KeysT& keys, const PrefixesT& prefixes) {
+    Node* ret = Allocate(keys.size(), true);
+    ret->InitKeys(keys, prefixes);
     return ret;
   }
 
@@ -231,20 +434,216 @@ public:
     return size < kWidth;
   }
 
+  // IsUnderfull returns true if (non-root) node is below minimum
+  // size. Erase produces nodes that are at most one key short, and
+  // then their parent borrows key from sibling or merges them with
+  // sibling.
+  bool IsUnderfull() const {
+    return size < (is_leaf ? kMinLeafSize : kMinInternalSize);
+  }
+
+  // CanLendKey returns true if we can remove one key from this node
+  // and stay at or above minimum size.
+  bool CanLendKey() const {
+    return size > (is_leaf ? kMinLeafSize : kMinInternalSize);
+  }
+
+  size_t AllocSize() const {
+    return AllocSize(is_leaf);
+  }
+
+  // LogicalSize returns how many bytes of this node are actually in
+  // use. I.e. header plus used keys, child pointers and key
+  // prefixes. Note, nodes are allocated as AllocSize bytes.
+  size_t LogicalSize() const {
+    size_t rv = AllocSize() - kInternalSize + size * sizeof(std::string_view);
+    if (!is_leaf) {
+      rv += (size + 1) * sizeof(NodePtr);
+      if (USE_BTREE_KEY_PREFIXES) {
+        rv -= (kPrefixSlots - size) * sizeof(int64_t);
+      }
+    }
+    return rv;
+  }
+
+  // With CONCURRENT_READERS refcount is accessed atomically (via
+  // atomic_ref, so that layout is same in both modes).
+  int LoadRefCount() const {
+    if (CONCURRENT_READERS) {
+      return std::atomic_ref<int>(refcount).load(std::memory_order_acquire);
+    }
+    return refcount;
+  }
+
   std::span<const NodePtr> GetChildren() const {
     return {GetPtrStorage(), static_cast<size_t>(size + 1)};
   }
   std::span<const std::string_view> GetKeys() const {
     return {GetKeysStorage(), static_cast<size_t>(size)};
   }
+  // GetPrefixes returns prefixes of our keys. For leaves (and without
+  // USE_BTREE_KEY_PREFIXES) it is span of zeros, just so that code
+  // that builds nodes doesn't need to care.
+  std::span<const int64_t> GetPrefixes() const {
+#if USE_BTREE_KEY_PREFIXES
+    if (!is_leaf) {
+      return {key_prefixes, static_cast<size_t>(size)};
+    }
+#endif
+    static constexpr int64_t kNoPrefixes[kLeafWidth] = {};
+    return {kNoPrefixes, static_cast<size_t>(size)};
+  }
 
   // FindInsertPos returns index of a smallest key that is >= than
   // given value.
   int FindInsertPos(std::string_view value) const {
     auto keys = GetKeys();
+#if USE_BTREE_KEY_PREFIXES
+    if (!is_leaf) {
+      // Keys with smaller prefixes are smaller than value, and keys
+      // with greater prefixes are greater. So we only compare strings
+      // in between.
+      auto [less, less_or_equal] = CountPrefixes(KeyPrefix(value));
+      return std::lower_bound(keys.begin() + less, keys.begin() + less_or_equal, value) - keys.begin();
+    }
+#endif
     return std::lower_bound(keys.begin(), keys.end(), value) - keys.begin();
   }
 
+#if USE_BTREE_KEY_PREFIXES
+  // CountPrefixes returns number of our key prefixes that are less
+  // than given prefix and number of those that are less or equal.
+  std::pair<int, int> CountPrefixes(int64_t prefix) const {
+    int less = 0;
+    int less_or_equal = 0;
+#ifdef __AVX2__
+    __m256i needle = _mm256_set1_epi64x(prefix);
+    for (int i = 0; i < size; i += 4) {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key_prefixes + i));
+      unsigned lt = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(needle, v)));
+      unsigned gt = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, needle)));
+      unsigned valid = (size - i >= 4) ? 0xf : (1u << (size - i)) - 1;
+      less += std::popcount(lt & valid);
+      less_or_equal += std::popcount(~gt & valid);
+    }
+#else
+    // Compilers vectorize this just fine with whatever SIMD is
+    // available.
+    for (int i = 0; i < size; i++) {
+      less += (key_prefixes[i] < prefix);
+      less_or_equal += (key_prefixes[i] <= prefix);
+    }
+#endif
+    return {less, less_or_equal};
+  }
+#endif
+
+  // OverwriteKey replaces key in place. Only for erase fast-path,
+  // which deals with unshared nodes (see there).
+  void OverwriteKey(int pos, std::string_view key) const {
+    assert(pos < size);
+    *const_cast<std::string_view*>(&GetKeysStorage()[pos]) = key;
+#if USE_BTREE_KEY_PREFIXES
+    if (!is_leaf) {
+      const_cast<int64_t&>(key_prefixes[pos]) = KeyPrefix(key);
+    }
+#endif
+  }
+
+  // Relink replaces child pointer in place. Only for fast-paths and
+  // transients, which deal with unshared nodes.
+  static void Relink(const NodePtr& place, const Node* new_child) {
+    NodePtr* p = const_cast<NodePtr*>(&place);
+    p->~NodePtr();
+    new (static_cast<void*>(p)) NodePtr{new_child};
+  }
+
+  // Copy builds a copy of this node. Transients use it to get private
+  // copy of a shared node before mutating it.
+  const Node* Copy() const {
+    if (is_leaf) {
+      return MakeLeaf(GetKeys(), GetPrefixes());
+    }
+    return MakeInternal(GetKeys(), GetPrefixes(), GetChildren());
+  }
+
+  // In-place counterparts of InsertIntoLeaf, InsertIntoInternal and
+  // Split{Leaf,Internal}. Those are for BTree::Transient, which only
+  // applies them to nodes it owns exclusively. Like our other
+  // in-place tricks, they take const this, since nodes are linked via
+  // const pointers.
+  void InsertIntoLeafInPlace(int pos, std::string_view value) const {
+    assert(is_leaf);
+    assert(size < kLeafWidth);
+    Node* self = const_cast<Node*>(this);
+    std::string_view* kp = const_cast<std::string_view*>(GetKeysStorage());
+    memmove(kp + pos + 1, kp + pos, (size - pos) * sizeof(std::string_view));
+    kp[pos] = value;
+    self->size++;
+    self->subtree_size++;
+  }
+
+  // InsertSplitInPlace installs split of child at pos. That child was
+  // split in place (see SplitInPlace), so it already is the left half
+  // and we only add key and right half.
+  void InsertSplitInPlace(int pos, const SplitRes& split) const {
+    assert(!is_leaf);
+    assert(size < kWidth);
+    assert(GetChildren()[pos].Get() == split.left);
+    Node* self = const_cast<Node*>(this);
+    std::string_view* kp = const_cast<std::string_view*>(GetKeysStorage());
+    memmove(kp + pos + 1, kp + pos, (size - pos) * sizeof(std::string_view));
+    kp[pos] = split.key;
+#if USE_BTREE_KEY_PREFIXES
+    memmove(self->key_prefixes + pos + 1, self->key_prefixes + pos, (size - pos) * sizeof(int64_t));
+    self->key_prefixes[pos] = KeyPrefix(split.key);
+#endif
+    // NodePtr is just a pointer, so we can relocate children bytewise.
+    static_assert(sizeof(NodePtr) == sizeof(const Node*));
+    NodePtr* pp = const_cast<NodePtr*>(GetPtrStorage());
+    memmove(static_cast<void*>(pp + pos + 2), static_cast<const void*>(pp + pos + 1),
+            (size - pos) * sizeof(NodePtr));
+    new (static_cast<void*>(pp + pos + 1)) NodePtr{split.right};
+    self->size++;
+#if USE_BTREE_KEY_PREFIXES
+    self->PadPrefixes();
+#endif
+  }
+
+  // SplitInPlace moves upper half of this full node into a new node,
+  // and returns split with this node as left half.
+  SplitRes SplitInPlace() const {
+    Node* self = const_cast<Node*>(this);
+    auto keys = GetKeys();
+    auto prefixes = GetPrefixes();
+    int mid;
+    const Node* right;
+    if (is_leaf) {
+      assert(size == kLeafWidth);
+      mid = kLeafWidth / 2;
+      right = MakeLeaf(keys.subspan(mid + 1), prefixes.subspan(mid + 1));
+    } else {
+      assert(size == kWidth);
+      mid = kWidth / 2;
+      auto children = GetChildren();
+      right = MakeInternal(keys.subspan(mid + 1), prefixes.subspan(mid + 1),
+                           children.subspan(mid + 1));
+      // right now holds it's own references to those.
+      for (const NodePtr& p : children.subspan(mid + 1)) {
+        const_cast<NodePtr&>(p).~NodePtr();
+      }
+    }
+    std::string_view key = keys[mid];
+    self->size = mid;
+    self->subtree_size -= right->subtree_size + 1;
+#if USE_BTREE_KEY_PREFIXES
+    if (!is_leaf) {
+      self->PadPrefixes();
+    }
+#endif
+    return SplitRes{this, key, right};
+  }
+
   // Splits leaf into 2 halves (extracting middle key into
   // SplitRes#key field).
   SplitRes SplitLeaf() const {
@@ -253,11 +652,12 @@ public:
 
     int mid = kLeafWidth / 2;
     auto keys = GetKeys();
+    auto prefixes = GetPrefixes();
 
     return SplitRes{
-      MakeLeaf(keys.subspan(0, mid)),
+      MakeLeaf(keys.subspan(0, mid), prefixes.subspan(0, mid)),
       keys[mid],
-      MakeLeaf(keys.subspan(mid + 1))};
+      MakeLeaf(keys.subspan(mid + 1), prefixes.subspan(mid + 1))};
   }
 
   // Splits internal node.
@@ -267,10 +667,12 @@ public:
     int mid = kWidth / 2;
 
     auto keys = GetKeys();
+    auto prefixes = GetPrefixes();
     auto children = GetChildren();
 
     auto mk = [&] (int from, int to) -> const Node* {
       return MakeInternal(keys.subspan(from, to - from),
+                          prefixes.subspan(from, to - from),
                           children.subspan(from, to + 1 - from));
     };
 
@@ -289,6 +691,7 @@ public:
     assert(new_child);
 
     return MakeInternal(GetKeys(),
+                        GetPrefixes(),
                         span_ops::ReplaceOp(GetChildren(),
                                             child_index,
                                             NodePtr{new_child}));
@@ -300,7 +703,8 @@ public:
   const Node* InsertIntoLeaf(int pos, std::string_view value) const {
     assert(is_leaf);
     assert(size < kLeafWidth);
-    return MakeLeaf(span_ops::InsertOp(GetKeys(), pos, value));
+    return MakeLeaf(span_ops::InsertOp(GetKeys(), pos, value),
+                    span_ops::InsertOp(GetPrefixes(), pos, KeyPrefix(value)));
   }
 
   // Builds new internal node with given split 'installed' at given
@@ -312,6 +716,7 @@ public:
     assert(pos <= size);
     return MakeInternal(
       span_ops::InsertOp(GetKeys(), pos, split.key),
+      span_ops::InsertOp(GetPrefixes(), pos, KeyPrefix(split.key)),
       span_ops::InsertOp(
         span_ops::ReplaceOp(GetChildren(),
                             pos,
@@ -324,30 +729,446 @@ public:
   // valid as root.
   static const Node* MakeInternalFromSplit(const SplitRes& split) {
     NodePtr kids[2] = {NodePtr{split.left}, NodePtr{split.right}};
+    int64_t prefix = KeyPrefix(split.key);
     return Node::MakeInternal(
       std::span<const std::string_view>(&split.key, 1),
+      std::span<const int64_t>(&prefix, 1),
       std::span<NodePtr>(kids, 2));
   }
+
+  // Builds new leaf with key at given position removed.
+  const Node* EraseFromLeaf(int pos) const {
+    assert(is_leaf);
+    assert(size > 1);
+    auto keys = GetKeys();
+    auto prefixes = GetPrefixes();
+    return MakeLeaf(span_ops::EraseOp(keys, pos), span_ops::EraseOp(prefixes, pos));
+  }
+
+  // BorrowFromRight takes two siblings and their separator key from
+  // parent. And moves separator down to the end of left node and
+  // first key of right node up to become new separator. Returns new
+  // siblings and separator as SplitRes.
+  static SplitRes BorrowFromRight(const Node* left, std::string_view key, const Node* right) {
+    assert(left->is_leaf == right->is_leaf);
+    auto left_keys = left->GetKeys();
+    auto right_keys = right->GetKeys();
+    auto left_prefixes = left->GetPrefixes();
+    auto right_prefixes = right->GetPrefixes();
+    int64_t key_prefix = KeyPrefix(key);
+    span_ops::InsertOp new_left_keys(left_keys, left_keys.size(), key);
+    span_ops::InsertOp new_left_prefixes(left_prefixes, left_prefixes.size(), key_prefix);
+    if (left->is_leaf) {
+      return SplitRes{
+        MakeLeaf(new_left_keys, new_left_prefixes),
+        right_keys[0],
+        MakeLeaf(right_keys.subspan(1), right_prefixes.subspan(1))};
+    }
+    auto left_children = left->GetChildren();
+    auto right_children = right->GetChildren();
+    return SplitRes{
+      MakeInternal(new_left_keys, new_left_prefixes,
+                   span_ops::InsertOp(left_children, left_children.size(), right_children[0])),
+      right_keys[0],
+      MakeInternal(right_keys.subspan(1), right_prefixes.subspan(1), right_children.subspan(1))};
+  }
+
+  // BorrowFromLeft is mirror image of BorrowFromRight. Separator goes
+  // down to the front of right node and last key of left node goes
+  // up.
+  static SplitRes BorrowFromLeft(const Node* left, std::string_view key, const Node* right) {
+    assert(left->is_leaf == right->is_leaf);
+    auto left_keys = left->GetKeys();
+    auto right_keys = right->GetKeys();
+    auto left_prefixes = left->GetPrefixes();
+    auto right_prefixes = right->GetPrefixes();
+    int64_t key_prefix = KeyPrefix(key);
+    span_ops::InsertOp new_right_keys(right_keys, 0, key);
+    span_ops::InsertOp new_right_prefixes(right_prefixes, 0, key_prefix);
+    size_t left_size = left_keys.size() - 1;
+    if (left->is_leaf) {
+      return SplitRes{
+        MakeLeaf(left_keys.first(left_size), left_prefixes.first(left_size)),
+        left_keys.back(),
+        MakeLeaf(new_right_keys, new_right_prefixes)};
+    }
+    auto left_children = left->GetChildren();
+    auto right_children = right->GetChildren();
+    return SplitRes{
+      MakeInternal(left_keys.first(left_size), left_prefixes.first(left_size),
+                   left_children.first(left_size + 1)),
+      left_keys.back(),
+      MakeInternal(new_right_keys, new_right_prefixes,
+                   span_ops::InsertOp(right_children, 0, left_children.back()))};
+  }
+
+  // Merge builds single node out of two siblings and their separator
+  // key.
+  static const Node* Merge(const Node* left, std::string_view key, const Node* right) {
+    assert(left->is_leaf == right->is_leaf);
+    auto left_keys = left->GetKeys();
+    auto right_keys = right->GetKeys();
+    auto left_prefixes = left->GetPrefixes();
+    auto right_prefixes = right->GetPrefixes();
+    int64_t key_prefix = KeyPrefix(key);
+    span_ops::InsertOp left_and_key(left_keys, left_keys.size(), key);
+    span_ops::ConcatOp keys(left_and_key, right_keys);
+    span_ops::InsertOp left_and_prefix(left_prefixes, left_prefixes.size(), key_prefix);
+    span_ops::ConcatOp prefixes(left_and_prefix, right_prefixes);
+    if (left->is_leaf) {
+      return MakeLeaf(keys, prefixes);
+    }
+    auto left_children = left->GetChildren();
+    auto right_children = right->GetChildren();
+    return MakeInternal(keys, prefixes, span_ops::ConcatOp(left_children, right_children));
+  }
+
+  // ReplaceChildAndRebalance is ReplaceChild counterpart for
+  // erasing. It builds new node with child at given index replaced
+  // by given node and (if new_key is given) key at the same index
+  // replaced by *new_key. New child may be underfull, in which case
+  // we also borrow a key from it's sibling (preferring right one) or
+  // merge it with sibling. So the node we return may itself be
+  // underfull.
+  //
+  // When this node has just one key (i.e. is root) and it's 2
+  // children are merged, we return merged node instead. I.e. tree
+  // becomes one level shorter.
+  const Node* ReplaceChildAndRebalance(int child_index, const Node* new_child,
+                                       const std::string_view* new_key) const {
+    assert(!is_leaf);
+    assert(child_index <= size);
+    assert(new_child);
+    assert(!new_key || child_index < size);
+
+    NodePtr kid{new_child};
+    auto orig_keys = GetKeys();
+    auto children = GetChildren();
+    std::string_view key_at_index = new_key ? *new_key
+      : (child_index < size ? orig_keys[child_index] : std::string_view{});
+    span_ops::ReplaceOp keys(orig_keys, child_index, key_at_index);
+    auto orig_prefixes = GetPrefixes();
+    int64_t prefix_at_index = new_key ? KeyPrefix(*new_key)
+      : (child_index < size ? orig_prefixes[child_index] : 0);
+    span_ops::ReplaceOp prefixes(orig_prefixes, child_index, prefix_at_index);
+
+    if (!kid->IsUnderfull()) {
+      return MakeInternal(keys, prefixes, span_ops::ReplaceOp(children, child_index, kid));
+    }
+
+    int left_index = (child_index < size) ? child_index : child_index - 1;
+    bool kid_is_left = (left_index == child_index);
+    const Node* left = kid_is_left ? kid.Get() : children[left_index].Get();
+    const Node* right = kid_is_left ? children[left_index + 1].Get() : kid.Get();
+    const Node* sibling = kid_is_left ? right : left;
+
+    if (sibling->CanLendKey()) {
+      SplitRes borrowed = kid_is_left
+        ? BorrowFromRight(left, keys[left_index], right)
+        : BorrowFromLeft(left, keys[left_index], right);
+      NodePtr new_left{borrowed.left};
+      NodePtr new_right{borrowed.right};
+      int64_t borrowed_prefix = KeyPrefix(borrowed.key);
+      span_ops::ReplaceOp with_left(children, left_index, new_left);
+      return MakeInternal(span_ops::ReplaceOp(keys, left_index, borrowed.key),
+                          span_ops::ReplaceOp(prefixes, left_index, borrowed_prefix),
+                          span_ops::ReplaceOp(with_left, left_index + 1, new_right));
+    }
+
+    const Node* merged = Merge(left, keys[left_index], right);
+    if (size == 1) {
+      return merged;
+    }
+    NodePtr merged_ptr{merged};
+    span_ops::ReplaceOp with_merged(children, left_index, merged_ptr);
+    return MakeInternal(span_ops::EraseOp(keys, left_index),
+                        span_ops::EraseOp(prefixes, left_index),
+                        span_ops::EraseOp(with_merged, left_index + 1));
+  }
 };
 
-void NodePtr::IncRef(const Node* p) {
-  p->refcount++;
+template <int kWidthParam>
+void NodePtr<kWidthParam>::IncRef(const Node* p) {
+  if (CONCURRENT_READERS) {
+    std::atomic_ref<int>(p->refcount).fetch_add(1, std::memory_order_relaxed);
+  } else {
+    p->refcount++;
+  }
 }
-void NodePtr::DecRef(const Node* p) {
-  if (--p->refcount == 0) {
-    delete p;
+template <int kWidthParam>
+void NodePtr<kWidthParam>::DecRef(const Node* p) {
+  int prev;
+  if (CONCURRENT_READERS) {
+    prev = std::atomic_ref<int>(p->refcount).fetch_sub(1, std::memory_order_acq_rel);
+  } else {
+    prev = p->refcount--;
+  }
+  if (prev == 1) {
+    Node::Delete(p);
   }
 }
 
+template <int kWidthParam = kDefaultNodeWidth>
 struct BTree {
+  using Node = ::Node<kWidthParam>;
+  using NodePtr = ::NodePtr<kWidthParam>;
+  using SplitRes = ::SplitRes<kWidthParam>;
+
+  // Our nodes are at least half-full, so 32 levels is way more than
+  // enough for any tree that fits into memory.
+  static constexpr int kMaxHeight = 32;
+
   std::optional<NodePtr> root;
 
+  class Iterator;
+  class Transient;
+
   void Insert(std::string_view value);
+  // Erase removes given key. Returns false if there was no such key.
+  bool Erase(std::string_view value);
+  // EraseRange removes all keys in [from, to). Returns number of keys
+  // removed.
+  size_t EraseRange(std::string_view from, std::string_view to);
   const std::string_view* LowerBound(std::string_view str);
+  static const std::string_view* LowerBound(const Node* n, std::string_view str);
+
+  // Iterators over current version of the tree. Seek returns iterator
+  // positioned at smallest key that is >= str.
+  Iterator First() const;
+  Iterator Last() const;
+  Iterator Seek(std::string_view str) const;
+
+  // Order statistics. We maintain subtree sizes in every node, so
+  // those are O(log N). Rank returns number of keys that are smaller
+  // than str. Select returns i-th smallest key (counting from 0) or
+  // nullptr if there are not that many keys. CountRange returns
+  // number of keys in [from, to), and CountPrefix number of keys
+  // that start with given prefix.
+  size_t Rank(std::string_view str) const;
+  const std::string_view* Select(size_t i) const;
+  size_t CountRange(std::string_view from, std::string_view to) const;
+  size_t CountPrefix(std::string_view prefix) const;
+
+  // Diff calls fn(key, added) for every key that is only in one of
+  // the given versions (added is true for keys that are only in
+  // new_root's version). Subtrees that are shared by both versions
+  // are skipped without looking inside, so cost is proportional to
+  // how much versions differ, not to their size. Null root means
+  // empty version.
+  template <typename Fn>
+  static void Diff(const Node* old_root, const Node* new_root, Fn fn);
+  // Union returns version with keys of both given versions. We
+  // insert keys that are only in b into (copy of) a, so a had
+  // better be the bigger one.
+  static std::optional<NodePtr> Union(const Node* a, const Node* b);
+
   int Validate();
+  void AccountMemory(MemoryStats* stats) const;
+
+#if CONCURRENT_READERS
+  // Publish makes current version of the tree visible to Snapshot
+  // callers. Only the (single) writer thread calls it.
+  void Publish();
+  // Snapshot returns reference to last published version of the
+  // tree. Any thread can call it, and the version stays intact for as
+  // long as caller holds the reference. Lock-free.
+  std::optional<NodePtr> Snapshot();
+
+  ~BTree() {
+    delete published_.load();
+  }
+
+private:
+  // published_ owns it's own reference to published version. Older
+  // versions are released via epoch_, once readers are done
+  // grabbing them.
+  std::atomic<const NodePtr*> published_{nullptr};
+  EpochDomain epoch_;
+#endif
+};
+
+// Transient is batch-mutation mode of the tree (this idea comes from
+// Clojure's transients). It owns it's nodes exclusively, so it
+// inserts by mutating nodes in place (splits included) and doesn't
+// copy anything. Freeze turns current state into regular immutable
+// version in O(1), by simply sharing the root. Nodes become shared
+// then, so subsequent inserts into the same transient copy whatever
+// frozen versions still reference (once per node), and then go back
+// to mutating in place.
+//
+// Note, we only do insertion here. Just like elsewhere, nodes are
+// exclusively owned when their refcount is 1 and we got to them via
+// exclusively owned parent.
+template <int kWidthParam>
+class BTree<kWidthParam>::Transient {
+public:
+  Transient() = default;
+  // This transient starts with contents of the given tree.
+  explicit Transient(const BTree& tree) : root_(tree.root) {}
+
+  void Insert(std::string_view value);
+
+  // Freeze makes tree's root point to current version. O(1).
+  void Freeze(BTree* tree) const {
+    if (root_) {
+      tree->root.emplace(*root_);
+    } else {
+      tree->root.reset();
+    }
+  }
+
+private:
+  // Unshare makes sure node at given place is exclusively ours and
+  // returns it.
+  static const Node* Unshare(const NodePtr& place) {
+    const Node* n = place.Get();
+    if (n->LoadRefCount() != 1) {
+      n = n->Copy();
+      Node::Relink(place, n);
+    }
+    return n;
+  }
+
+  std::optional<NodePtr> root_;
+};
+
+template <int kWidthParam>
+void BTree<kWidthParam>::Transient::Insert(std::string_view value) {
+  if (!root_) {
+    int64_t prefix = KeyPrefix(value);
+    root_.emplace(Node::MakeLeaf(std::span<const std::string_view>(&value, 1),
+                                 std::span<const int64_t>(&prefix, 1)));
+    return;
+  }
+
+  // We split full nodes on the way down, so that there is always room
+  // in the parent for the split of it's child.
+  const Node* n = Unshare(*root_);
+  if (n->is_leaf ? !n->CanInsertInLeaf() : !n->CanInsertInInternal()) {
+    root_.emplace(Node::MakeInternalFromSplit(n->SplitInPlace()));
+    n = root_->Get();
+  }
+
+  for (;;) {
+    if (n->is_leaf) {
+      n->InsertIntoLeafInPlace(n->FindInsertPos(value), value);
+      return;
+    }
+    n->subtree_size++;
+    int pos = n->FindInsertPos(value);
+    const Node* child = Unshare(n->GetChildren()[pos]);
+    if (child->is_leaf ? !child->CanInsertInLeaf() : !child->CanInsertInInternal()) {
+      SplitRes split = child->SplitInPlace();
+      n->InsertSplitInPlace(pos, split);
+      if (value > split.key) {
+        child = split.right;
+      }
+    }
+    n = child;
+  }
+}
+
+// Iterator walks keys of one version of the tree in order. It holds
+// reference to root of that version, so the tree can be freely
+// updated while we iterate (but note, that makes nodes shared and
+// disables insertion/erase fast-paths until iterator is gone).
+//
+// We keep entire path from root to current key. Frames above the
+// last one point at the child we descended into, and last frame
+// points at current key (which may be in internal node). So Next and
+// Prev only walk up or down as far as needed, which is amortized O(1)
+// per key.
+template <int kWidthParam>
+class BTree<kWidthParam>::Iterator {
+public:
+  bool Valid() const {
+    return depth_ > 0;
+  }
+
+  std::string_view operator*() const {
+    assert(Valid());
+    const Frame& f = path_[depth_ - 1];
+    return f.node->GetKeys()[f.pos];
+  }
+
+  void Next() {
+    assert(Valid());
+    Frame& top = path_[depth_ - 1];
+    if (!top.node->is_leaf) {
+      // Next key is the smallest key in subtree to the right of
+      // current key.
+      top.pos++;
+      DescendLeftmost(top.node->GetChildren()[top.pos].Get());
+      return;
+    }
+    if (++top.pos < top.node->size) {
+      return;
+    }
+    // We're done with this leaf. Next key is separator to the right of
+    // the first subtree up the path that isn't rightmost child.
+    depth_--;
+    while (depth_ > 0 && path_[depth_ - 1].pos == path_[depth_ - 1].node->size) {
+      depth_--;
+    }
+  }
+
+  void Prev() {
+    assert(Valid());
+    Frame& top = path_[depth_ - 1];
+    if (!top.node->is_leaf) {
+      DescendRightmost(top.node->GetChildren()[top.pos].Get());
+      return;
+    }
+    if (--top.pos >= 0) {
+      return;
+    }
+    depth_--;
+    while (depth_ > 0 && path_[depth_ - 1].pos == 0) {
+      depth_--;
+    }
+    if (depth_ > 0) {
+      path_[depth_ - 1].pos--;
+    }
+  }
+
+private:
+  friend BTree;
+
+  struct Frame {
+    const Node* node;
+    int pos;
+  };
+
+  explicit Iterator(const std::optional<NodePtr>& root) : root_(root) {}
+
+  void Push(const Node* n, int pos) {
+    assert(depth_ < kMaxHeight);
+    path_[depth_++] = Frame{n, pos};
+  }
+
+  void DescendLeftmost(const Node* n) {
+    while (!n->is_leaf) {
+      Push(n, 0);
+      n = n->GetChildren()[0].Get();
+    }
+    Push(n, 0);
+  }
+
+  void DescendRightmost(const Node* n) {
+    while (!n->is_leaf) {
+      Push(n, n->size);
+      n = n->GetChildren()[n->size].Get();
+    }
+    Push(n, n->size - 1);
+  }
+
+  const std::optional<NodePtr> root_;
+  Frame path_[kMaxHeight];
+  int depth_ = 0;
 };
 
-void BTree::Insert(std::string_view value) {
+template <int kWidthParam>
+void BTree<kWidthParam>::Insert(std::string_view value) {
   struct R {
     // We use simplified (and slightly more efficient) insertion
     // strategy. Rather than having recursive insert calls return
@@ -439,11 +1260,18 @@ void BTree::Insert(std::string_view value) {
     // common case insertions and makes our implementation roughly
     // competitive with imperative, non-persistent and polished abseil
     // btree code.
+    //
+    // We remember the path, so that once we succeed, we bump subtree
+    // sizes of all the nodes we've walked through.
     static bool TryFastPath(const Node* n, std::string_view value) {
       if (n->is_leaf) {
         return false; // leaf root isn't fast-path (yet)
       }
-      while (n->refcount == 1) {
+      const Node* path[kMaxHeight];
+      int depth = 0;
+      while (n->LoadRefCount() == 1) {
+        assert(depth < kMaxHeight);
+        path[depth++] = n;
         int pos = n->FindInsertPos(value);
         NodePtr* child_place = const_cast<NodePtr*>(&n->GetChildren()[pos]);
         const Node* child = child_place->Get();
@@ -463,6 +1291,9 @@ void BTree::Insert(std::string_view value) {
           child_place->~NodePtr();
           new (static_cast<void*>(child_place)) NodePtr{new_child};
 
+          for (int i = 0; i < depth; i++) {
+            path[i]->subtree_size++;
+          }
           return true; // yay \o/
         }
 
@@ -475,7 +1306,9 @@ void BTree::Insert(std::string_view value) {
   };
 
   if (!root) {
-    root.emplace(Node::MakeLeaf(std::span<const std::string_view>(&value, 1)));
+    int64_t prefix = KeyPrefix(value);
+    root.emplace(Node::MakeLeaf(std::span<const std::string_view>(&value, 1),
+                                std::span<const int64_t>(&prefix, 1)));
     return;
   }
 
@@ -511,40 +1344,444 @@ void BTree::Insert(std::string_view value) {
   root.emplace(n);
 }
 
-const std::string_view* BTree::LowerBound(std::string_view str) {
-  if (!root) {
-    return nullptr;
-  }
-
+template <int kWidthParam>
+bool BTree<kWidthParam>::Erase(std::string_view value) {
   struct R {
-    static const std::string_view* Rec(const Node* n, std::string_view str) {
-      auto keys = n->GetKeys();
+    // Unlike insertion, erase is straightforward "bottom-up"
+    // recursion. Rec returns rewritten subtree without given value
+    // (or nullptr if value isn't there). Rewritten subtree may be one
+    // key short of minimum size, and then it's parent rebalances it
+    // (see Node::ReplaceChildAndRebalance). When value is in internal
+    // node, we replace it with it's predecessor, which we erase from
+    // the leaf level.
+    static const Node* Rec(const Node* n, std::string_view value) {
+      int pos = n->FindInsertPos(value);
+      bool found = (pos < n->size && n->GetKeys()[pos] == value);
+
       if (n->is_leaf) {
-        auto it = std::lower_bound(keys.begin(), keys.end(), str);
-        if (it == keys.end()) {
-          return nullptr;
-        }
-        return &*it;
+        return found ? n->EraseFromLeaf(pos) : nullptr;
       }
 
-      int pos = n->FindInsertPos(str);
-      const std::string_view* child_result = Rec(n->GetChildren()[pos].Get(), str);
-      if (!child_result && static_cast<size_t>(pos) < keys.size()) {
-        return &keys[pos];
+      const Node* kid = n->GetChildren()[pos].Get();
+      if (found) {
+        std::string_view predecessor;
+        const Node* new_kid = EraseMax(kid, &predecessor);
+        return n->ReplaceChildAndRebalance(pos, new_kid, &predecessor);
       }
-      return child_result;
-    }
-  };
 
-  return R::Rec(root->Get(), str);
-}
+      const Node* new_kid = Rec(kid, value);
+      if (new_kid == nullptr) {
+        return nullptr;
+      }
+      return n->ReplaceChildAndRebalance(pos, new_kid, nullptr);
+    }
 
-int BTree::Validate() {
-  struct Checker {
-    const Node* const root;
-    std::optional<std::string_view> prev_seen;
+    // EraseMax removes largest key of given subtree and returns it
+    // via *max. Returns rewritten subtree, which similarly to Rec above
+    // may be underfull.
+    static const Node* EraseMax(const Node* n, std::string_view* max) {
+      if (n->is_leaf) {
+        *max = n->GetKeys().back();
+        return n->EraseFromLeaf(n->size - 1);
+      }
+      const Node* new_kid = EraseMax(n->GetChildren()[n->size].Get(), max);
+      return n->ReplaceChildAndRebalance(n->size, new_kid, nullptr);
+    }
 
-    Checker(const Node* root) : root(root) {}
+    // TryFastPath is erase counterpart of insertion's TryFastPath
+    // (see there). When entire path down to the leaf has refcount of
+    // 1, we rewrite leaf and link it directly into it's parent. This
+    // works when leaf can lose a key. And when it can't, but one of
+    // it's siblings can lend us a key, we borrow it, again rewriting
+    // both leaves and separator key directly in the parent. Merges
+    // change parent's size, so those (and keys found in internal
+    // nodes) go to the slow path.
+    static bool TryFastPath(const Node* n, std::string_view value) {
+      if (n->is_leaf) {
+        return false;
+      }
+      const Node* path[kMaxHeight];
+      int depth = 0;
+      auto shrink_path = [&] () {
+        for (int i = 0; i < depth; i++) {
+          path[i]->subtree_size--;
+        }
+      };
+      while (n->LoadRefCount() == 1) {
+        assert(depth < kMaxHeight);
+        path[depth++] = n;
+        int pos = n->FindInsertPos(value);
+        if (pos < n->size && n->GetKeys()[pos] == value) {
+          return false;
+        }
+        const Node* child = n->GetChildren()[pos].Get();
+        if (!child->is_leaf) {
+          n = child;
+          continue;
+        }
+
+        int child_pos = child->FindInsertPos(value);
+        if (child_pos == child->size || child->GetKeys()[child_pos] != value) {
+          return false; // not found. Let slow path tell caller that.
+        }
+
+        if (child->CanLendKey()) {
+          Node::Relink(n->GetChildren()[pos], child->EraseFromLeaf(child_pos));
+          shrink_path();
+          return true;
+        }
+
+        int left_pos = (pos < n->size) ? pos : pos - 1;
+        bool child_is_left = (left_pos == pos);
+        const Node* sibling = n->GetChildren()[child_is_left ? pos + 1 : left_pos].Get();
+        if (!sibling->CanLendKey()) {
+          return false;
+        }
+
+        NodePtr new_child{child->EraseFromLeaf(child_pos)};
+        std::string_view key = n->GetKeys()[left_pos];
+        SplitRes borrowed = child_is_left
+          ? Node::BorrowFromRight(new_child.Get(), key, sibling)
+          : Node::BorrowFromLeft(sibling, key, new_child.Get());
+
+        n->OverwriteKey(left_pos, borrowed.key);
+        Node::Relink(n->GetChildren()[left_pos], borrowed.left);
+        Node::Relink(n->GetChildren()[left_pos + 1], borrowed.right);
+        shrink_path();
+        return true;
+      }
+
+      return false;
+    }
+  };
+
+  if (!root) {
+    return false;
+  }
+
+  const Node* n = root->Get();
+  if (n->is_leaf && n->size == 1) {
+    // Leaf nodes are never empty, so we have to special-case erasing
+    // the last key.
+    if (n->GetKeys()[0] != value) {
+      return false;
+    }
+    root.reset();
+    return true;
+  }
+
+#if ENABLE_BTREE_FASTPATH
+  if (R::TryFastPath(n, value)) {
+    return true;
+  }
+#endif
+
+  n = R::Rec(n, value);
+  if (!n) {
+    return false;
+  }
+  root.emplace(n);
+  return true;
+}
+
+template <int kWidthParam>
+size_t BTree<kWidthParam>::EraseRange(std::string_view from, std::string_view to) {
+  // We collect keys first and then erase them one by one. Iterator
+  // holds a reference to the version it walks, which would make every
+  // erase take slow path.
+  std::vector<std::string_view> keys;
+  for (Iterator it = Seek(from); it.Valid() && *it < to; it.Next()) {
+    keys.push_back(*it);
+  }
+  for (std::string_view key : keys) {
+    bool erased = Erase(key);
+    assert(erased); (void)erased;
+  }
+  return keys.size();
+}
+
+template <int kWidthParam>
+auto BTree<kWidthParam>::First() const -> Iterator {
+  Iterator it{root};
+  if (root) {
+    it.DescendLeftmost(root->Get());
+  }
+  return it;
+}
+
+template <int kWidthParam>
+auto BTree<kWidthParam>::Last() const -> Iterator {
+  Iterator it{root};
+  if (root) {
+    it.DescendRightmost(root->Get());
+  }
+  return it;
+}
+
+template <int kWidthParam>
+auto BTree<kWidthParam>::Seek(std::string_view str) const -> Iterator {
+  Iterator it{root};
+  if (!root) {
+    return it;
+  }
+  const Node* n = root->Get();
+  while (!n->is_leaf) {
+    int pos = n->FindInsertPos(str);
+    it.Push(n, pos);
+    n = n->GetChildren()[pos].Get();
+  }
+  int pos = n->FindInsertPos(str);
+  if (pos < n->size) {
+    it.Push(n, pos);
+  } else {
+    // Entire leaf is smaller than str. So we position at it's last key
+    // and step forward, which finds our key (if any) up the path.
+    it.Push(n, n->size - 1);
+    it.Next();
+  }
+  return it;
+}
+
+template <int kWidthParam>
+size_t BTree<kWidthParam>::Rank(std::string_view str) const {
+  if (!root) {
+    return 0;
+  }
+  size_t rank = 0;
+  const Node* n = root->Get();
+  while (!n->is_leaf) {
+    int pos = n->FindInsertPos(str);
+    // Everything in subtrees to the left of children[pos] and their
+    // separators is smaller.
+    auto children = n->GetChildren();
+    for (int i = 0; i < pos; i++) {
+      rank += children[i]->subtree_size;
+    }
+    rank += pos;
+    n = children[pos].Get();
+  }
+  return rank + n->FindInsertPos(str);
+}
+
+template <int kWidthParam>
+const std::string_view* BTree<kWidthParam>::Select(size_t i) const {
+  if (!root || i >= (*root)->subtree_size) {
+    return nullptr;
+  }
+  const Node* n = root->Get();
+  while (!n->is_leaf) {
+    auto children = n->GetChildren();
+    int pos = 0;
+    for (;; pos++) {
+      size_t kid_size = children[pos]->subtree_size;
+      if (i < kid_size) {
+        break;
+      }
+      if (i == kid_size) {
+        return &n->GetKeys()[pos];
+      }
+      i -= kid_size + 1;
+    }
+    n = children[pos].Get();
+  }
+  return &n->GetKeys()[i];
+}
+
+template <int kWidthParam>
+size_t BTree<kWidthParam>::CountRange(std::string_view from, std::string_view to) const {
+  if (to <= from) {
+    return 0;
+  }
+  return Rank(to) - Rank(from);
+}
+
+template <int kWidthParam>
+size_t BTree<kWidthParam>::CountPrefix(std::string_view prefix) const {
+  // Keys starting with prefix are [prefix, successor), where successor
+  // is the smallest string greater than all strings with our
+  // prefix. We get it by dropping trailing \xff-s and incrementing
+  // last char. If prefix is all \xff-s, there is no such successor,
+  // and everything from prefix onwards counts.
+  std::string successor{prefix};
+  while (!successor.empty() && static_cast<unsigned char>(successor.back()) == 0xff) {
+    successor.pop_back();
+  }
+  size_t total = root ? (*root)->subtree_size : 0;
+  if (successor.empty()) {
+    return total - Rank(prefix);
+  }
+  successor.back()++;
+  return Rank(successor) - Rank(prefix);
+}
+
+template <int kWidthParam>
+const std::string_view* BTree<kWidthParam>::LowerBound(std::string_view str) {
+  if (!root) {
+    return nullptr;
+  }
+  return LowerBound(root->Get(), str);
+}
+
+template <int kWidthParam>
+const std::string_view* BTree<kWidthParam>::LowerBound(const Node* n, std::string_view str) {
+  struct R {
+    static const std::string_view* Rec(const Node* n, std::string_view str) {
+      auto keys = n->GetKeys();
+      if (n->is_leaf) {
+        size_t pos = n->FindInsertPos(str);
+        if (pos == keys.size()) {
+          return nullptr;
+        }
+        return &keys[pos];
+      }
+
+      int pos = n->FindInsertPos(str);
+      const std::string_view* child_result = Rec(n->GetChildren()[pos].Get(), str);
+      if (!child_result && static_cast<size_t>(pos) < keys.size()) {
+        return &keys[pos];
+      }
+      return child_result;
+    }
+  };
+
+  return R::Rec(n, str);
+}
+
+template <int kWidthParam>
+template <typename Fn>
+void BTree<kWidthParam>::Diff(const Node* old_root, const Node* new_root, Fn fn) {
+  // We walk both versions in order, as stacks of pending items. Item
+  // is either a key or an entire subtree (with it's level, counting
+  // from leaves). Subtree gets expanded into it's children and keys
+  // only when it is not the same subtree as on the other side. We
+  // always expand the higher one, so that shared subtrees meet at the
+  // same level.
+  struct Item {
+    const Node* node; // nullptr for keys
+    int level;
+    std::string_view key;
+  };
+  struct Stack {
+    std::vector<Item> items;
+
+    explicit Stack(const Node* root) {
+      if (root) {
+        int level = 0;
+        for (const Node* n = root; !n->is_leaf; n = n->GetChildren()[0].Get()) {
+          level++;
+        }
+        items.push_back(Item{root, level, {}});
+      }
+    }
+
+    void Expand() {
+      Item item = items.back();
+      items.pop_back();
+      const Node* n = item.node;
+      auto keys = n->GetKeys();
+      for (int i = n->size - 1; i >= 0; i--) {
+        if (!n->is_leaf) {
+          items.push_back(Item{n->GetChildren()[i + 1].Get(), item.level - 1, {}});
+        }
+        items.push_back(Item{nullptr, 0, keys[i]});
+      }
+      if (!n->is_leaf) {
+        items.push_back(Item{n->GetChildren()[0].Get(), item.level - 1, {}});
+      }
+    }
+  };
+
+  Stack a{old_root};
+  Stack b{new_root};
+  while (!a.items.empty() && !b.items.empty()) {
+    const Item& x = a.items.back();
+    const Item& y = b.items.back();
+    if (x.node && x.node == y.node) {
+      a.items.pop_back();
+      b.items.pop_back();
+    } else if (x.node && (!y.node || x.level >= y.level)) {
+      a.Expand();
+    } else if (y.node) {
+      b.Expand();
+    } else if (x.key < y.key) {
+      fn(x.key, false);
+      a.items.pop_back();
+    } else if (y.key < x.key) {
+      fn(y.key, true);
+      b.items.pop_back();
+    } else {
+      a.items.pop_back();
+      b.items.pop_back();
+    }
+  }
+  while (!a.items.empty()) {
+    if (a.items.back().node) {
+      a.Expand();
+    } else {
+      fn(a.items.back().key, false);
+      a.items.pop_back();
+    }
+  }
+  while (!b.items.empty()) {
+    if (b.items.back().node) {
+      b.Expand();
+    } else {
+      fn(b.items.back().key, true);
+      b.items.pop_back();
+    }
+  }
+}
+
+template <int kWidthParam>
+auto BTree<kWidthParam>::Union(const Node* a, const Node* b) -> std::optional<NodePtr> {
+  // Note, we could do "proper" B-tree split and join here. But then
+  // we'd lose most of the sharing between versions (splits and joins
+  // rebuild nodes along the way). Diff gives us keys that are only in
+  // b cheaply, and inserting them copies only the paths that change.
+  BTree result;
+  if (a) {
+    result.root.emplace(a);
+  }
+  Diff(a, b, [&result] (std::string_view key, bool added) {
+    if (added) {
+      result.Insert(key);
+    }
+  });
+  return std::move(result.root);
+}
+
+#if CONCURRENT_READERS
+template <int kWidthParam>
+void BTree<kWidthParam>::Publish() {
+  const NodePtr* p = root ? new NodePtr(*root) : nullptr;
+  const NodePtr* old = published_.exchange(p);
+  if (old) {
+    // Some reader might have just loaded old pointer and is about to
+    // grab reference. So we defer dropping published reference to
+    // the old version.
+    epoch_.Retire([old] () { delete old; });
+  }
+  epoch_.Reclaim();
+}
+
+template <int kWidthParam>
+auto BTree<kWidthParam>::Snapshot() -> std::optional<NodePtr> {
+  EpochDomain::Guard g{&epoch_};
+  const NodePtr* p = published_.load();
+  if (!p) {
+    return {};
+  }
+  return NodePtr{*p};
+}
+#endif
+
+template <int kWidthParam>
+int BTree<kWidthParam>::Validate() {
+  struct Checker {
+    const Node* const root;
+    std::optional<std::string_view> prev_seen;
+
+    Checker(const Node* root) : root(root) {}
 
     // VisitKey validates that our btree actually stores keys in-order.
     void VisitKey(std::string_view v) {
@@ -560,18 +1797,32 @@ int BTree::Validate() {
     void AssertSize(const Node* n) {
       bool is_root = (n == root);
       if (n->is_leaf) {
-        int min_size = is_root ? 1 : (Node::kLeafWidth - 1) / 2;
+        int min_size = is_root ? 1 : Node::kMinLeafSize;
         bool leaf_size_ok = (min_size / 2 <= n->size) && (n->size <= Node::kLeafWidth);
         assert(leaf_size_ok); if (!leaf_size_ok) { abort(); }
       } else {
-        int min_size = is_root ? 1 : (Node::kWidth - 1) / 2;
+        int min_size = is_root ? 1 : Node::kMinInternalSize;
         bool node_size_ok = (min_size <= n->size) && (n->size <= Node::kWidth);
         assert(node_size_ok); if (!node_size_ok) { abort(); }
       }
     }
 
+    // AssertSubtreeSize checks that subtree size is number of our
+    // keys plus subtree sizes of our children.
+    void AssertSubtreeSize(const Node* n) {
+      size_t expected = n->size;
+      if (!n->is_leaf) {
+        for (const NodePtr& p : n->GetChildren()) {
+          expected += p->subtree_size;
+        }
+      }
+      bool subtree_size_ok = (n->subtree_size == expected);
+      assert(subtree_size_ok); if (!subtree_size_ok) { abort(); }
+    }
+
     int Rec(const Node* n) {
       AssertSize(n);
+      AssertSubtreeSize(n);
       if (n->is_leaf) {
         for (std::string_view s : n->GetKeys()) {
           VisitKey(s);
@@ -597,8 +1848,519 @@ int BTree::Validate() {
   return Checker{root->Get()}.Rec(root->Get());
 }
 
+template <int kWidthParam>
+void BTree<kWidthParam>::AccountMemory(MemoryStats* stats) const {
+  // Note, we only keep latest version of the tree, so nodes are
+  // never shared and we're not at risk of double-counting.
+  struct R {
+    static void Rec(const Node* n, MemoryStats* stats) {
+      stats->AddKeys(n->size);
+      stats->AddNode(n->AllocSize(), n->LogicalSize());
+      if (n->is_leaf) {
+        return;
+      }
+      for (const NodePtr& p : n->GetChildren()) {
+        Rec(p.Get(), stats);
+      }
+    }
+  };
+
+  if (root) {
+    R::Rec(root->Get(), stats);
+  }
+}
+
+// Snapshots.
+//
+// Our nodes are immutable, so any version of the tree can be written
+// out as is. Snapshot file is:
+//
+//  * SnapshotHeader, padded to full page
+//  * copy of the text our keys point into, padded to full page
+//  * node records. Each record is SnapshotNode followed by size keys
+//    (SnapshotKey, i.e. offset and length in the text) and, for
+//    internal nodes, size + 1 file offsets of child records.
+//
+// Records are written children first, so each node only refers to
+// records that were written before it, and root is written
+// last. I.e. this is the same append-only, copy-on-write shape as
+// our in-memory tree. Shared nodes are written once. We also don't
+// let records straddle page boundaries, so that visiting any node
+// touches exactly one page.
+//
+// Snapshot can be mmap-ed and searched directly (see MappedBTree
+// below). So restart doesn't need to rebuild or even read the index,
+// and multiple processes mapping the same file share page cache.
+//
+// Note, we use native byte order and don't try to be defensive
+// against corrupted files beyond checking header.
+#ifndef _WIN32
+#define HAVE_BTREE_SNAPSHOTS 1
+#else
+#define HAVE_BTREE_SNAPSHOTS 0
+#endif
+
+#if HAVE_BTREE_SNAPSHOTS
+
+// We only write snapshots of default node geometry.
+using SnapshotBTree = BTree<>;
+using SnapshotTreeNode = SnapshotBTree::Node;
+
+static constexpr uint64_t kSnapshotPageSize = 4096;
+static constexpr char kSnapshotMagic[8] = {'S', 'F', 'X', 'B', 'T', 'R', 'E', 'E'};
+static constexpr uint32_t kSnapshotVersion = 1;
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  uint64_t file_size;
+  uint64_t text_offset;
+  uint64_t text_size;
+  uint64_t root_offset; // 0 if tree is empty
+};
+
+struct SnapshotKey {
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct SnapshotNode {
+  uint32_t size;
+  uint32_t is_leaf;
+
+  std::span<const SnapshotKey> GetKeys() const {
+    return {reinterpret_cast<const SnapshotKey*>(this + 1), size};
+  }
+  std::span<const uint64_t> GetChildren() const {
+    assert(!is_leaf);
+    return {reinterpret_cast<const uint64_t*>(GetKeys().data() + size), size + size_t{1}};
+  }
+
+  static size_t RecordSize(const SnapshotTreeNode* n) {
+    size_t rv = sizeof(SnapshotNode) + n->size * sizeof(SnapshotKey);
+    if (!n->is_leaf) {
+      rv += (n->size + 1) * sizeof(uint64_t);
+    }
+    return rv;
+  }
+};
+
+static_assert(SnapshotTreeNode::kWidth + 1 <= 64);
+static_assert(sizeof(SnapshotNode) + SnapshotTreeNode::kLeafWidth * sizeof(SnapshotKey) <= kSnapshotPageSize);
+static_assert(sizeof(SnapshotNode) + SnapshotTreeNode::kWidth * sizeof(SnapshotKey)
+              + (SnapshotTreeNode::kWidth + 1) * sizeof(uint64_t) <= kSnapshotPageSize);
+
+class SnapshotWriter {
+public:
+  SnapshotWriter(FILE* f, std::string_view text) : f_(f), text_(text) {}
+
+  void Write(const SnapshotBTree& tree) {
+    // We write header last, when we know where root is.
+    SnapshotHeader h{};
+    memcpy(h.magic, kSnapshotMagic, sizeof(h.magic));
+    h.version = kSnapshotVersion;
+    h.page_size = kSnapshotPageSize;
+
+    Append(&h, sizeof(h)); // placeholder
+    PadTo(kSnapshotPageSize);
+    h.text_offset = offset_;
+    h.text_size = text_.size();
+    Append(text_.data(), text_.size());
+    PadTo(kSnapshotPageSize);
+
+    if (tree.root) {
+      h.root_offset = WriteNode(tree.root->Get());
+    }
+    h.file_size = offset_;
+
+    if (fseek(f_, 0, SEEK_SET) != 0) {
+      perror("fseek");
+      abort();
+    }
+    if (fwrite(&h, sizeof(h), 1, f_) != 1) {
+      perror("fwrite");
+      abort();
+    }
+  }
+
+private:
+  void Append(const void* data, size_t size) {
+    if (size > 0 && fwrite(data, size, 1, f_) != 1) {
+      perror("fwrite");
+      abort();
+    }
+    offset_ += size;
+  }
+
+  void PadTo(uint64_t alignment) {
+    static constexpr char zeros[kSnapshotPageSize] = {};
+    Append(zeros, (alignment - offset_ % alignment) % alignment);
+  }
+
+  uint64_t WriteNode(const SnapshotTreeNode* n) {
+    auto [it, inserted] = written_.try_emplace(n, 0);
+    if (!inserted) {
+      return it->second;
+    }
+
+    uint64_t child_offsets[SnapshotTreeNode::kWidth + 1];
+    if (!n->is_leaf) {
+      auto children = n->GetChildren();
+      for (size_t i = 0; i < children.size(); i++) {
+        child_offsets[i] = WriteNode(children[i].Get());
+      }
+    }
+
+    size_t record_size = SnapshotNode::RecordSize(n);
+    if (offset_ % kSnapshotPageSize + record_size > kSnapshotPageSize) {
+      PadTo(kSnapshotPageSize);
+    }
+    uint64_t rv = offset_;
+
+    SnapshotNode header{static_cast<uint32_t>(n->size), n->is_leaf};
+    Append(&header, sizeof(header));
+    for (std::string_view k : n->GetKeys()) {
+      assert(text_.data() <= k.data() && k.data() + k.size() <= text_.data() + text_.size());
+      SnapshotKey key{static_cast<uint64_t>(k.data() - text_.data()), k.size()};
+      Append(&key, sizeof(key));
+    }
+    if (!n->is_leaf) {
+      Append(child_offsets, (n->size + 1) * sizeof(uint64_t));
+    }
+
+    written_[n] = rv;
+    return rv;
+  }
+
+  FILE* const f_;
+  const std::string_view text_;
+  uint64_t offset_ = 0;
+  std::unordered_map<const SnapshotTreeNode*, uint64_t> written_;
+};
+
+// WriteSnapshot saves given tree into a file. All tree keys must
+// point into given text.
+void WriteSnapshot(const SnapshotBTree& tree, std::string_view text, const std::string& path) {
+  FILE* f = fopen(path.c_str(), "wb");
+  if (f == nullptr) {
+    perror(path.c_str());
+    abort();
+  }
+  SnapshotWriter{f, text}.Write(tree);
+  if (fclose(f) != 0) {
+    perror("fclose");
+    abort();
+  }
+}
+
+// MappedBTree is read-only btree mmap-ed from snapshot file.
+class MappedBTree {
+public:
+  explicit MappedBTree(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      perror(path.c_str());
+      abort();
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      perror("fstat");
+      abort();
+    }
+    size_ = st.st_size;
+    if (size_ < sizeof(SnapshotHeader)) {
+      fprintf(stderr, "%s is too short to be btree snapshot\n", path.c_str());
+      abort();
+    }
+    void* base = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+      perror("mmap");
+      abort();
+    }
+    close(fd);
+    base_ = static_cast<const char*>(base);
+
+    const SnapshotHeader* h = Header();
+    bool ok = (memcmp(h->magic, kSnapshotMagic, sizeof(h->magic)) == 0
+               && h->version == kSnapshotVersion
+               && h->page_size == kSnapshotPageSize
+               && h->file_size == size_
+               && h->text_offset + h->text_size <= size_
+               && h->root_offset < size_);
+    if (!ok) {
+      fprintf(stderr, "%s is not a valid btree snapshot\n", path.c_str());
+      abort();
+    }
+  }
+
+  ~MappedBTree() {
+    munmap(const_cast<char*>(base_), size_);
+  }
+
+  MappedBTree(const MappedBTree&) = delete;
+  MappedBTree& operator=(const MappedBTree&) = delete;
+
+  std::string_view text() const {
+    return {base_ + Header()->text_offset, Header()->text_size};
+  }
+
+  // LowerBound returns smallest key that is >= given string, or
+  // nullopt if everything is smaller. Same as BTree::LowerBound, but
+  // iterative: each level's candidate is smaller than candidates
+  // from levels above, so we just keep last one we've seen.
+  std::optional<std::string_view> LowerBound(std::string_view str) const {
+    std::optional<std::string_view> best;
+    uint64_t offset = Header()->root_offset;
+    if (offset == 0) {
+      return best;
+    }
+    for (;;) {
+      const SnapshotNode* n = reinterpret_cast<const SnapshotNode*>(base_ + offset);
+      auto keys = n->GetKeys();
+      auto it = std::partition_point(keys.begin(), keys.end(), [&] (const SnapshotKey& k) {
+        return KeyAt(k) < str;
+      });
+      if (it != keys.end()) {
+        best.emplace(KeyAt(*it));
+      }
+      if (n->is_leaf) {
+        return best;
+      }
+      offset = n->GetChildren()[it - keys.begin()];
+    }
+  }
+
+private:
+  const SnapshotHeader* Header() const {
+    return reinterpret_cast<const SnapshotHeader*>(base_);
+  }
+
+  std::string_view KeyAt(const SnapshotKey& k) const {
+    return text().substr(k.offset, k.size);
+  }
+
+  const char* base_;
+  size_t size_;
+};
+
+#endif  // HAVE_BTREE_SNAPSHOTS
+
+#if HAVE_BTREE_SNAPSHOTS
+// LoadSnapshotAndSearch is what we do instead of building the tree
+// when given --load-snapshot=FILE.
+void LoadSnapshotAndSearch(const std::string& path) {
+  MappedBTree mapped{path};
+  std::string_view text = mapped.text();
+  printf("mapped snapshot `%s'. text size = %zu\n", path.c_str(), text.size());
+
+  auto it = mapped.LowerBound("the Roman Empire");
+  if (!it) {
+    printf("failed to find lower bound\n");
+    abort();
+  }
+
+  size_t off = it->data() - text.data();
+  printf("off = %zu\n", off);
+
+  printf("context of last(ish) occurrence of 'the Roman Empire':\n");
+  PrintOccurenceContext(text, off);
+}
+#endif
+
+#ifndef NDEBUG
+// CheckEraseAndIteration exercises iterators, Erase and EraseRange on
+// a copy of given tree. Copy shares all nodes with the original, so
+// this also checks that erasing leaves the original version intact.
+template <int kWidthParam>
+void CheckEraseAndIteration(const BTree<kWidthParam>& tree, std::string_view s) {
+  auto count = [] (const BTree<kWidthParam>& t) -> size_t {
+    size_t forward = 0;
+    for (auto it = t.First(); it.Valid(); it.Next()) {
+      if (forward % 61 == 0) {
+        assert(t.Rank(*it) == forward);
+        assert(*t.Select(forward) == *it);
+      }
+      forward++;
+    }
+    assert(t.Select(forward) == nullptr);
+    size_t backward = 0;
+    for (auto it = t.Last(); it.Valid(); it.Prev()) {
+      backward++;
+    }
+    assert(forward == backward);
+    return forward;
+  };
+
+  size_t expected = s.size();
+  assert(count(tree) == expected);
+
+  BTree<kWidthParam> copy;
+  copy.root.emplace(*tree.root);
+
+  for (size_t pos = 0; pos < s.size(); pos += 3) {
+    bool erased = copy.Erase(s.substr(pos));
+    assert(erased); (void)erased;
+    expected--;
+  }
+  assert(!copy.Erase(s.substr(0)));
+  copy.Validate();
+  assert(count(copy) == expected);
+
+  size_t in_range = 0;
+  for (auto it = copy.Seek("the"); it.Valid() && *it < "thf"; it.Next()) {
+    in_range++;
+  }
+  assert(copy.CountRange("the", "thf") == in_range);
+  assert(copy.CountPrefix("the") == in_range);
+  size_t erased = copy.EraseRange("the", "thf");
+  assert(erased == in_range);
+  copy.Validate();
+  expected -= erased;
+  assert(count(copy) == expected);
+  auto it = copy.Seek("the");
+  assert(!it.Valid() || *it >= "thf");
+
+  // Erase the rest, so that we go through all the merges down to
+  // empty tree.
+  for (size_t pos = 0; pos < s.size(); pos++) {
+    expected -= copy.Erase(s.substr(pos));
+  }
+  assert(expected == 0 && !copy.root);
+
+  assert(count(tree) == s.size());
+  printf("erase and iteration checks passed\n");
+}
+
+// CheckDiffAndUnion builds a couple of versions of given tree (which
+// must have every suffix of s) by erasing keys and checks Diff and
+// Union of those.
+template <int kWidthParam>
+void CheckDiffAndUnion(const BTree<kWidthParam>& tree, std::string_view s) {
+  using Node = typename BTree<kWidthParam>::Node;
+  auto diff_size = [] (const Node* a, const Node* b) -> size_t {
+    size_t count = 0;
+    BTree<kWidthParam>::Diff(a, b, [&count] (std::string_view, bool) { count++; });
+    return count;
+  };
+
+  // odd has suffixes at odd positions and even at even ones.
+  BTree<kWidthParam> odd;
+  BTree<kWidthParam> even;
+  odd.root.emplace(*tree.root);
+  even.root.emplace(*tree.root);
+  for (size_t pos = 0; pos < s.size(); pos++) {
+    bool erased = ((pos % 2) ? even : odd).Erase(s.substr(pos));
+    assert(erased); (void)erased;
+  }
+
+  size_t removed = 0;
+  BTree<kWidthParam>::Diff(tree.root->Get(), odd.root->Get(), [&] (std::string_view key, bool added) {
+    assert(!added && (key.data() - s.data()) % 2 == 0);
+    removed++;
+  });
+  assert(removed == (s.size() + 1) / 2);
+  assert(diff_size(odd.root->Get(), even.root->Get()) == s.size());
+  assert(diff_size(tree.root->Get(), tree.root->Get()) == 0);
+
+  BTree<kWidthParam> merged;
+  merged.root.emplace(*BTree<kWidthParam>::Union(odd.root->Get(), even.root->Get()));
+  merged.Validate();
+  assert(diff_size(merged.root->Get(), tree.root->Get()) == 0);
+
+  // Small change on top of big tree. Diff and Union only deal with
+  // changed paths.
+  BTree<kWidthParam> changed;
+  changed.root.emplace(*tree.root);
+  changed.Erase(s.substr(s.size() / 2));
+  changed.Erase(s.substr(s.size() / 3));
+  assert(diff_size(tree.root->Get(), changed.root->Get()) == 2);
+  merged.root.emplace(*BTree<kWidthParam>::Union(changed.root->Get(), tree.root->Get()));
+  merged.Validate();
+  assert(diff_size(merged.root->Get(), tree.root->Get()) == 0);
+
+  printf("diff and union checks passed\n");
+}
+#endif
+
+// BenchmarkWidth builds suffix tree with given node width and prints
+// one row of --sweep-widths table: insertion and lookup throughput
+// and memory per key.
+template <int kWidth>
+void BenchmarkWidth(std::string_view s) {
+  using Node = typename BTree<kWidth>::Node;
+  using Clock = std::chrono::steady_clock;
+  auto seconds_since = [] (Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+  };
+
+  BTree<kWidth> tree;
+  auto start = Clock::now();
+  for (int pos = s.size() - 1; pos >= 0; pos--) {
+    tree.Insert(s.substr(pos));
+  }
+  double insert_seconds = seconds_since(start);
+
+  // Same probes as concurrent readers do (see ConcurrentReaders).
+  static constexpr size_t kLookups = size_t{1} << 20;
+  std::minstd_rand rng(1);
+  size_t hits = 0;
+  start = Clock::now();
+  for (size_t i = 0; i < kLookups; i++) {
+    std::string_view probe = s.substr(rng() % s.size(), ConcurrentReaders::kProbeSize);
+    const std::string_view* it = tree.LowerBound(probe);
+    hits += (it && it->starts_with(probe));
+  }
+  double lookup_seconds = seconds_since(start);
+
+  MemoryStats stats;
+  tree.AccountMemory(&stats);
+  double keys = stats.key_count();
+  printf("%6d %6d %6zu %6d %12.2f %12.2f %10.2f %10.2f %6.1f%%\n",
+         Node::kWidth, Node::kLeafWidth, sizeof(Node), tree.Validate(),
+         keys / insert_seconds / 1e6, kLookups / lookup_seconds / 1e6,
+         stats.requested_bytes() / keys, stats.logical_bytes() / keys,
+         100.0 * hits / kLookups);
+}
+
+template <int... kWidths>
+void SweepWidths(std::string_view s) {
+  printf("%6s %6s %6s %6s %12s %12s %10s %10s %7s\n",
+         "width", "leaf", "node", "height", "Minserts/s", "Mlookups/s",
+         "bytes/key", "used/key", "hits");
+  (BenchmarkWidth<kWidths>(s), ...);
+}
+
 int main(int argc, char** argv) {
-  BTree locations; // we want to clean up btree last so that heap
+  std::optional<std::string_view> snapshot_path = ConsumeFlag(&argc, &argv, "--snapshot");
+  std::optional<std::string_view> load_snapshot_path = ConsumeFlag(&argc, &argv, "--load-snapshot");
+  std::optional<std::string_view> readers_flag = ConsumeFlag(&argc, &argv, "--readers");
+  std::optional<std::string_view> sweep_flag = ConsumeFlag(&argc, &argv, "--sweep-widths");
+  std::optional<std::string_view> transient_flag = ConsumeFlag(&argc, &argv, "--transient");
+  int num_readers = readers_flag ? atoi(std::string{*readers_flag}.c_str()) : 0;
+  if (num_readers && !CONCURRENT_READERS) {
+    fprintf(stderr, "--readers=N requires build with CONCURRENT_READERS (see -concurrent variant)\n");
+    exit(1);
+  }
+  if (sweep_flag) {
+    // Cache-line-ish multiples of node sizes from 8 to 64 keys, plus
+    // our default.
+    SweepWidths<8, 12, 16, kDefaultNodeWidth, 24, 32, 48, 64>(ReadRomanHistoryText());
+    return 0;
+  }
+#if HAVE_BTREE_SNAPSHOTS
+  if (load_snapshot_path) {
+    LoadSnapshotAndSearch(std::string{*load_snapshot_path});
+    return 0;
+  }
+#else
+  if (snapshot_path || load_snapshot_path) {
+    fprintf(stderr, "btree snapshots are not supported on this platform\n");
+    exit(1);
+  }
+#endif
+
+  BTree<> locations; // we want to clean up btree last so that heap
                    // sample dump we arrange just below, happens while
                    // btree is still populated.
 
@@ -608,27 +2370,119 @@ int main(int argc, char** argv) {
   AtomicFlag stop_req;
   auto sigint_cleanup = SignalHelper::OnSIGINT(&stop_req);
 
+  using Node = BTree<>::Node;
   printf("kWidth: %d, kLeafWidth: %d, Node size: %zu, kInternalSize: %zu\n", Node::kWidth, Node::kLeafWidth, sizeof(Node), size_t{Node::kInternalSize});
 
+#if CONCURRENT_READERS
+  // Readers look up random substrings in whatever version is
+  // published while we keep inserting. We publish new version every
+  // kPublishInterval insertions.
+  static constexpr size_t kPublishInterval = 1024;
+  std::optional<ConcurrentReaders> readers;
+  if (num_readers) {
+    readers.emplace(num_readers, s, [&locations] (std::span<const std::string_view> probes) -> size_t {
+      std::optional<BTree<>::NodePtr> snapshot = locations.Snapshot();
+      if (!snapshot) {
+        return 0;
+      }
+      size_t hits = 0;
+      for (std::string_view probe : probes) {
+        const std::string_view* it = BTree<>::LowerBound(snapshot->Get(), probe);
+        assert(!it || *it >= probe);
+        hits += (it && it->starts_with(probe));
+      }
+      return hits;
+    });
+  }
+#endif
+
+  // With --transient we build via BTree::Transient and freeze it
+  // into locations whenever we need immutable version.
+  std::optional<BTree<>::Transient> transient;
+  if (transient_flag) {
+    transient.emplace();
+  }
+
+  MemoryStats memory_stats;
   for (int pos = s.size() - 1; pos >= 0; pos--) {
-    locations.Insert(std::string_view{s}.substr(pos));
+    if (transient) {
+      transient->Insert(std::string_view{s}.substr(pos));
+    } else {
+      locations.Insert(std::string_view{s}.substr(pos));
+    }
     if (stop_req) {
       fprintf(stderr, "interrupted insertions by seeing SIGINT\n");
       break;
     }
+#if CONCURRENT_READERS
+    if (num_readers && (s.size() - pos) % kPublishInterval == 0) {
+      if (transient) {
+        transient->Freeze(&locations);
+      }
+      locations.Publish();
+    }
+#endif
 #ifndef NDEBUG
     size_t num_inserted = s.size() - pos;
     // We want to validate often when we're at small tree, but
     // otherwise avoid O(N^2) blowup in debug builds.
     if (num_inserted < 128 || (num_inserted & (num_inserted - 1)) == 0) {
+      if (transient) {
+        transient->Freeze(&locations);
+      }
       locations.Validate();
       printf("inserted %zu suffixes so far\n", num_inserted);
     }
 #endif
   }
 
+  if (transient) {
+    transient->Freeze(&locations);
+    // Drop transient's reference, so that nodes are unshared again
+    // (and erase/insert fast-paths work).
+    transient.reset();
+  }
+
+#if CONCURRENT_READERS
+  if (readers) {
+    locations.Publish();
+    readers->Stop();
+  }
+#endif
+
 #ifndef NDEBUG
   printf("Tree height we built is %d\n", locations.Validate());
+  if (!stop_req) {
+    CheckEraseAndIteration(locations, s);
+    CheckDiffAndUnion(locations, s);
+  }
+#endif
+
+  if (MemoryStats::Enabled()) {
+    locations.AccountMemory(&memory_stats);
+    memory_stats.Print("persistent btree");
+  }
+
+#if HAVE_BTREE_SNAPSHOTS
+  if (snapshot_path) {
+    std::string path{*snapshot_path};
+    WriteSnapshot(locations, s, path);
+    printf("wrote snapshot to `%s'\n", path.c_str());
+#ifndef NDEBUG
+    // Lets make sure mapped snapshot finds exactly what we find.
+    MappedBTree mapped{path};
+    assert(mapped.text() == s);
+    for (size_t pos = 0; pos < s.size(); pos += 97) {
+      for (std::string_view probe : {std::string_view{s}.substr(pos, 8), std::string_view{s}.substr(pos)}) {
+        const std::string_view* expected = locations.LowerBound(probe);
+        std::optional<std::string_view> got = mapped.LowerBound(probe);
+        bool ok = (expected == nullptr) ? !got.has_value()
+          : (got.has_value() && got->data() - mapped.text().data() == expected->data() - s.data());
+        assert(ok); if (!ok) { abort(); }
+      }
+    }
+#endif
+  }
 #endif
 
   auto it = locations.LowerBound("the Roman Empire");
@@ -639,4 +2493,15 @@ int main(int argc, char** argv) {
 
   printf("context of last(ish) occurrence of 'the Roman Empire':\n");
   PrintOccurenceContext(s, off);
+
+  size_t occurrences = locations.CountPrefix("the Roman Empire");
+#ifndef NDEBUG
+  size_t scanned = 0;
+  for (auto i = locations.Seek("the Roman Empire");
+       i.Valid() && (*i).starts_with("the Roman Empire"); i.Next()) {
+    scanned++;
+  }
+  assert(scanned == occurrences);
+#endif
+  printf("'the Roman Empire' occurs %zu times\n", occurrences);
 }
@@ -8,11 +8,13 @@
 #include "absl/container/btree_set.h"
 
 #include "demo-helper.h"
+#include "prefixed-key.h"
 
 struct Loc {
-  const std::string_view data;
+  const SuffixKey data;
 
   Loc(std::string_view data) : data(data) {}
+  Loc(const SuffixKey& data) : data(data) {}
 };
 
 struct LocLess {
@@ -20,23 +22,30 @@ struct LocLess {
     return a.data < b.data;
   }
   bool operator()(std::string_view a, const Loc& b) const {
-    return a < b.data;
+    return SuffixKey{a} < b.data;
   }
 };
 
 int main(int argc, char** argv) {
   // NOTE, we want this to be destroyed after heap sample dump we
   // setup just below.
-  absl::btree_set<Loc, LocLess> locations;
+  absl::btree_set<Loc, LocLess, CountingAllocator<Loc>> locations;
 
   auto sampling_cleanup = MaybeSetupHeapSampling(argc, argv);
   std::string s = ReadRomanHistoryText();
 
+  MemoryStats memory_stats;
   for (int pos = s.size() - 1; pos >= 0; pos--) {
     Loc l = Loc{std::string_view{s}.substr(pos)};
     locations.insert(l);
   }
 
+  if (MemoryStats::Enabled()) {
+    memory_stats.AddKeys(locations.size());
+    AllocationCounts::Global()->AccountMemory(&memory_stats);
+    memory_stats.Print("absl::btree_set");
+  }
+
   auto it = locations.lower_bound(std::string_view{"the Roman Empire"});
   assert(it != locations.end());
 
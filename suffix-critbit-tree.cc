@@ -2,17 +2,28 @@
 #include <string>
 #include <string_view>
 #include <algorithm>
+#include <type_traits>
+#include <vector>
 
 #include <assert.h>
 #include <stdio.h>
 
+#include "compact-critbit-tree.h"
 #include "critbit-tree.h"
 #include "demo-helper.h"
 
+// Build with -DUSE_COMPACT_CRITBIT=1 to use array-based critbit tree
+// from compact-critbit-tree.h (see -compact variant).
+#ifndef USE_COMPACT_CRITBIT
+#define USE_COMPACT_CRITBIT 0
+#endif
+
+using Tree = std::conditional_t<USE_COMPACT_CRITBIT, CompactCritBitTree, CritBitTree>;
+
 int main(int argc, char** argv) {
   // NOTE, we want this to be destroyed after heap sample dump we
   // setup just below.
-  CritBitTree locations;
+  Tree locations;
 
   auto sampling_cleanup = MaybeSetupHeapSampling(argc, argv);
   std::string s = ReadRomanHistoryText();
@@ -20,6 +31,7 @@ int main(int argc, char** argv) {
   AtomicFlag stop_req;
   auto sigint_cleanup = SignalHelper::OnSIGINT(&stop_req);
 
+  MemoryStats memory_stats;
   for (int pos = s.size() - 1; pos >= 0; pos--) {
     locations.Insert(std::string_view{s}.substr(pos));
     if (stop_req) {
@@ -32,39 +44,54 @@ int main(int argc, char** argv) {
   locations.ValidateInvariants();
 #endif
 
-  const std::string_view* it;
+  if (MemoryStats::Enabled()) {
+    locations.AccountMemory(&memory_stats);
+    memory_stats.Print("critbit tree");
+  }
+
+  // Every key with our prefix is in one subtree, so we get them all
+  // with a single descent.
   const std::string_view prefix = "the Roman Empire";
-  it = locations.LowerBound(prefix);
-  if (!it) {
+  const std::string_view* farthest_result = nullptr;
+  size_t seen_hits = 0;
+  locations.ForEachWithPrefix(prefix, [&] (const std::string_view& key) {
+    if (!farthest_result || key.data() > farthest_result->data()) {
+      farthest_result = &key;
+    }
+    seen_hits++;
+  });
+  if (!farthest_result) {
     fprintf(stderr, "didn't find?\n");
     abort();
   }
+  if (locations.CountPrefix(prefix) != seen_hits) { abort(); }
 
-  const std::string_view* farthest_result = it;
-  size_t seen_hits = 1;
-  for (;;) {
-    auto nextit = locations.LowerBound(*it, true);
-    if (!nextit || !nextit->starts_with(prefix)) {
-      break;
-    }
-    if (nextit->data() == it->data()) { abort(); }
-    if (nextit->data() > farthest_result->data()) {
-      farthest_result = nextit;
-    }
-
-    {
-      size_t lcp = std::mismatch(it->begin(), it->end(),
-                                 nextit->begin(), nextit->end()).first - it->begin();
-      std::string test_s{it->substr(0, lcp + 1)};
-      test_s[lcp]++;
-      auto testit = locations.LowerBound(std::string_view{test_s});
-      if (testit != nextit) { abort(); }
+#ifndef NDEBUG
+  // Cross-check against stepping through matches with LowerBound.
+  {
+    std::vector<const std::string_view*> hits;
+    locations.ForEachWithPrefix(prefix, [&hits] (const std::string_view& key) {
+      hits.push_back(&key);
+    });
+    const std::string_view* it = locations.LowerBound(prefix);
+    for (size_t i = 0; i < hits.size(); i++) {
+      if (it != hits[i]) { abort(); }
+      auto nextit = locations.LowerBound(*it, true);
+      if (nextit) {
+        size_t lcp = std::mismatch(it->begin(), it->end(),
+                                   nextit->begin(), nextit->end()).first - it->begin();
+        std::string test_s{it->substr(0, lcp + 1)};
+        test_s[lcp]++;
+        auto testit = locations.LowerBound(std::string_view{test_s});
+        if (testit != nextit) { abort(); }
+      }
+      it = nextit;
     }
-
-    seen_hits++;
-    it = nextit;
+    if (it && it->starts_with(prefix)) { abort(); }
   }
-  it = farthest_result;
+#endif
+
+  const std::string_view* it = farthest_result;
   printf("seen_hits: %zu\n", seen_hits);
 
   size_t off = it->data() - s.data();
@@ -12,21 +12,23 @@
 #include <optional>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include <assert.h>
 #include <stdio.h>
 
 #include "demo-helper.h"
+#include "node-pool.h"
 
 // Node struct updated with a parent pointer and a constructor.
 struct Node {
   std::string_view value;
-  Node* parent;
-  Node* left;
-  Node* right;
+  NodeRef<Node> parent;
+  NodeRef<Node> left;
+  NodeRef<Node> right;
 
   // Constructor for easier node creation.
-  Node(std::string_view val, Node* p)
+  Node(std::string_view val, NodeRef<Node> p)
       : value(val), parent(p), left(nullptr), right(nullptr) {}
 };
 
@@ -34,23 +36,23 @@ namespace {
 
 // --- Rotation Helpers ---
 // Single rotations are used only for the Zig case (parent is the root).
-void RightRotate(Node* p);
-void LeftRotate(Node* p);
+void RightRotate(NodeRef<Node> p);
+void LeftRotate(NodeRef<Node> p);
 
 // Optimized double rotation helpers that inline two single rotations.
-void RotateZigZigLeftLeft(Node* g);
-void RotateZigZigRightRight(Node* g);
-void RotateZigZagLeftRight(Node* g);
-void RotateZigZagRightLeft(Node* g);
+void RotateZigZigLeftLeft(NodeRef<Node> g);
+void RotateZigZigRightRight(NodeRef<Node> g);
+void RotateZigZagLeftRight(NodeRef<Node> g);
+void RotateZigZagRightLeft(NodeRef<Node> g);
 
 
 // --- Splay and Insert Logic ---
 
 // Splays the given node 'x' up to the root of the tree.
-void Splay(Node* x) {
+void Splay(NodeRef<Node> x) {
   while (x->parent) {
-    Node* p = x->parent;
-    Node* g = p->parent;
+    NodeRef<Node> p = x->parent;
+    NodeRef<Node> g = p->parent;
 
     if (!g) {
       // Zig case: Parent is the root.
@@ -80,10 +82,10 @@ void Splay(Node* x) {
 
 // Inserts a value, assuming it does not already exist in the tree.
 // The root is passed by reference.
-void Insert(Node*& root, std::string_view value) {
+void Insert(NodeRef<Node>& root, std::string_view value) {
   // --- Phase 1: Find the insertion point using a pointer-to-pointer ---
-  Node** link = &root;
-  Node* parent = nullptr;
+  NodeRef<Node>* link = &root;
+  NodeRef<Node> parent = nullptr;
 
   while (*link) {
     parent = *link;
@@ -97,7 +99,7 @@ void Insert(Node*& root, std::string_view value) {
   // --- Phase 2: Create, link, and splay the new node ---
   // 'parent' is the correct parent for the new node.
   // 'link' points to the parent's child pointer that is currently null.
-  Node* new_node = new Node(value, parent);
+  NodeRef<Node> new_node = NewNode<Node>(value, parent);
   *link = new_node;
 
   Splay(new_node);
@@ -107,9 +109,9 @@ void Insert(Node*& root, std::string_view value) {
 
 // --- Implementations for rotation helpers ---
 
-void RightRotate(Node* p) {
-  Node* x = p->left;
-  Node* grandparent = p->parent;
+void RightRotate(NodeRef<Node> p) {
+  NodeRef<Node> x = p->left;
+  NodeRef<Node> grandparent = p->parent;
   if (grandparent) {
     if (grandparent->left == p) {
       grandparent->left = x;
@@ -126,9 +128,9 @@ void RightRotate(Node* p) {
   if (x) x->right = p;
 }
 
-void LeftRotate(Node* p) {
-  Node* x = p->right;
-  Node* grandparent = p->parent;
+void LeftRotate(NodeRef<Node> p) {
+  NodeRef<Node> x = p->right;
+  NodeRef<Node> grandparent = p->parent;
   if (grandparent) {
     if (grandparent->left == p) {
       grandparent->left = x;
@@ -145,10 +147,10 @@ void LeftRotate(Node* p) {
   if (x) x->left = p;
 }
 
-void RotateZigZigLeftLeft(Node* g) {
-  Node* p = g->left;
-  Node* x = p->left;
-  Node* const gg = g->parent;
+void RotateZigZigLeftLeft(NodeRef<Node> g) {
+  NodeRef<Node> p = g->left;
+  NodeRef<Node> x = p->left;
+  const NodeRef<Node> gg = g->parent;
 
   g->left = p->right;
   if (g->left) g->left->parent = g;
@@ -172,10 +174,10 @@ void RotateZigZigLeftLeft(Node* g) {
   }
 }
 
-void RotateZigZigRightRight(Node* g) {
-  Node* p = g->right;
-  Node* x = p->right;
-  Node* const gg = g->parent;
+void RotateZigZigRightRight(NodeRef<Node> g) {
+  NodeRef<Node> p = g->right;
+  NodeRef<Node> x = p->right;
+  const NodeRef<Node> gg = g->parent;
 
   g->right = p->left;
   if (g->right) g->right->parent = g;
@@ -199,10 +201,10 @@ void RotateZigZigRightRight(Node* g) {
   }
 }
 
-void RotateZigZagLeftRight(Node* g) {
-  Node* p = g->left;
-  Node* x = p->right;
-  Node* const gg = g->parent;
+void RotateZigZagLeftRight(NodeRef<Node> g) {
+  NodeRef<Node> p = g->left;
+  NodeRef<Node> x = p->right;
+  const NodeRef<Node> gg = g->parent;
 
   p->right = x->left;
   if (p->right) p->right->parent = p;
@@ -226,10 +228,10 @@ void RotateZigZagLeftRight(Node* g) {
   }
 }
 
-void RotateZigZagRightLeft(Node* g) {
-  Node* p = g->right;
-  Node* x = p->left;
-  Node* const gg = g->parent;
+void RotateZigZagRightLeft(NodeRef<Node> g) {
+  NodeRef<Node> p = g->right;
+  NodeRef<Node> x = p->left;
+  const NodeRef<Node> gg = g->parent;
 
   p->left = x->right;
   if (p->left) p->left->parent = p;
@@ -256,7 +258,7 @@ void RotateZigZagRightLeft(Node* g) {
 }  // anonymous namespace
 
 struct SplayTree {
-  Node* root = nullptr;
+  NodeRef<Node> root = nullptr;
 
   ~SplayTree() {
     Clear();
@@ -323,18 +325,22 @@ struct SplayTree {
     }
   }
 
+  void AccountMemory(MemoryStats* stats) const {
+    AccountBinaryTreeMemory<Node>(root, stats);
+  }
+
   void Clear() {
     // Note, recursion is potentially unsafe here, but this code is
     // not pretending to be production, so lets keep it uncomplicated.
     struct Deleter {
       size_t total_deleted = 0;
-      void Rec(Node* n) {
+      void Rec(NodeRef<Node> n) {
         if (n == nullptr) {
           return;
         }
         Rec(n->left);
-        Node* r = n->right;
-        delete n;
+        NodeRef<Node> r = n->right;
+        DeleteNode(n);
         total_deleted++;
         Rec(r);
       }
@@ -348,6 +354,14 @@ struct SplayTree {
 #endif
     (void)d.total_deleted;
   }
+
+  // ReleaseAll drops every pooled node at once, instead of Clear-ing
+  // them one by one. It drops nodes of every splay tree, so caller
+  // has to make sure no tree with nodes is used (or destroyed)
+  // afterwards.
+  static void ReleaseAll() {
+    NodePool<Node>::Clear();
+  }
 };
 
 int main(int argc, char** argv) {
@@ -360,6 +374,7 @@ int main(int argc, char** argv) {
   AtomicFlag stop_req;
   auto sigint_cleanup = SignalHelper::OnSIGINT(&stop_req);
 
+  MemoryStats memory_stats;
   for (int pos = s.size() - 1; pos >= 0; pos--) {
     locations.InsertBottomUp(std::string_view{s}.substr(pos));
     if (stop_req) {
@@ -381,6 +396,11 @@ int main(int argc, char** argv) {
   locations.Validate(true);
 #endif
 
+  if (MemoryStats::Enabled()) {
+    locations.AccountMemory(&memory_stats);
+    memory_stats.Print("splay tree (classic)");
+  }
+
   const Node* it = locations.LowerBound("the Roman Empire");
   assert(it);
 
@@ -389,4 +409,12 @@ int main(int argc, char** argv) {
 
   printf("context of last(ish) occurrence of 'the Roman Empire':\n");
   PrintOccurenceContext(s, off);
+
+  if (USE_NODE_POOL) {
+    // Instead of deleting nodes one by one, we drop entire pool at
+    // once. But heap sample has to see populated tree first.
+    sampling_cleanup.DumpHeapSampleNow();
+    locations.root = nullptr;
+    SplayTree::ReleaseAll();
+  }
 }
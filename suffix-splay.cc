@@ -1,33 +1,38 @@
 // -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
 // #undef NDEBUG
 #include <algorithm>
+#include <chrono>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include <assert.h>
 #include <stdio.h>
 
 #include "demo-helper.h"
+#include "frozen-tree.h"
+#include "node-pool.h"
+#include "prefixed-key.h"
 
 struct Node {
-  const std::string_view value;
+  const SuffixKey value;
 
-  Node* left;
-  Node* right;
+  NodeRef<Node> left;
+  NodeRef<Node> right;
 
   explicit Node(std::string_view value) : value(value), left{}, right{} {}
 };
 
 struct SplayTree {
-  Node* root = nullptr;
+  NodeRef<Node> root = nullptr;
 
   ~SplayTree() {
     Clear();
   }
 
   void InsertMoveToTop(std::string_view value) {
-    Node* node = new Node(value);
+    NodeRef<Node> node = NewNode<Node>(value);
 
     struct Split {
       // Splits given search tree root into one tree with elements
@@ -41,8 +46,8 @@ struct SplayTree {
       // Note, this is not splaying as it lacks handling of "zig-zig"
       // case which is crucial for reaching amortized O(log N)
       // bound. See below for actual splay-ful insert routine.
-      static void Rec(std::string_view value, Node* node,
-                      Node** place_left, Node** place_right) {
+      static void Rec(const SuffixKey& value, NodeRef<Node> node,
+                      NodeRef<Node>* place_left, NodeRef<Node>* place_right) {
         if (!node) {
           *place_left = nullptr;
           *place_right = nullptr;
@@ -59,23 +64,24 @@ struct SplayTree {
       }
     };
 
-    Split::Rec(value, root, &node->left, &node->right);
+    Split::Rec(node->value, root, &node->left, &node->right);
     root = node;
   }
 
   // This is trivial unbalanced "insert at the bottom" routine.
   void NonSplayUnbalancedInsert(std::string_view value) {
-    Node** parent_place = &root;
-    Node* node = root;
+    const SuffixKey key{value};
+    NodeRef<Node>* parent_place = &root;
+    NodeRef<Node> node = root;
     while (node) {
-      if (node->value < value) {
+      if (node->value < key) {
         parent_place = &node->right;
       } else {
         parent_place = &node->left;
       }
       node = *parent_place;
     }
-    *parent_place = new Node(value);
+    *parent_place = NewNode<Node>(value);
   }
 
   // SplitOp is the combination of split and splay. For basic idea
@@ -86,23 +92,24 @@ struct SplayTree {
   // avoiding duplicate comparisons pushes us into less then simplest
   // code.
   //
-  // We still rely on ~all decent compilers optimizing out tail-calls
-  // (and inlining Go{Left,Right} helpers below). And even with that
-  // the generated code still doesn't look entirely perfect to me. So
-  // production version of this code would likely need manual
-  // transformation into regular loop. I didn't do it here to keep
-  // closer resemblance of the "move-to-top" Split above.
+  // Rec relies on ~all decent compilers optimizing out tail-calls
+  // (and inlining Go{Left,Right} helpers below). It is kept to
+  // closely resemble the "move-to-top" Split above. Loop is the same
+  // thing manually transformed into regular loop, and that is what
+  // InsertLoop and LowerBound use.
+  //
+  // Nodes equal to value go to the right tree. Insert never has
+  // those, but LowerBound relies on it.
   struct SplitOp {
-    static void Rec(std::string_view value, bool value_is_less,
-                    Node* root, Node** place_left, Node** place_right) {
-      // We silently assume root->value == value won't happen. It
-      // won't be hard to handle this, but our toy use-case doesn't
-      // need it.
+    static void Rec(const SuffixKey& value, bool value_is_less,
+                    NodeRef<Node> root, NodeRef<Node>* place_left, NodeRef<Node>* place_right) {
+      // value_is_less is really value <= root->value, so node equal
+      // to value goes to the right tree (see above).
       if (value_is_less) {
         // value "belongs to" left subtree
-        Node* l = root->left;
+        NodeRef<Node> l = root->left;
         if (l) {
-          if (value < l->value) {
+          if (value <= l->value) {
             // "double left" case. This is zig-zig op. So we first
             // "pull" l to be higher than root and then split at l.
             root->left = l->right;
@@ -119,7 +126,7 @@ struct SplayTree {
         return GoLeft<false, false>(value, root, l, place_left, place_right);
       } else {
         // "Right" case is mirror of left.
-        Node* r = root->right;
+        NodeRef<Node> r = root->right;
         if (r) {
           if (value > r->value) {
             root->right = r->left;
@@ -135,53 +142,169 @@ struct SplayTree {
     }
 
     template <bool comparison_known, bool value_is_less>
-    static void GoLeft(std::string_view value, Node* root, Node* l,
-                       Node** place_left, Node** place_right) {
+    static void GoLeft(const SuffixKey& value, NodeRef<Node> root, NodeRef<Node> l,
+                       NodeRef<Node>* place_left, NodeRef<Node>* place_right) {
       *place_right = root;
       if (!comparison_known && !l) {
         *place_left = root->left = nullptr;
         return;
       }
-      bool v_is_less = comparison_known ? value_is_less : (value < l->value);
+      bool v_is_less = comparison_known ? value_is_less : (value <= l->value);
       Rec(value, v_is_less, l, place_left, &root->left);
     }
     template <bool comparison_known, bool value_is_less>
-    static void GoRight(std::string_view value, Node* root, Node* r,
-                        Node** place_left, Node** place_right) {
+    static void GoRight(const SuffixKey& value, NodeRef<Node> root, NodeRef<Node> r,
+                        NodeRef<Node>* place_left, NodeRef<Node>* place_right) {
       *place_left = root;
       if (!comparison_known && !r) {
         root->right = *place_right = nullptr;
         return;
       }
-      bool v_is_less = comparison_known ? value_is_less : (value < r->value);
+      bool v_is_less = comparison_known ? value_is_less : (value <= r->value);
       Rec(value, v_is_less, r, &root->right, place_right);
     }
+
+    // Loop is exactly the same split as Rec, but as explicit loop. So
+    // it doesn't depend on compiler eliminating tail calls (which
+    // isn't guaranteed in C++, and doesn't happen at -O0 or with some
+    // sanitizers). comparison_known/value_is_less play the role of
+    // Go{Left,Right}'s template parameters.
+    static void Loop(const SuffixKey& value, NodeRef<Node> root,
+                     NodeRef<Node>* place_left, NodeRef<Node>* place_right) {
+      bool comparison_known = false;
+      bool value_is_less = false;
+      while (root) {
+        if (!comparison_known) {
+          value_is_less = (value <= root->value);
+        }
+        comparison_known = false;
+        if (value_is_less) {
+          NodeRef<Node> l = root->left;
+          if (l) {
+            if (value <= l->value) {
+              // zig-zig
+              root->left = l->right;
+              l->right = root;
+              root = l;
+            } else {
+              comparison_known = true;
+              value_is_less = false;
+            }
+          }
+          *place_right = root;
+          place_right = &root->left;
+          root = root->left;
+        } else {
+          NodeRef<Node> r = root->right;
+          if (r) {
+            if (value > r->value) {
+              root->right = r->left;
+              r->left = root;
+              root = r;
+            } else {
+              comparison_known = true;
+              value_is_less = true;
+            }
+          }
+          *place_left = root;
+          place_left = &root->right;
+          root = root->right;
+        }
+      }
+      *place_left = nullptr;
+      *place_right = nullptr;
+    }
   };
 
   void Insert(std::string_view value) {
-    Node* node = new Node(value);
+    NodeRef<Node> node = NewNode<Node>(value);
     if (root) {
-      SplitOp::Rec(value, (value < root->value), root, &node->left, &node->right);
+      SplitOp::Rec(node->value, (node->value < root->value), root, &node->left, &node->right);
     }
     root = node;
   }
 
+  // InsertLoop is Insert with loop-based split (see SplitOp::Loop).
+  void InsertLoop(std::string_view value) {
+    NodeRef<Node> node = NewNode<Node>(value);
+    SplitOp::Loop(node->value, root, &node->left, &node->right);
+    root = node;
+  }
+
+  // SplayLeftmost is top-down splay of the smallest node of the tree
+  // at root. It returns that node, which is now the root (and so has
+  // no left child).
+  static NodeRef<Node> SplayLeftmost(NodeRef<Node> root) {
+    NodeRef<Node> right_tree = nullptr;
+    NodeRef<Node>* place_right = &right_tree;
+    while (root->left) {
+      NodeRef<Node> l = root->left;
+      if (l->left) {
+        // zig-zig. Rotate l above root first.
+        root->left = l->right;
+        l->right = root;
+        root = l;
+      }
+      // root and it's right subtree are greater than everything
+      // under root->left, so they go to the leftmost place of right
+      // tree.
+      *place_right = root;
+      place_right = &root->left;
+      root = root->left;
+    }
+    *place_right = root->right;
+    root->right = right_tree;
+    return root;
+  }
+
   // We find smallest node that is >= than given string, or nullptr if
-  // everything is smaller than str.
-  //
-  // We choose to make LowerBound move-to-top the node we're looking
-  // for up. So returned value is new root (unless it is
-  // nullptr).
+  // everything is smaller than str. Found node is splayed to the
+  // root.
   //
-  // Also note that we're not properly splaying here to keep things
-  // simpler (see Insert vs InsertMoveToTop above). We only use lower
-  // bound a handful of times in this toy use-case, so we can keep it
-  // simpler.
+  // This is proper splaying built from our SplitOp: we split the
+  // tree at str (so everything >= str ends up in the right tree), and
+  // then splay right tree's smallest node to it's top and hang the
+  // left tree under it. We use loop version of split, so that lookups
+  // never depend on tail calls. Both steps are top-down splay operations, so
+  // we keep splay tree's amortized O(log N) bound even when lookups
+  // vastly outnumber insertions.
   const Node* LowerBound(std::string_view str) {
+    if (!root) {
+      return nullptr;
+    }
+    const SuffixKey key{str};
+    NodeRef<Node> left;
+    NodeRef<Node> right;
+    SplitOp::Loop(key, root, &left, &right);
+    if (!right) {
+      root = left;
+      return nullptr;
+    }
+    root = SplayLeftmost(right);
+    root->left = left;
+    return root;
+  }
+
+  // Find returns node that is equal to str (splayed to the root), or
+  // nullptr if there is none.
+  const Node* Find(std::string_view str) {
+    const Node* it = LowerBound(str);
+    if (it && it->value == SuffixKey{str}) {
+      return it;
+    }
+    return nullptr;
+  }
+
+  // LowerBoundMoveToTop is simpler version of LowerBound that moves
+  // found node to the top, but doesn't properly splay (see Insert vs
+  // InsertMoveToTop above). It is fine for a handful of lookups, but
+  // read-heavy workloads lose splay's amortized guarantees. We keep
+  // it to compare with (see --lookup-op).
+  const Node* LowerBoundMoveToTop(std::string_view str) {
     struct Split {
-      static void Rec(std::string_view str, Node* root,
-                      Node** place_left, Node** place_right,
-                      Node*** place_lower_bound) {
+      static void Rec(const SuffixKey& str, NodeRef<Node> root,
+                      NodeRef<Node>* place_left, NodeRef<Node>* place_right,
+                      NodeRef<Node>** place_lower_bound) {
         if (!root) {
           *place_left = *place_right = nullptr;
           return;
@@ -202,22 +325,23 @@ struct SplayTree {
       }
     };
 
-    Node** place_lower_bound = &root;
-    Node* left;
-    Node* right;
+    const SuffixKey key{str};
+    NodeRef<Node>* place_lower_bound = &root;
+    NodeRef<Node> left;
+    NodeRef<Node> right;
 
-    Split::Rec(str, root, &left, &right, &place_lower_bound);
+    Split::Rec(key, root, &left, &right, &place_lower_bound);
 
     if (place_lower_bound == &root) {
       assert(left == root);
       assert(right == nullptr);
-      if (root && root->value >= str) {
+      if (root && root->value >= key) {
         return root;
       }
       return nullptr;
     }
 
-    Node* new_root = *place_lower_bound;
+    NodeRef<Node> new_root = *place_lower_bound;
     assert(new_root->left == nullptr);
     *place_lower_bound = new_root->right;
     new_root->left = left;
@@ -244,33 +368,39 @@ struct SplayTree {
     // instead of our root node. It seems like it would take
     // approximately same amount of work. Or maybe even end up
     // touching fewer nodes, so maybe I should've done it instead.
-    struct Join {
-      static void RecLeft(Node** place_root, Node* left, Node* right) {
+    //
+    // Join is loop (and not pair of tail-recursive functions), so
+    // that long spines don't depend on tail call elimination either
+    // (see SplitOp::Loop).
+    NodeRef<Node> old_root = root;
+    NodeRef<Node>* place = &root;
+    NodeRef<Node> left = old_root->left;
+    NodeRef<Node> right = old_root->right;
+    for (bool take_left = true; ; take_left = !take_left) {
+      if (take_left) {
         if (!left) {
-          *place_root = right;
-          return;
+          *place = right;
+          break;
         }
-        *place_root = left;
-        RecRight(&left->right, left->right, right);
-      }
-      static void RecRight(Node** place_root, Node* left, Node* right) {
+        *place = left;
+        place = &left->right;
+        left = left->right;
+      } else {
         if (!right) {
-          *place_root = left;
-          return;
+          *place = left;
+          break;
         }
-        *place_root = right;
-        RecLeft(&right->left, left, right->left);
+        *place = right;
+        place = &right->left;
+        right = right->left;
       }
-    };
-
-    Node* old_root = root;
-    Join::RecLeft(&root, root->left, root->right);
-    delete old_root;
+    }
+    DeleteNode(old_root);
   }
 
   void Validate(bool print_stats) {
     struct Checker {
-      std::optional<std::string_view> prev_seen;
+      std::optional<SuffixKey> prev_seen;
       size_t total_height = 0;
       size_t node_count = 0;
 
@@ -308,13 +438,17 @@ struct SplayTree {
     }
   }
 
+  void AccountMemory(MemoryStats* stats) const {
+    AccountBinaryTreeMemory<Node>(root, stats);
+  }
+
   void Clear() {
     size_t total_deleted = 0;
-    Node* n = root;
-    Node* p = nullptr;
+    NodeRef<Node> n = root;
+    NodeRef<Node> p = nullptr;
 
     for (;;) {
-      Node* next;
+      NodeRef<Node> next;
       if (!n) {
         // when current node is absent, then we go back "up" to
         // parent.
@@ -327,7 +461,7 @@ struct SplayTree {
         p = n->left;
         next = n->right;
 
-        delete n;
+        DeleteNode(n);
         total_deleted++;
       } else {
         // before we're able to drop current node, we need to handle
@@ -347,36 +481,51 @@ struct SplayTree {
 #endif
     (void)total_deleted;
   }
-};
 
-void MaybeSetupInsertOp(int* argc, char*** argv,
-                        void (SplayTree::** insert_op_var)(std::string_view)) {
-  static constexpr std::string_view kInsertOp = "--insert-op=";
-  std::string_view arg = (*argv)[1];
-  if (!arg.starts_with(kInsertOp)) {
-    return;
+  // ReleaseAll drops every pooled node at once, instead of Clear-ing
+  // them one by one. It drops nodes of every splay tree, so caller
+  // has to make sure no tree with nodes is used (or destroyed)
+  // afterwards.
+  static void ReleaseAll() {
+    NodePool<Node>::Clear();
   }
+};
 
-  (*argv)++;
-  (*argc)--;
-
-  arg = arg.substr(kInsertOp.size());
-  if (arg == "splay") {
-    *insert_op_var = &SplayTree::Insert;
-  } else if (arg == "move-to-top") {
-    *insert_op_var = &SplayTree::InsertMoveToTop;
-  } else if (arg == "naive") {
-    *insert_op_var = &SplayTree::NonSplayUnbalancedInsert;
-  } else {
-    fprintf(stderr, "--insert-op can be one of the splay, classic, move-to-top or naive\n");
+int main(int argc, char** argv) {
+  std::optional<std::string_view> lookups_flag = ConsumeFlag(&argc, &argv, "--lookups");
+  size_t num_lookups = lookups_flag ? strtoull(std::string{*lookups_flag}.c_str(), nullptr, 10) : 0;
+  std::optional<std::string_view> lookup_op_flag = ConsumeFlag(&argc, &argv, "--lookup-op");
+  const bool move_to_top_lookups = (lookup_op_flag == "move-to-top");
+  if (lookup_op_flag && !move_to_top_lookups && lookup_op_flag != "splay") {
+    fprintf(stderr, "--lookup-op can be one of the splay or move-to-top\n");
     exit(1);
   }
-}
 
-int main(int argc, char** argv) {
+  auto freeze = FreezeOption<SuffixKey>::FromFlags(&argc, &argv);
+
+  std::optional<std::string_view> insert_op_flag = ConsumeFlag(&argc, &argv, "--insert-op");
   void (SplayTree::* insert_op)(std::string_view) = &SplayTree::Insert;
-  if (argc > 1) {
-    MaybeSetupInsertOp(&argc, &argv, &insert_op);
+  if (insert_op_flag == "loop") {
+    insert_op = &SplayTree::InsertLoop;
+  } else if (insert_op_flag == "move-to-top") {
+    insert_op = &SplayTree::InsertMoveToTop;
+  } else if (insert_op_flag == "naive") {
+    insert_op = &SplayTree::NonSplayUnbalancedInsert;
+  } else if (insert_op_flag && insert_op_flag != "rec") {
+    fprintf(stderr, "--insert-op can be one of the rec, loop, move-to-top or naive\n");
+    exit(1);
+  }
+
+  // --insert-order=skewed inserts suffixes in SkewedSuffixOrder
+  // (see demo-helper.h) instead of from the end of the text. This
+  // builds chain-like trees, and so is where recursive and loop split
+  // differ (see --insert-op). Validate is recursive too, so we skip
+  // it then.
+  std::optional<std::string_view> insert_order_flag = ConsumeFlag(&argc, &argv, "--insert-order");
+  const bool skewed_order = (insert_order_flag == "skewed");
+  if (insert_order_flag && !skewed_order && insert_order_flag != "text") {
+    fprintf(stderr, "--insert-order can be one of the text or skewed\n");
+    exit(1);
   }
 
   SplayTree locations; // Note, we want this destructor to run after
@@ -388,51 +537,108 @@ int main(int argc, char** argv) {
   AtomicFlag stop_req;
   auto sigint_cleanup = SignalHelper::OnSIGINT(&stop_req);
 
-  for (int pos = s.size() - 1; pos >= 0; pos--) {
+  std::vector<size_t> order;
+  if (skewed_order) {
+    order = SkewedSuffixOrder(s);
+  }
+
+  MemoryStats memory_stats;
+  auto build_start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < s.size(); i++) {
+    size_t pos = skewed_order ? order[i] : s.size() - 1 - i;
     (locations.*insert_op)(std::string_view{s}.substr(pos));
     if (stop_req) {
       fprintf(stderr, "interrupted insertions by seeing SIGINT\n");
       break;
     }
 #ifndef NDEBUG
-    size_t num_inserted = s.size() - pos;
+    size_t num_inserted = i + 1;
     // We want to validate often when we're at small tree, but
     // otherwise avoid O(N^2) blowup in debug builds.
-    if (num_inserted < 128 || (num_inserted & (num_inserted - 1)) == 0) {
+    if (!skewed_order && (num_inserted < 128 || (num_inserted & (num_inserted - 1)) == 0)) {
       locations.Validate(false);
       printf("inserted %zu suffixes so far\n", num_inserted);
     }
 #endif
   }
+  if (skewed_order) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+    printf("inserted suffixes in skewed order in %.3f sec\n", seconds);
+  }
 
 #ifndef NDEBUG
-  locations.Validate(true);
+  if (!skewed_order) {
+    locations.Validate(true);
+  }
+#endif
+
+  if (MemoryStats::Enabled()) {
+    locations.AccountMemory(&memory_stats);
+    memory_stats.Print("splay tree");
+  }
+
+  freeze.MaybeFreeze(
+    static_cast<const Node*>(locations.root), "splay tree",
+    [] (const Node* n) -> const SuffixKey& { return n->value; },
+    [] (const Node* n) -> const Node* { return n->left; },
+    [] (const Node* n) -> const Node* { return n->right; },
+    [&] () { locations.Clear(); });
+  const FrozenTree<SuffixKey>* frozen = freeze.frozen();
+
+  // Read-heavy benchmark. --lookups=N runs N lookups with either
+  // LowerBound version (see --lookup-op), or against frozen copy.
+  freeze.RunLookups(s, num_lookups, [&] (std::string_view probe) {
+    const Node* it = move_to_top_lookups ? locations.LowerBoundMoveToTop(probe) : locations.LowerBound(probe);
+    return it && it->value.starts_with(probe);
+  });
+#ifndef NDEBUG
+  if (num_lookups && !frozen && !skewed_order) {
+    locations.Validate(true);
+  }
 #endif
 
   static constexpr std::string_view kSearchString = "the Roman Empire";
 
-  const Node* it = locations.LowerBound(kSearchString);
-  assert(it);
+  // next_occurrence returns occurrence after prev (or first one if
+  // prev is nullptr). Splay tree finds it by removing prev (which
+  // lookup left at the root) and looking up again. Frozen copy just
+  // steps to the next key.
+  auto next_occurrence = [&] (const SuffixKey* prev) -> const SuffixKey* {
+    if (frozen) {
+      return prev ? frozen->UpperBound(*prev) : frozen->LowerBound(kSearchString);
+    }
+    if (prev) {
+      assert(&locations.root->value == prev);
+      locations.RemoveRoot();
+    }
+    const Node* it = locations.LowerBound(kSearchString);
+    return it ? &it->value : nullptr;
+  };
+
+  const SuffixKey* key = next_occurrence(nullptr);
+  assert(key);
 
-  while (it) {
-    size_t off = it->value.data() - s.data();
+  while (key && key->starts_with(kSearchString)) {
+    size_t off = key->data() - s.data();
     printf("off = %zu\n", off);
 
     printf("context occurrence of '%.*s':\n", (int)kSearchString.size(), kSearchString.data());
     PrintOccurenceContext(s, off);
 
-    assert(locations.root == it);
-    locations.RemoveRoot();
-
-    it = locations.LowerBound(kSearchString);
-    assert(it->value.data() >= kSearchString);
-
-    if (it && !it->value.starts_with(kSearchString)) {
-      it = nullptr;
-    }
+    key = next_occurrence(key);
   }
 
 #ifndef NDEBUG
-  locations.Validate(true);
+  if (!frozen && !skewed_order) {
+    locations.Validate(true);
+  }
 #endif
+
+  if (USE_NODE_POOL) {
+    // Instead of deleting nodes one by one, we drop entire pool at
+    // once. But heap sample has to see populated tree first.
+    sampling_cleanup.DumpHeapSampleNow();
+    locations.root = nullptr;
+    SplayTree::ReleaseAll();
+  }
 }
@@ -1,20 +1,31 @@
 // -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
 // #undef NDEBUG
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <assert.h>
 #include <stdio.h>
 
 #include "demo-helper.h"
+#include "frozen-tree.h"
+#include "node-pool.h"
+#include "prefixed-key.h"
 
 struct Node {
-  const std::string_view value;
+  const SuffixKey value;
 
-  Node* left;
-  Node* right;
+  NodeRef<Node> left;
+  NodeRef<Node> right;
+
+  // Number of nodes in this subtree (including this one).
+  uint32_t size = 1;
 
   size_t priority;
 
@@ -30,65 +41,166 @@ struct Node {
 
   static inline uint64_t rng = NextRandom(NextRandom(NextRandom(0xbeefcafe)));
 
+  // When set (see --priority=offset-hash), priority is hash of the
+  // value's offset from text_base instead of next rng output. Then
+  // treap's shape only depends on the set of values, and not on
+  // insertion order, and we don't touch shared rng state. Which is
+  // what lets us build shards in parallel threads.
+  static inline const char* text_base = nullptr;
+
+  // When set (see --priority=sequential), every new node gets
+  // smaller priority than all previous ones, so it always ends up at
+  // the root. This is the worst case for split (see
+  // --insert-order=skewed).
+  static inline bool sequential = false;
+  static inline uint64_t next_sequential = ~uint64_t{0};
+
+  // splitmix64's finalizer. It is a bijection, so distinct offsets
+  // get distinct priorities.
+  static constexpr uint64_t HashOffset(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
   explicit Node(std::string_view value) : value(value), left{}, right{} {
-    rng = NextRandom(rng);
-    priority = rng;
+    if (text_base) {
+      priority = HashOffset(value.data() - text_base);
+    } else if (sequential) {
+      priority = next_sequential--;
+    } else {
+      rng = NextRandom(rng);
+      priority = rng;
+    }
   }
 };
 
 struct Treap {
-  Node* root = nullptr;
+  NodeRef<Node> root = nullptr;
+
+  Treap() = default;
+  Treap(Treap&& other) noexcept : root(other.root) {
+    other.root = nullptr;
+  }
 
   ~Treap() {
     Clear();
   }
 
-  void Insert(std::string_view value) {
-    // Note, we assume that the value doesn't exist in the tree. Which
-    // is the case for our suffix-map application. It won't be hard to
-    // handle this, but we keep things simple.
-    Node* new_node = new Node(value);
-    size_t priority = new_node->priority;
+  static size_t SubtreeSize(const Node* node) {
+    return node ? node->size : 0;
+  }
 
-    struct Split {
-      // Splits given search tree root into one tree with elements
-      // less than `value' and another tree with elements larger than
-      // `value'. "less than tree" is placed into *place_left and
-      // another tree is placed into *place_right.
-      //
-      // Yes, this is tail-recursive, so decent compilers turn this
-      // into plain straightforward loop.
-      static void Rec(std::string_view value, Node* node,
-                      Node** place_left, Node** place_right) {
-        if (!node) {
-          *place_left = nullptr;
-          *place_right = nullptr;
-          return;
-        }
+  static void UpdateSize(Node* node) {
+    node->size = 1 + SubtreeSize(node->left) + SubtreeSize(node->right);
+  }
+
+  // RankIn returns number of values less than `value' in given
+  // subtree.
+  static size_t RankIn(const Node* node, const SuffixKey& value) {
+    size_t rank = 0;
+    while (node) {
+      if (node->value < value) {
+        rank += 1 + SubtreeSize(node->left);
+        node = node->right;
+      } else {
+        node = node->left;
+      }
+    }
+    return rank;
+  }
+
+  struct SplitOp {
+    // Splits given search tree root into one tree with elements
+    // less than `value' and another tree with elements greater or
+    // equal to `value'. "less than tree" is placed into *place_left
+    // and another tree is placed into *place_right.
+    //
+    // This used to be tail-recursive. But now we fix subtree sizes
+    // on the way back up, so it is real recursion (see Loop below).
+    static void Rec(const SuffixKey& value, NodeRef<Node> node,
+                    NodeRef<Node>* place_left, NodeRef<Node>* place_right) {
+      if (!node) {
+        *place_left = nullptr;
+        *place_right = nullptr;
+        return;
+      }
+
+      if (node->value < value) {
+        *place_left = node;
+        Rec(value, node->right, &node->right, place_right);
+      } else {
+        *place_right = node;
+        Rec(value, node->left, place_left, &node->left);
+      }
+      UpdateSize(node);
+    }
 
-        // We silently assume node->value == value won't happen. It
-        // won't be hard to handle this, but our toy use-case doesn't
-        // need it.
+    // Loop is the same split as explicit loop. Tail call elimination
+    // isn't guaranteed in C++ (and doesn't happen at -O0 or with some
+    // sanitizers), and treap's depth is only probabilistically
+    // bounded.
+    //
+    // Without a stack we cannot fix sizes bottom-up. So we first
+    // walk the path to count how many values go left. Then every node
+    // we place into left tree heads all the remaining left values, so
+    // it's new size is known upfront (and same for the right tree).
+    static void Loop(const SuffixKey& value, NodeRef<Node> node,
+                     NodeRef<Node>* place_left, NodeRef<Node>* place_right) {
+      size_t left_size = RankIn(node, value);
+      size_t right_size = SubtreeSize(node) - left_size;
+      while (node) {
         if (node->value < value) {
           *place_left = node;
-          Rec(value, node->right, &node->right, place_right);
+          node->size = left_size;
+          left_size -= 1 + SubtreeSize(node->left);
+          place_left = &node->right;
+          node = node->right;
         } else {
           *place_right = node;
-          Rec(value, node->left, place_left, &node->left);
+          node->size = right_size;
+          right_size -= 1 + SubtreeSize(node->right);
+          place_right = &node->left;
+          node = node->left;
         }
       }
-    };
+      *place_left = nullptr;
+      *place_right = nullptr;
+    }
+  };
 
-    Node** parent_place = &root;
-    Node* node = root;
+  // Insert uses loop-based split, so it doesn't care how deep the
+  // treap gets. InsertRec uses recursive one, which needs stack
+  // proportional to treap's depth (see --insert-op).
+  void Insert(std::string_view value) {
+    InsertWith<&SplitOp::Loop>(value);
+  }
+  void InsertRec(std::string_view value) {
+    InsertWith<&SplitOp::Rec>(value);
+  }
+
+  template <auto split>
+  void InsertWith(std::string_view value) {
+    // Note, we assume that the value doesn't exist in the tree. Which
+    // is the case for our suffix-map application. It won't be hard to
+    // handle this, but we keep things simple.
+    NodeRef<Node> new_node = NewNode<Node>(value);
+    size_t priority = new_node->priority;
+    const SuffixKey& key = new_node->value;
+
+    NodeRef<Node>* parent_place = &root;
+    NodeRef<Node> node = root;
 
     while (node) {
       if (node->priority > priority) {
-        Split::Rec(value, node, &new_node->left, &new_node->right);
+        split(key, node, &new_node->left, &new_node->right);
+        UpdateSize(new_node);
         break;
       }
 
-      if (node->value < value) {
+      node->size++;
+
+      if (node->value < key) {
         parent_place = &node->right;
       } else {
         parent_place = &node->left;
@@ -99,15 +211,15 @@ struct Treap {
     *parent_place = new_node;
   }
 
-
   // We find smallest node that is >= than given string, or nullptr if
   // everything is smaller than str.
   const Node* LowerBound(std::string_view str) {
+    const SuffixKey key{str};
     const Node* node = root;
 
-    const Node* best = (node && node->value >= str) ? node : nullptr;
+    const Node* best = (node && node->value >= key) ? node : nullptr;
     while (node) {
-      if (node->value < str) {
+      if (node->value < key) {
         node = node->right;
       } else {
         best = node;
@@ -117,9 +229,174 @@ struct Treap {
     return best;
   }
 
+  size_t Size() const {
+    return SubtreeSize(root);
+  }
+
+  // Rank returns number of values less than str.
+  size_t Rank(std::string_view str) const {
+    return RankIn(root, SuffixKey{str});
+  }
+
+  // Select returns k-th smallest value (counting from 0), or nullptr
+  // if we have no more than k values.
+  const Node* Select(size_t k) const {
+    const Node* node = root;
+    if (k >= SubtreeSize(node)) {
+      return nullptr;
+    }
+    for (;;) {
+      size_t left_size = SubtreeSize(node->left);
+      if (k == left_size) {
+        return node;
+      }
+      if (k < left_size) {
+        node = node->left;
+      } else {
+        k -= left_size + 1;
+        node = node->right;
+      }
+    }
+  }
+
+  // CountRange returns number of values in [lo, hi).
+  size_t CountRange(std::string_view lo, std::string_view hi) const {
+    if (hi <= lo) {
+      return 0;
+    }
+    return Rank(hi) - Rank(lo);
+  }
+
+  // Split moves all values >= str into returned treap.
+  Treap Split(std::string_view str) {
+    Treap upper;
+    SplitOp::Loop(SuffixKey{str}, root, &root, &upper.root);
+    return upper;
+  }
+
+  // Merge moves all values of other treap into this one. They all
+  // must be greater than ours.
+  void Merge(Treap&& other) {
+    root = MergeNodes(root, other.root);
+    other.root = nullptr;
+  }
+
+  // Erase removes value equal to str, and returns false if there is
+  // no such value.
+  bool Erase(std::string_view str) {
+    const SuffixKey key{str};
+    const Node* found = LowerBound(str);
+    if (!found || found->value != key) {
+      return false;
+    }
+    NodeRef<Node>* place = &root;
+    for (;;) {
+      NodeRef<Node> node = *place;
+      std::strong_ordering cmp = key <=> node->value;
+      if (cmp == 0) {
+        *place = MergeNodes(node->left, node->right);
+        DeleteNode(node);
+        return true;
+      }
+      node->size--;
+      place = (cmp < 0) ? &node->left : &node->right;
+    }
+  }
+
+  // Union moves all values of other treap into this one (values that
+  // are in both are kept once). This is the classic divide and
+  // conquer treap union. Root with smaller priority stays on top,
+  // the other treap is split by it's value, and both halves are
+  // united with it's children. Which is O(m log(n/m + 1)) work for
+  // treaps of sizes m <= n. The two halves are independent, so we
+  // hand one of them to a new thread, until we've used up `threads'.
+  void Union(Treap&& other, int threads = 1) {
+    std::vector<NodeRef<Node>> dropped;
+    root = UnionRec(root, other.root, threads, &dropped);
+    other.root = nullptr;
+    // Note, we free duplicates only here, since NodePool isn't
+    // thread-safe.
+    for (NodeRef<Node> n : dropped) {
+      DeleteNode(n);
+    }
+  }
+
+  // Merges a and b, where every value of a is less than every value
+  // of b. Recursion depth is bounded by sum of their heights.
+  static NodeRef<Node> MergeNodes(NodeRef<Node> a, NodeRef<Node> b) {
+    if (!a) {
+      return b;
+    }
+    if (!b) {
+      return a;
+    }
+    if (a->priority < b->priority) {
+      a->right = MergeNodes(a->right, b);
+      UpdateSize(a);
+      return a;
+    }
+    b->left = MergeNodes(a, b->left);
+    UpdateSize(b);
+    return b;
+  }
+
+  // Forking threads only pays off for larger subtrees.
+  static constexpr size_t kMinParallelUnion = 1 << 16;
+
+  static NodeRef<Node> UnionRec(NodeRef<Node> a, NodeRef<Node> b, int threads,
+                                std::vector<NodeRef<Node>>* dropped) {
+    if (!a) {
+      return b;
+    }
+    if (!b) {
+      return a;
+    }
+    if (b->priority < a->priority) {
+      std::swap(a, b);
+    }
+    size_t total_size = a->size + b->size;
+
+    NodeRef<Node> b_left, b_right;
+    SplitOp::Loop(a->value, b, &b_left, &b_right);
+    // Value equal to a's (if any) is the smallest of b_right.
+    if (b_right) {
+      NodeRef<Node>* place = &b_right;
+      while ((*place)->left) {
+        place = &(*place)->left;
+      }
+      NodeRef<Node> smallest = *place;
+      if (smallest->value == a->value) {
+        for (NodeRef<Node> n = b_right; n != smallest; n = n->left) {
+          n->size--;
+        }
+        *place = smallest->right;
+        dropped->push_back(smallest);
+      }
+    }
+
+    NodeRef<Node> left = a->left;
+    NodeRef<Node> right = a->right;
+    if (threads > 1 && total_size >= kMinParallelUnion) {
+      std::vector<NodeRef<Node>> left_dropped;
+      std::thread left_thread([&] () {
+        left = UnionRec(left, b_left, threads / 2, &left_dropped);
+      });
+      right = UnionRec(right, b_right, threads - threads / 2, dropped);
+      left_thread.join();
+      dropped->insert(dropped->end(), left_dropped.begin(), left_dropped.end());
+    } else {
+      left = UnionRec(left, b_left, 1, dropped);
+      right = UnionRec(right, b_right, 1, dropped);
+    }
+    a->left = left;
+    a->right = right;
+    UpdateSize(a);
+    return a;
+  }
+
   void Validate(bool print_stats) {
     struct Checker {
-      std::optional<std::string_view> prev_seen;
+      std::optional<SuffixKey> prev_seen;
       size_t total_height = 0;
       size_t node_count = 0;
 
@@ -145,6 +422,11 @@ struct Treap {
 
         int right_height = Rec(node->right, depth + 1);
 
+        if (node->size != 1 + SubtreeSize(node->left) + SubtreeSize(node->right)) {
+          fprintf(stderr, "bad subtree size %u\n", node->size);
+          abort();
+        }
+
         return std::max<int>(left_height, right_height) + 1;
       }
     };
@@ -160,35 +442,126 @@ struct Treap {
     }
   }
 
+  void AccountMemory(MemoryStats* stats) const {
+    AccountBinaryTreeMemory<Node>(root, stats);
+  }
+
   void Clear() {
-    // Note, recursion is potentially unsafe here, because of
-    // unpredictable maximum depth. But this code is not pretending to
-    // be production, so lets keep it uncomplicated.
-    struct Deleter {
-      size_t total_deleted = 0;
-      void Rec(Node* n) {
-        if (n == nullptr) {
-          return;
+    if (!root) {
+      return;
+    }
+
+    // Same as in suffix-splay, we walk the treap without recursion
+    // (treap's depth is unbounded with --priority=sequential), by
+    // reusing left links of nodes we're yet to delete as links to
+    // their parents.
+    size_t total_deleted = 0;
+    NodeRef<Node> n = root;
+    NodeRef<Node> p = nullptr;
+
+    for (;;) {
+      NodeRef<Node> next;
+      if (!n) {
+        if (!p) {
+          break;
         }
-        Rec(n->left);
-        Node* r = n->right;
-        delete n;
+        n = p;
+        p = n->left;
+        next = n->right;
+        DeleteNode(n);
         total_deleted++;
-        Rec(r);
+      } else {
+        next = n->left;
+        n->left = p;
+        p = n;
       }
-    };
+      n = next;
+    }
 
-    Deleter d;
-    d.Rec(root);
     root = nullptr;
 #ifndef NDEBUG
-    printf("total_deleted: %zu\n", d.total_deleted);
+    printf("total_deleted: %zu\n", total_deleted);
 #endif
-    (void)d.total_deleted;
+    (void)total_deleted;
+  }
+
+  // ReleaseAll drops every pooled node at once. Our nodes don't own
+  // anything but other nodes, so this is fine. But it drops nodes of
+  // every treap, so caller has to make sure no treap with nodes is
+  // used (or destroyed) afterwards.
+  static void ReleaseAll() {
+    NodePool<Node>::Clear();
   }
 };
 
+// BuildShard inserts suffixes of s at positions [begin, end) into
+// treap, starting from the end.
+void BuildShard(Treap* treap, void (Treap::* insert_op)(std::string_view),
+                const std::string& s, size_t begin, size_t end, const AtomicFlag& stop_req) {
+  for (size_t pos = end; pos-- > begin;) {
+    (treap->*insert_op)(std::string_view{s}.substr(pos));
+    if (stop_req) {
+      return;
+    }
+#ifndef NDEBUG
+    size_t num_inserted = end - pos;
+    // We want to validate often when we're at small tree, but
+    // otherwise avoid O(N^2) blowup in debug builds.
+    if (num_inserted < 128 || (num_inserted & (num_inserted - 1)) == 0) {
+      treap->Validate(false);
+      printf("inserted %zu suffixes so far\n", num_inserted);
+    }
+#endif
+  }
+}
+
 int main(int argc, char** argv) {
+  std::optional<std::string_view> insert_op_flag = ConsumeFlag(&argc, &argv, "--insert-op");
+  void (Treap::* insert_op)(std::string_view) = &Treap::Insert;
+  if (insert_op_flag == "rec") {
+    insert_op = &Treap::InsertRec;
+  } else if (insert_op_flag && insert_op_flag != "loop") {
+    fprintf(stderr, "--insert-op can be one of the rec or loop\n");
+    exit(1);
+  }
+
+  std::optional<std::string_view> priority_flag = ConsumeFlag(&argc, &argv, "--priority");
+  bool offset_priorities = (priority_flag == "offset-hash");
+  Node::sequential = (priority_flag == "sequential");
+  if (priority_flag && !offset_priorities && !Node::sequential && priority_flag != "random") {
+    fprintf(stderr, "--priority can be one of the random, offset-hash or sequential\n");
+    exit(1);
+  }
+
+  // --insert-order=skewed inserts suffixes in SkewedSuffixOrder
+  // (see demo-helper.h) instead of from the end of the text. With
+  // --priority=sequential this builds chain-like treap, and so is
+  // where recursive and loop split differ (see --insert-op). Validate
+  // and MergeNodes are recursive too, so we skip debug checks then.
+  std::optional<std::string_view> insert_order_flag = ConsumeFlag(&argc, &argv, "--insert-order");
+  const bool skewed_order = (insert_order_flag == "skewed");
+  if (insert_order_flag && !skewed_order && insert_order_flag != "text") {
+    fprintf(stderr, "--insert-order can be one of the text or skewed\n");
+    exit(1);
+  }
+
+  // --shards=N builds N treaps over N contiguous ranges of suffix
+  // positions, and then unites them (in parallel with
+  // --threads=M). With offset-hash priorities shards are built by M
+  // threads too.
+  std::optional<std::string_view> shards_flag = ConsumeFlag(&argc, &argv, "--shards");
+  size_t num_shards = shards_flag ? std::max(atoi(std::string{*shards_flag}.c_str()), 1) : 1;
+  if (skewed_order && num_shards > 1) {
+    fprintf(stderr, "--insert-order=skewed doesn't support --shards\n");
+    exit(1);
+  }
+  std::optional<std::string_view> threads_flag = ConsumeFlag(&argc, &argv, "--threads");
+  int num_threads = threads_flag ? std::max(atoi(std::string{*threads_flag}.c_str()), 1) : 1;
+
+  std::optional<std::string_view> lookups_flag = ConsumeFlag(&argc, &argv, "--lookups");
+  size_t num_lookups = lookups_flag ? strtoull(std::string{*lookups_flag}.c_str(), nullptr, 10) : 0;
+  auto freeze = FreezeOption<SuffixKey>::FromFlags(&argc, &argv);
+
   Treap locations; // Note, we want this destructor to run after we've
                    // dumped heap sample
 
@@ -198,33 +571,163 @@ int main(int argc, char** argv) {
   AtomicFlag stop_req;
   auto sigint_cleanup = SignalHelper::OnSIGINT(&stop_req);
 
-  for (int pos = s.size() - 1; pos >= 0; pos--) {
-    locations.Insert(std::string_view{s}.substr(pos));
-    if (stop_req) {
-      fprintf(stderr, "interrupted insertions by seeing SIGINT\n");
-      break;
+  if (offset_priorities) {
+    Node::text_base = s.data();
+  }
+
+  // Shard 0 is locations itself.
+  std::vector<Treap> shards(num_shards - 1);
+  std::vector<Treap*> all{&locations};
+  for (Treap& t : shards) {
+    all.push_back(&t);
+  }
+  auto build_shard = [&] (size_t i) {
+    BuildShard(all[i], insert_op, s, i * s.size() / num_shards, (i + 1) * s.size() / num_shards, stop_req);
+  };
+
+  std::vector<size_t> order;
+  if (skewed_order) {
+    order = SkewedSuffixOrder(s);
+  }
+
+  MemoryStats memory_stats;
+  auto build_start = std::chrono::steady_clock::now();
+  // We build shards in parallel only with offset-hash priorities,
+  // since random ones come from shared rng. NodePool isn't
+  // thread-safe either. Otherwise we build shards one by one, last
+  // shard first, so that with random priorities we get exactly the
+  // same treap as without shards.
+  size_t build_threads = std::min<size_t>(num_threads, num_shards);
+  if (skewed_order) {
+    for (size_t pos : order) {
+      (locations.*insert_op)(std::string_view{s}.substr(pos));
+      if (stop_req) {
+        break;
+      }
     }
-#ifndef NDEBUG
-    size_t num_inserted = s.size() - pos;
-    // We want to validate often when we're at small tree, but
-    // otherwise avoid O(N^2) blowup in debug builds.
-    if (num_inserted < 128 || (num_inserted & (num_inserted - 1)) == 0) {
-      locations.Validate(false);
-      printf("inserted %zu suffixes so far\n", num_inserted);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+    printf("inserted suffixes in skewed order in %.3f sec\n", seconds);
+  } else if (offset_priorities && !USE_NODE_POOL && build_threads > 1) {
+    std::atomic<size_t> next_shard{0};
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < build_threads; i++) {
+      threads.emplace_back([&] () {
+        for (size_t shard; (shard = next_shard.fetch_add(1)) < num_shards; ) {
+          build_shard(shard);
+        }
+      });
     }
+    for (std::thread& t : threads) {
+      t.join();
+    }
+  } else {
+    for (size_t i = num_shards; i-- > 0; ) {
+      build_shard(i);
+    }
+  }
+  if (stop_req) {
+    fprintf(stderr, "interrupted insertions by seeing SIGINT\n");
+  }
+
+  if (num_shards > 1) {
+    double build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+    printf("built %zu shards in %.3f sec\n", num_shards, build_seconds);
+
+    auto start = std::chrono::steady_clock::now();
+    // Pairwise, so that we unite treaps of similar sizes.
+    for (size_t step = 1; step < all.size(); step *= 2) {
+      for (size_t i = 0; i + step < all.size(); i += 2 * step) {
+        all[i]->Union(std::move(*all[i + step]), num_threads);
+      }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("united %zu shards in %.3f sec\n", num_shards, seconds);
+  }
+
+#ifndef NDEBUG
+  if (!skewed_order) {
+    locations.Validate(true);
+  }
+  assert(stop_req || locations.Size() == s.size());
 #endif
+
+  if (MemoryStats::Enabled()) {
+    locations.AccountMemory(&memory_stats);
+    memory_stats.Print("treap");
   }
 
+  const std::string_view prefix = "the Roman Empire";
+  std::string prefix_end{prefix};
+  prefix_end.back()++;
+
 #ifndef NDEBUG
-  locations.Validate(true);
+  if (!skewed_order) {
+    // Exercise the rest of split/merge toolkit on the final treap.
+    size_t total = locations.Size();
+    size_t rank = locations.Rank(prefix);
+    const Node* first = locations.Select(rank);
+    assert(first == locations.LowerBound(prefix));
+    std::string_view first_value = first->value.view();
+
+    Treap upper = locations.Split(prefix);
+    locations.Validate(false);
+    upper.Validate(false);
+    assert(locations.Size() == rank && upper.Size() == total - rank);
+    assert(upper.Select(0) == first);
+    locations.Merge(std::move(upper));
+    locations.Validate(false);
+
+    assert(locations.Erase(first_value));
+    assert(!locations.Erase(first_value));
+    assert(locations.Size() == total - 1);
+    locations.Validate(false);
+    locations.Insert(first_value);
+    assert(locations.Rank(first_value) == rank);
+    locations.Validate(false);
+  }
 #endif
 
-  const Node* it = locations.LowerBound("the Roman Empire");
-  assert(it);
+  freeze.MaybeFreeze(
+    static_cast<const Node*>(locations.root), "treap",
+    [] (const Node* n) -> const SuffixKey& { return n->value; },
+    [] (const Node* n) -> const Node* { return n->left; },
+    [] (const Node* n) -> const Node* { return n->right; },
+    [&] () { locations.Clear(); });
+  const FrozenTree<SuffixKey>* frozen = freeze.frozen();
+
+  freeze.RunLookups(s, num_lookups, [&] (std::string_view probe) {
+    const Node* it = locations.LowerBound(probe);
+    return it && it->value.starts_with(probe);
+  });
+
+  const SuffixKey* found;
+  size_t seen_hits = 0;
+  if (frozen) {
+    // Frozen copy has no subtree sizes, so we count by stepping
+    // through matches.
+    found = frozen->LowerBound(prefix);
+    for (const SuffixKey* key = found; key && key->starts_with(prefix); key = frozen->UpperBound(*key)) {
+      seen_hits++;
+    }
+  } else {
+    seen_hits = locations.CountRange(prefix, prefix_end);
+    const Node* it = locations.LowerBound(prefix);
+    found = it ? &it->value : nullptr;
+  }
+  printf("seen_hits: %zu\n", seen_hits);
+  assert(found);
 
-  size_t off = it->value.data() - s.data();
+  size_t off = found->data() - s.data();
   printf("off = %zu\n", off);
 
   printf("context of last(ish) occurrence of 'the Roman Empire':\n");
   PrintOccurenceContext(s, off);
+
+  if (USE_NODE_POOL) {
+    // Instead of deleting nodes one by one, we drop entire pool at
+    // once. But heap sample has to see populated treap first.
+    sampling_cleanup.DumpHeapSampleNow();
+    locations.root = nullptr;
+    Treap::ReleaseAll();
+  }
 }
@@ -0,0 +1,631 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "demo-helper.h"
+#include "epoch.h"
+
+// This is concurrent version of suffix-trie (with it's default
+// bitmap nodes). Any number of threads may insert and look up at the
+// same time, without any locks.
+//
+// suffix-trie already never modifies node's children in place:
+// adding a child makes a copy of the node. Here nodes are fully
+// immutable once published. But children of a node aren't linked
+// directly. Instead, every key or subtree hangs off it's own Slot
+// (I-node in Ctrie paper terms), which is a separately allocated
+// atomic link to current version of that subtree. Every change to
+// the trie is then a single CAS on a single slot: either the slot's
+// node gets replaced by it's copy with new child added, or slot's
+// subtree (or leaf) gets pushed down under new 2-child node. If we
+// had atomic links right inside nodes, then copying a node while some
+// other thread CAS-es one of it's links would lose that update.
+//
+// Node that got replaced by it's copy is still visible to threads
+// that are walking it. So we retire it via EpochDomain (see epoch.h)
+// and every operation runs inside epoch guard. Slots and leaves are
+// never replaced, so they live as long as the trie.
+
+struct Leaf {
+  const std::string_view data;
+  explicit Leaf(std::string_view data) : data(data) {}
+};
+
+struct Node;
+
+// Link is what Slot holds: either Leaf* (with low bit set) or Node*.
+class Link {
+public:
+  Link() : value_(0) {}
+  explicit Link(Leaf* ptr) : value_(reinterpret_cast<uintptr_t>(ptr) | 1) {}
+  explicit Link(Node* ptr) : value_(reinterpret_cast<uintptr_t>(ptr)) {}
+
+  bool IsEmpty() const {
+    return value_ == 0;
+  }
+
+  void Unpack(Leaf** l, Node** n) const {
+    if ((value_ & 1) != 0) {
+      *l = reinterpret_cast<Leaf*>(value_ & ~uintptr_t{1});
+      *n = nullptr;
+    } else {
+      *l = nullptr;
+      *n = reinterpret_cast<Node*>(value_);
+    }
+  }
+
+  friend bool operator==(Link a, Link b) {
+    return a.value_ == b.value_;
+  }
+
+private:
+  uintptr_t value_;
+};
+
+struct Slot {
+  std::atomic<Link> link;
+
+  explicit Slot(Link link) : link(link) {}
+
+  Link Load() const {
+    return link.load(std::memory_order_acquire);
+  }
+
+  bool CompareExchange(Link expected, Link desired) {
+    return link.compare_exchange_strong(expected, desired, std::memory_order_acq_rel);
+  }
+};
+
+namespace detail {
+
+struct ArrayIndex {
+  uint64_t in_use_bits[4] = {};
+  uint8_t start_indexes[4] = {};
+
+  bool HasElement(uint8_t pos) const {
+    uint8_t word_idx = pos / 64;
+    uint8_t bit = pos % 64;
+    return  ((in_use_bits[word_idx] >> bit) & 1) != 0;
+  }
+  uint8_t NumElementsBefore(uint8_t pos) const {
+    uint8_t word_idx = pos / 64;
+    uint8_t bit = pos % 64;
+    uint8_t start = start_indexes[word_idx];
+    uint64_t mask = ~(~uint64_t{} << bit);
+    return start + std::popcount(in_use_bits[word_idx] & mask);
+  }
+
+  // NextElement returns smallest present pos >= from, or -1 if
+  // there is none.
+  int NextElement(uint32_t from) const {
+    for (uint32_t word_idx = from / 64; word_idx < 4; word_idx++) {
+      uint64_t bits = in_use_bits[word_idx];
+      if (word_idx == from / 64) {
+        bits &= ~uint64_t{} << (from % 64);
+      }
+      if (bits != 0) {
+        return word_idx * 64 + std::countr_zero(bits);
+      }
+    }
+    return -1;
+  }
+
+  void InitInUse(uint8_t bit) {
+    in_use_bits[bit / 64] |= uint64_t{1} << (bit % 64);
+  }
+
+  void FinishInitialization() {
+    uint8_t acc = 0;
+    for (int i = 0; i < 4; i++) {
+      start_indexes[i] = acc;
+      acc += std::popcount(in_use_bits[i]);
+    }
+  }
+};
+
+}  // namespace detail
+
+// Node is the same as suffix-trie's bitmap node, except children are
+// Slot pointers and node doesn't own them. I.e. Node versions share
+// slots, and slots outlive every version of their parent node.
+struct Node {
+  const uint32_t size;
+  const uint32_t depth;
+  detail::ArrayIndex idx;
+  Slot* children[/* size */];
+
+  // MakeInserting returns copy of prev_node with slot added under
+  // (currently absent) ch.
+  static Node* MakeInserting(const Node* prev_node, uint8_t ch, Slot* slot) {
+    assert(!prev_node->idx.HasElement(ch));
+    uint32_t pos = prev_node->idx.NumElementsBefore(ch);
+    Node* n = Allocate(prev_node->size + 1, prev_node->depth);
+    n->idx = prev_node->idx;
+    n->idx.InitInUse(ch);
+    n->idx.FinishInitialization();
+    std::copy(prev_node->children, prev_node->children + pos, n->children);
+    n->children[pos] = slot;
+    std::copy(prev_node->children + pos, prev_node->children + prev_node->size, n->children + pos + 1);
+    return n;
+  }
+
+  static Node* MakeFrom2(uint32_t depth,
+                         uint8_t ch1, Slot* child1,
+                         uint8_t ch2, Slot* child2) {
+    assert(ch1 != ch2);
+    if (ch1 > ch2) {
+      std::swap(ch1, ch2);
+      std::swap(child1, child2);
+    }
+    Node* n = Allocate(2, depth);
+    n->idx.InitInUse(ch1);
+    n->idx.InitInUse(ch2);
+    n->idx.FinishInitialization();
+    n->children[0] = child1;
+    n->children[1] = child2;
+    return n;
+  }
+
+  Slot* FindChild(uint8_t ch) const {
+    if (!idx.HasElement(ch)) {
+      return nullptr;
+    }
+    return children[idx.NumElementsBefore(ch)];
+  }
+
+  // FindNextChild returns first child with char >= from and sets *ch
+  // to it's char. Or nullptr if there is no such child.
+  Slot* FindNextChild(uint32_t from, uint8_t* ch) const {
+    int pos = idx.NextElement(from);
+    if (pos < 0) {
+      return nullptr;
+    }
+    *ch = pos;
+    return children[idx.NumElementsBefore(pos)];
+  }
+
+  std::span<Slot* const> GetChildren() const {
+    return {children, size};
+  }
+
+  static size_t AllocSize(uint32_t size) {
+    return offsetof(Node, children) + sizeof(Slot*) * size;
+  }
+
+  // Delete frees just this version of node. Children are shared with
+  // other versions.
+  static void Delete(Node* node) {
+    size_t alloc_size = AllocSize(node->size);
+    node->~Node();
+#if __cpp_sized_deallocation
+    (::operator delete)(node, alloc_size);
+#else
+    (::operator delete)(node);
+    (void)alloc_size; // unused in this config. Avoid warning.
+#endif
+  }
+
+private:
+  static Node* Allocate(uint32_t size, uint32_t depth) {
+    return new ((::operator new)(AllocSize(size))) Node(size, depth);
+  }
+
+  Node(uint32_t size, uint32_t depth) : size(size), depth(depth) {}
+};
+
+static uint8_t ReadString(std::string_view data, size_t depth) {
+  if (depth < data.size()) [[likely]] {
+    return data[depth];
+  }
+  return 0;
+}
+
+static Leaf* SmallestLeaf(Link link) {
+  for (;;) {
+    Leaf* leaf;
+    Node* node;
+    link.Unpack(&leaf, &node);
+    if (leaf) {
+      return leaf;
+    }
+    link = node->children[0]->Load();
+  }
+}
+
+class ConcurrentTrie {
+public:
+  // Writers hand us nodes they've replaced in batches of this size
+  // (see Writer).
+  static constexpr size_t kRetireBatch = 256;
+
+  ConcurrentTrie() = default;
+  ~ConcurrentTrie() {
+    // Retired node versions get freed by epochs_ destructor. And we
+    // free the rest.
+    DestroyRec(root_.Load());
+  }
+
+  ConcurrentTrie(const ConcurrentTrie&) = delete;
+  ConcurrentTrie& operator=(const ConcurrentTrie&) = delete;
+
+  // Writer is per-thread inserting handle. It batches retirement of
+  // replaced nodes, so that we don't hit EpochDomain's lock on every
+  // insertion.
+  class Writer {
+  public:
+    explicit Writer(ConcurrentTrie* trie) : trie_(trie) {}
+    ~Writer() {
+      Flush();
+    }
+
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    void Insert(std::string_view data) {
+      Leaf* leaf = new Leaf(data);
+      for (;;) {
+        EpochDomain::Guard g(&trie_->epochs_);
+        if (trie_->TryInsert(leaf, &garbage_)) {
+          break;
+        }
+      }
+      if (garbage_.size() >= kRetireBatch) {
+        Flush();
+        trie_->epochs_.Reclaim();
+      }
+    }
+
+  private:
+    void Flush() {
+      if (garbage_.empty()) {
+        return;
+      }
+      trie_->epochs_.Retire([garbage = std::move(garbage_)] () {
+        for (Node* n : garbage) {
+          Node::Delete(n);
+        }
+      });
+      garbage_.clear();
+    }
+
+    ConcurrentTrie* const trie_;
+    std::vector<Node*> garbage_;
+  };
+
+  // LowerBound returns smallest leaf > data (or nullptr), just like
+  // suffix-trie's LowerBound.
+  Leaf* LowerBound(std::string_view data) {
+    EpochDomain::Guard g(&epochs_);
+    Link root = root_.Load();
+    if (root.IsEmpty()) {
+      return nullptr;
+    }
+    Leaf* other_leaf;
+    size_t lcp;
+    std::tie(other_leaf, lcp) = FindLCPLeaf(root, data);
+    return LowerBoundRec(root, data, other_leaf, lcp);
+  }
+
+  // Validate checks the trie (which must not be modified
+  // concurrently) and returns number of leafs.
+  size_t Validate() const {
+    Link root = root_.Load();
+    if (root.IsEmpty()) {
+      return 0;
+    }
+    size_t leafs = 0;
+    ValidateRec(root, 0, &leafs);
+    return leafs;
+  }
+
+  void AccountMemory(MemoryStats* stats) const {
+    AccountMemoryRec(root_.Load(), stats);
+  }
+
+private:
+  // FindLCPLeaf descends to some leaf that shares longest prefix with
+  // data and returns it along with the length of that prefix. See
+  // suffix-trie's FindLCPLeaf.
+  static std::pair<Leaf*, size_t> FindLCPLeaf(Link link, std::string_view data) {
+    Leaf* leaf;
+    Node* node;
+    for (;;) {
+      link.Unpack(&leaf, &node);
+      if (leaf) {
+        break;
+      }
+      Slot* child = node->FindChild(ReadString(data, node->depth));
+      if (!child) {
+        leaf = SmallestLeaf(link);
+        break;
+      }
+      link = child->Load();
+    }
+    size_t lcp = std::mismatch(data.begin(), data.end(),
+                               leaf->data.begin(), leaf->data.end()).first - data.begin();
+    return {leaf, lcp};
+  }
+
+  // TryInsert makes one attempt to add leaf (via one CAS). It returns
+  // false if some other thread changed the part of trie we've looked
+  // at, and we should start over. Nodes replaced by successful
+  // attempt are appended to *garbage.
+  bool TryInsert(Leaf* leaf, std::vector<Node*>* garbage) {
+    std::string_view data = leaf->data;
+    Link root = root_.Load();
+    if (root.IsEmpty()) {
+      return root_.CompareExchange(root, Link{leaf});
+    }
+
+    // Same as in suffix-trie, all keys under the first slot on data's
+    // path whose node is deeper than lcp (or which is a leaf) share
+    // exactly lcp chars with data. Note, slots only ever gain keys,
+    // so whatever we find below still holds other_leaf. If some other
+    // thread has inserted key that shares even longer prefix with
+    // data since, then either we'll find existing child at depth lcp,
+    // or our CAS will fail, since that key's insertion goes through
+    // the same slot.
+    Leaf* other_leaf;
+    size_t lcp;
+    std::tie(other_leaf, lcp) = FindLCPLeaf(root, data);
+    assert(lcp < data.size());
+
+    Slot* slot = &root_;
+    for (;;) {
+      Link link = slot->Load();
+      Leaf* l;
+      Node* node;
+      link.Unpack(&l, &node);
+
+      if (l != nullptr || node->depth > lcp) {
+        Slot* pushed_down = new Slot(link);
+        Slot* leaf_slot = new Slot(Link{leaf});
+        Node* n = Node::MakeFrom2(lcp,
+                                  ReadString(other_leaf->data, lcp), pushed_down,
+                                  ReadString(data, lcp), leaf_slot);
+        if (slot->CompareExchange(link, Link{n})) {
+          return true;
+        }
+        Node::Delete(n);
+        delete pushed_down;
+        delete leaf_slot;
+        return false;
+      }
+
+      uint8_t ch = ReadString(data, node->depth);
+      Slot* child = node->FindChild(ch);
+      if (node->depth == lcp) {
+        if (child) {
+          return false;
+        }
+        Slot* leaf_slot = new Slot(Link{leaf});
+        Node* n = Node::MakeInserting(node, ch, leaf_slot);
+        if (slot->CompareExchange(link, Link{n})) {
+          garbage->push_back(node);
+          return true;
+        }
+        Node::Delete(n);
+        delete leaf_slot;
+        return false;
+      }
+
+      assert(child);
+      slot = child;
+    }
+  }
+
+  static Leaf* LowerBoundRec(Link link, std::string_view data, Leaf* other_leaf, size_t lcp) {
+    Leaf* leaf;
+    Node* node;
+    link.Unpack(&leaf, &node);
+    if (leaf) {
+      return (leaf->data > data) ? leaf : nullptr;
+    }
+
+    // Note, we can do tighter but this is correct.
+    uint8_t ch = (node->depth > lcp) ? 0 : ReadString(data, node->depth);
+    if (Slot* child = node->FindChild(ch)) {
+      leaf = LowerBoundRec(child->Load(), data, other_leaf, lcp);
+      if (leaf) {
+        return leaf;
+      }
+    }
+    Slot* next = node->FindNextChild(uint32_t{ch} + 1, &ch);
+    if (!next) {
+      return nullptr;
+    }
+    leaf = SmallestLeaf(next->Load());
+    return (leaf->data > data) ? leaf : nullptr;
+  }
+
+#define validation_assert(c) do { \
+    if (!(c)) { \
+      fprintf(stderr, "validation assert failed: %s at %s:%d\n", #c, __FILE__, __LINE__); \
+      fflush(stderr); \
+      __builtin_trap(); \
+    } \
+  } while (false)
+
+  // ValidateRec checks subtree and returns common prefix of it's keys.
+  static std::string_view ValidateRec(Link link, uint32_t min_depth, size_t* leafs) {
+    Leaf* l;
+    Node* n;
+    link.Unpack(&l, &n);
+    if (l) {
+      ++*leafs;
+      return l->data;
+    }
+    validation_assert(n->size >= 2 && n->size <= 256);
+    validation_assert(n->depth >= min_depth);
+
+    std::string_view my_lcp;
+    uint32_t seen_children = 0;
+    uint8_t ch = 0;
+    for (Slot* child = n->FindNextChild(0, &ch); child; child = n->FindNextChild(uint32_t{ch} + 1, &ch)) {
+      std::string_view lcp = ValidateRec(child->Load(), n->depth + 1, leafs);
+      validation_assert(lcp.size() > n->depth);
+      validation_assert(static_cast<uint8_t>(lcp[n->depth]) == ch);
+      if (seen_children == 0) {
+        my_lcp = lcp;
+      } else {
+        size_t len = std::mismatch(my_lcp.begin(), my_lcp.end(),
+                                   lcp.begin(), lcp.end()).first - my_lcp.begin();
+        validation_assert(len == n->depth);
+        my_lcp = my_lcp.substr(0, len);
+      }
+      seen_children++;
+    }
+    validation_assert(seen_children == n->size);
+    return my_lcp;
+  }
+
+#undef validation_assert
+
+  static void AccountMemoryRec(Link link, MemoryStats* stats) {
+    Leaf* l;
+    Node* n;
+    link.Unpack(&l, &n);
+    if (l) {
+      stats->AddKeys(1);
+      stats->AddNode(sizeof(Leaf));
+      return;
+    }
+    if (!n) {
+      return;
+    }
+    stats->AddNode(Node::AllocSize(n->size));
+    for (Slot* child : n->GetChildren()) {
+      stats->AddNode(sizeof(Slot));
+      AccountMemoryRec(child->Load(), stats);
+    }
+  }
+
+  static void DestroyRec(Link link) {
+    Leaf* l;
+    Node* n;
+    link.Unpack(&l, &n);
+    if (l) {
+      delete l;
+      return;
+    }
+    if (!n) {
+      return;
+    }
+    for (Slot* child : n->GetChildren()) {
+      DestroyRec(child->Load());
+      delete child;
+    }
+    Node::Delete(n);
+  }
+
+  Slot root_{Link{}};
+  EpochDomain epochs_;
+};
+
+int main(int argc, char** argv) {
+  std::optional<std::string_view> writers_flag = ConsumeFlag(&argc, &argv, "--writers");
+  int num_writers = writers_flag ? std::max(atoi(std::string{*writers_flag}.c_str()), 1) : 1;
+  std::optional<std::string_view> readers_flag = ConsumeFlag(&argc, &argv, "--readers");
+  int num_readers = readers_flag ? atoi(std::string{*readers_flag}.c_str()) : 0;
+
+  // NOTE, we want this to be destroyed after heap sample dump we
+  // setup just below.
+  ConcurrentTrie locations;
+
+  auto sampling_cleanup = MaybeSetupHeapSampling(argc, argv);
+
+  std::string s = ReadRomanHistoryText();
+  s.append(1, '\0');
+
+  AtomicFlag stop_req;
+  auto sigint_cleanup = SignalHelper::OnSIGINT(&stop_req);
+
+  // Readers look up random substrings in the live trie while writers
+  // keep inserting.
+  std::optional<ConcurrentReaders> readers;
+  if (num_readers) {
+    readers.emplace(num_readers, s, [&locations] (std::span<const std::string_view> probes) -> size_t {
+      size_t hits = 0;
+      for (std::string_view probe : probes) {
+        Leaf* it = locations.LowerBound(probe);
+        assert(!it || it->data > probe);
+        hits += (it && it->data.starts_with(probe));
+      }
+      return hits;
+    });
+  }
+
+  // Writers go from the end of text, like other programs do, with
+  // writer i taking every num_writers-th suffix starting from i-th to
+  // last.
+  MemoryStats memory_stats;
+  std::vector<std::thread> writers;
+  for (int i = 0; i < num_writers; i++) {
+    writers.emplace_back([&, i] () {
+      ConcurrentTrie::Writer w(&locations);
+      for (size_t off = i; off < s.size(); off += num_writers) {
+        w.Insert(std::string_view{s}.substr(s.size() - 1 - off));
+        if (stop_req) {
+          return;
+        }
+      }
+    });
+  }
+  for (std::thread& t : writers) {
+    t.join();
+  }
+  if (stop_req) {
+    fprintf(stderr, "interrupted insertions by seeing SIGINT\n");
+  }
+
+  if (readers) {
+    readers->Stop();
+  }
+
+#ifndef NDEBUG
+  size_t leafs = locations.Validate();
+  printf("trie has %zu leafs\n", leafs);
+  assert(stop_req || leafs == s.size());
+#endif
+
+  if (MemoryStats::Enabled()) {
+    locations.AccountMemory(&memory_stats);
+    memory_stats.Print("concurrent trie");
+  }
+
+  const std::string_view prefix = "the Roman Empire";
+  Leaf* it = locations.LowerBound(prefix);
+  if (it == nullptr || !it->data.starts_with(prefix)) {
+    printf("failed to find\n");
+    abort();
+  }
+
+  const char* farthest_result = it->data.data();
+  size_t seen_hits = 0;
+  for (; it && it->data.starts_with(prefix); it = locations.LowerBound(it->data)) {
+    farthest_result = std::max(farthest_result, it->data.data());
+    seen_hits++;
+  }
+  printf("seen_hits: %zu\n", seen_hits);
+
+  size_t off = farthest_result - s.data();
+  printf("off = %zu\n", off);
+
+  printf("context of last occurrence of 'the Roman Empire':\n");
+  PrintOccurenceContext(s, off);
+}
@@ -1,19 +1,48 @@
 // -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
 #include <algorithm>
+#include <atomic>
 #include <bit>
 #include <functional>
+#include <optional>
 #include <span>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 #include <assert.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "demo-helper.h"
 
+// Build with -DUSE_ART_NODES=1 to have adaptive radix tree style
+// nodes (see -art variant). I.e. instead of one node layout that
+// reallocates on every added child, nodes come in 4 size classes
+// (sorted keys for up to 4 and up to 16 children, byte-indexed for up
+// to 48 children, and direct 256-slot array) and have room to grow.
+#ifndef USE_ART_NODES
+#define USE_ART_NODES 0
+#endif
+
+// Build with -DUSE_STORED_PREFIXES=1 to have nodes remember first few
+// chars they skip over (see detail::StoredPrefix). Then Insert and
+// LowerBound decide at every node whether data still matches, in a
+// single descent, instead of first descending to some leaf to learn
+// the longest common prefix (see FindLCPLeaf) and then descending
+// again.
+#ifndef USE_STORED_PREFIXES
+#define USE_STORED_PREFIXES 0
+#endif
+
 struct Leaf {
   const std::string_view data;
   Leaf(std::string_view data) : data(data) {}
@@ -92,6 +121,21 @@ struct ArrayIndex {
     return start + std::popcount(in_use_bits[word_idx] & mask);
   }
 
+  // NextElement returns smallest present pos >= from, or -1 if
+  // there is none.
+  int NextElement(uint32_t from) const {
+    for (uint32_t word_idx = from / 64; word_idx < 4; word_idx++) {
+      uint64_t bits = in_use_bits[word_idx];
+      if (word_idx == from / 64) {
+        bits &= ~uint64_t{} << (from % 64);
+      }
+      if (bits != 0) {
+        return word_idx * 64 + std::countr_zero(bits);
+      }
+    }
+    return -1;
+  }
+
   void InitInUse(uint8_t bit) {
     in_use_bits[bit / 64] |= uint64_t{1} << (bit % 64);
   }
@@ -105,15 +149,35 @@ struct ArrayIndex {
   }
 };
 
+// StoredPrefix is first kBytes of chars that node skips over. I.e.
+// chars from it's parent's depth + 1 up to (but not including) it's
+// own depth, which all keys in node's subtree share. Node doesn't
+// know where that range starts, but we always know it when
+// descending. Skips up to kBytes long are fully stored (what ART
+// paper calls pessimistic path compression). Rest of longer skips is
+// only checked against some leaf (optimistic), but those are rare.
+struct StoredPrefix {
+  static constexpr size_t kBytes = 8;
+  uint8_t bytes[kBytes] = {};
+
+  void Set(std::string_view skipped) {
+    memcpy(bytes, skipped.data(), std::min(skipped.size(), kBytes));
+  }
+};
+
 }  // namespace detail
 
+#if !USE_ART_NODES
 struct Node {
   const uint32_t size;
   const uint32_t depth;
   detail::ArrayIndex idx;
+#if USE_STORED_PREFIXES
+  detail::StoredPrefix prefix;
+#endif
   uintptr_t children[/* size */];
 
-  static Node* MakeInserting(Node* prev_node, uint8_t ch, uint8_t pos, Leaf* leaf) {
+  static Node* MakeInserting(Node* prev_node, uint8_t ch, uint8_t pos, NodePtr&& child) {
     assert(!prev_node->idx.HasElement(ch));
     assert(pos == prev_node->idx.NumElementsBefore(ch));
     uint32_t size = prev_node->size + 1;
@@ -122,6 +186,9 @@ struct Node {
     std::tie(n, childs_storage) = Allocate(size, prev_node->depth);
 
     memcpy(&n->idx, &prev_node->idx, sizeof(n->idx));
+#if USE_STORED_PREFIXES
+    n->prefix = prev_node->prefix;
+#endif
     n->idx.InitInUse(ch);
     n->idx.FinishInitialization();
 
@@ -129,7 +196,7 @@ struct Node {
 
     for (uint32_t i = 0; i < size; i++) {
       if (i == pos) {
-        new (childs_storage + i) NodePtr(leaf);
+        new (childs_storage + i) NodePtr(std::move(child));
       } else if (i < pos) {
         new (childs_storage + i) NodePtr(std::move(prev_children[i]));
       } else {
@@ -179,16 +246,37 @@ struct Node {
     } while (ch != 0);
   }
 
-  NodePtr* FindChild(uint8_t ch, uint8_t* pos_place) const {
-    uint8_t pos = idx.NumElementsBefore(ch);
-    if (pos_place) {
-      *pos_place = pos;
-    }
+  NodePtr* FindChild(uint8_t ch) const {
     if (!idx.HasElement(ch)) {
       return nullptr;
-    } else {
-      return &GetChildren()[pos];
     }
+    return &GetChildren()[idx.NumElementsBefore(ch)];
+  }
+
+  // FindNextChild returns first child with char >= from and sets *ch
+  // to it's char. Or nullptr if there is no such child.
+  NodePtr* FindNextChild(uint32_t from, uint8_t* ch) const {
+    int pos = idx.NextElement(from);
+    if (pos < 0) {
+      return nullptr;
+    }
+    *ch = pos;
+    return &GetChildren()[idx.NumElementsBefore(pos)];
+  }
+
+  // AddChild adds child under (currently absent) ch. Node at place is
+  // replaced by it's copy with the child added.
+  static void AddChild(NodePtr* place, Node* node, uint8_t ch, NodePtr&& child) {
+    *place = NodePtr{MakeInserting(node, ch, node->idx.NumElementsBefore(ch), std::move(child))};
+  }
+
+  // AllocSize is how many bytes we ask operator new for node with
+  // given number of children.
+  static size_t AllocSize(uint32_t size) {
+    return offsetof(Node, children) + sizeof(NodePtr) * size;
+  }
+  size_t AllocSize() const {
+    return AllocSize(size);
   }
 
 private:
@@ -199,7 +287,7 @@ private:
   }
 
   static void Delete(Node* node) {
-    size_t alloc_size = offsetof(Node, children) + sizeof(NodePtr) * node->size;
+    size_t alloc_size = AllocSize(node->size);
     node->~Node();
 #if __cpp_sized_deallocation
     (::operator delete)(node, alloc_size);
@@ -210,7 +298,7 @@ private:
   }
 
   static std::pair<Node*, NodePtr*> Allocate(uint32_t size, uint32_t depth) {
-    size_t alloc_size = offsetof(Node, children) + sizeof(NodePtr) * size;
+    size_t alloc_size = AllocSize(size);
 
     Node* n = new ((::operator new)(alloc_size)) Node(size, depth);
     NodePtr* childs_storage = reinterpret_cast<NodePtr*>(n->children);
@@ -225,6 +313,257 @@ private:
     }
   }
 };
+#else  // USE_ART_NODES
+struct Node {
+  const uint32_t depth;
+  uint16_t size;
+  // kind is size class: 0 is Node4, 1 is Node16, 2 is Node48 and 3
+  // is Node256. Node4 and Node16 have sorted array of keys (chars)
+  // and parallel array of children. Node48 has 256-entry array of
+  // (1-based) child indexes and children in the order of
+  // insertion. And Node256 is simply 256 children, with empty
+  // NodePtr-s for absent chars.
+  const uint8_t kind;
+#if USE_STORED_PREFIXES
+  detail::StoredPrefix prefix;
+#endif
+  alignas(NodePtr) unsigned char body[];
+
+  static constexpr int kKinds = 4;
+  static constexpr uint32_t kCapacity[kKinds] = {4, 16, 48, 256};
+  // Bytes of keys (or child indexes) before children. Multiples of 8,
+  // so that children are aligned.
+  static constexpr uint32_t kKeysBytes[kKinds] = {8, 16, 256, 0};
+
+  static Node* MakeFrom2(uint32_t depth,
+                         uint8_t ch1, NodePtr&& child1,
+                         uint8_t ch2, NodePtr&& child2) {
+    assert(ch1 != ch2);
+    Node* n = Allocate(0, depth);
+    n->InsertInPlace(ch1, std::move(child1));
+    n->InsertInPlace(ch2, std::move(child2));
+    return n;
+  }
+
+  NodePtr* GetSmallestChild() {
+    NodePtr* rv = nullptr;
+    ForEachChild([&rv] (uint8_t, NodePtr& p) {
+      rv = &p;
+      return false;
+    });
+    return rv;
+  }
+
+  void EnumChildren(const std::function<void(uint8_t, const NodePtr&)>& body) {
+    ForEachChild([&body] (uint8_t ch, NodePtr& p) {
+      body(ch, p);
+      return true;
+    });
+  }
+
+  NodePtr* FindChild(uint8_t ch) const {
+    switch (kind) {
+    case 0:
+      for (uint32_t i = 0; i < size; i++) {
+        if (Keys()[i] == ch) {
+          return &Children()[i];
+        }
+      }
+      return nullptr;
+    case 1: {
+#ifdef __SSE2__
+      __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(ch),
+                                   _mm_loadu_si128(reinterpret_cast<const __m128i*>(Keys())));
+      unsigned mask = _mm_movemask_epi8(cmp) & ((1u << size) - 1);
+      if (mask == 0) {
+        return nullptr;
+      }
+      return &Children()[std::countr_zero(mask)];
+#else
+      const uint8_t* keys = Keys();
+      const uint8_t* it = std::find(keys, keys + size, ch);
+      return (it == keys + size) ? nullptr : &Children()[it - keys];
+#endif
+    }
+    case 2: {
+      uint8_t idx = Keys()[ch];
+      return idx ? &Children()[idx - 1] : nullptr;
+    }
+    default: {
+      NodePtr* p = &Children()[ch];
+      return p->IsEmpty() ? nullptr : p;
+    }
+    }
+  }
+
+  // FindNextChild returns first child with char >= from and sets *ch
+  // to it's char. Or nullptr if there is no such child.
+  NodePtr* FindNextChild(uint32_t from, uint8_t* ch) const {
+    switch (kind) {
+    case 0:
+    case 1:
+      for (uint32_t i = 0; i < size; i++) {
+        if (Keys()[i] >= from) {
+          *ch = Keys()[i];
+          return &Children()[i];
+        }
+      }
+      return nullptr;
+    case 2:
+      for (uint32_t c = from; c < 256; c++) {
+        if (uint8_t idx = Keys()[c]) {
+          *ch = c;
+          return &Children()[idx - 1];
+        }
+      }
+      return nullptr;
+    default:
+      for (uint32_t c = from; c < 256; c++) {
+        if (!Children()[c].IsEmpty()) {
+          *ch = c;
+          return &Children()[c];
+        }
+      }
+      return nullptr;
+    }
+  }
+
+  // AddChild adds child under (currently absent) ch. Full node at
+  // place gets replaced by it's bigger version. Otherwise we insert in
+  // place.
+  static void AddChild(NodePtr* place, Node* node, uint8_t ch, NodePtr&& child) {
+    assert(!node->FindChild(ch));
+    if (node->size == kCapacity[node->kind]) {
+      Node* bigger = node->Grow();
+      *place = NodePtr{bigger};
+      node = bigger;
+    }
+    node->InsertInPlace(ch, std::move(child));
+  }
+
+  size_t AllocSize() const {
+    return AllocSize(kind);
+  }
+
+private:
+  friend class NodePtr;
+
+  static size_t AllocSize(uint8_t kind) {
+    return offsetof(Node, body) + kKeysBytes[kind] + sizeof(NodePtr) * kCapacity[kind];
+  }
+
+  uint8_t* Keys() const {
+    return const_cast<uint8_t*>(body);
+  }
+  NodePtr* Children() const {
+    return reinterpret_cast<NodePtr*>(const_cast<unsigned char*>(body) + kKeysBytes[kind]);
+  }
+
+  // ForEachChild calls fn(ch, child) for children in order of chars,
+  // until fn returns false.
+  template <typename Fn>
+  void ForEachChild(const Fn& fn) {
+    NodePtr* children = Children();
+    switch (kind) {
+    case 0:
+    case 1:
+      for (uint32_t i = 0; i < size; i++) {
+        if (!fn(Keys()[i], children[i])) {
+          return;
+        }
+      }
+      return;
+    case 2:
+      for (uint32_t ch = 0; ch < 256; ch++) {
+        uint8_t idx = Keys()[ch];
+        if (idx && !fn(ch, children[idx - 1])) {
+          return;
+        }
+      }
+      return;
+    default:
+      for (uint32_t ch = 0; ch < 256; ch++) {
+        if (!children[ch].IsEmpty() && !fn(ch, children[ch])) {
+          return;
+        }
+      }
+    }
+  }
+
+  void InsertInPlace(uint8_t ch, NodePtr&& child) {
+    assert(size < kCapacity[kind]);
+    NodePtr* children = Children();
+    switch (kind) {
+    case 0:
+    case 1: {
+      uint8_t* keys = Keys();
+      uint32_t pos = std::upper_bound(keys, keys + size, ch) - keys;
+      // NodePtr is just a word, so we can relocate it bytewise.
+      memmove(keys + pos + 1, keys + pos, size - pos);
+      memmove(static_cast<void*>(children + pos + 1), static_cast<void*>(children + pos),
+              (size - pos) * sizeof(NodePtr));
+      keys[pos] = ch;
+      new (children + pos) NodePtr(std::move(child));
+      break;
+    }
+    case 2:
+      // We never remove children, so slots are used in order.
+      Keys()[ch] = size + 1;
+      new (children + size) NodePtr(std::move(child));
+      break;
+    default:
+      children[ch] = std::move(child);
+    }
+    size++;
+  }
+
+  // Grow returns copy of this (full) node in the next size class,
+  // with our children moved into it.
+  Node* Grow() {
+    assert(kind + 1 < kKinds);
+    Node* n = Allocate(kind + 1, depth);
+#if USE_STORED_PREFIXES
+    n->prefix = prefix;
+#endif
+    ForEachChild([n] (uint8_t ch, NodePtr& p) {
+      n->InsertInPlace(ch, std::move(p));
+      return true;
+    });
+    return n;
+  }
+
+  static void Delete(Node* node) {
+    size_t alloc_size = AllocSize(node->kind);
+    node->~Node();
+#if __cpp_sized_deallocation
+    (::operator delete)(node, alloc_size);
+#else
+    (::operator delete)(node);
+    (void)alloc_size; // unused in this config. Avoid warning.
+#endif
+  }
+
+  static Node* Allocate(uint8_t kind, uint32_t depth) {
+    Node* n = new ((::operator new)(AllocSize(kind))) Node(kind, depth);
+    memset(n->Keys(), 0, kKeysBytes[kind]);
+    if (kind == kKinds - 1) {
+      for (uint32_t i = 0; i < 256; i++) {
+        new (n->Children() + i) NodePtr();
+      }
+    }
+    return n;
+  }
+
+  Node(uint8_t kind, uint32_t depth) : depth(depth), size(0), kind(kind) {}
+
+  ~Node() {
+    ForEachChild([] (uint8_t, NodePtr& p) {
+      p.~NodePtr();
+      return true;
+    });
+  }
+};
+#endif  // USE_ART_NODES
 
 static uint8_t ReadString(std::string_view data, size_t depth) {
   if (depth < data.size()) [[likely]] {
@@ -245,6 +584,7 @@ void NodePtr::Reset() {
   }
 }
 
+#if !USE_STORED_PREFIXES
 std::pair<Leaf*, size_t> FindLCPLeaf(NodePtr* place, std::string_view data) {
   Leaf* leaf;
   Node* node;
@@ -256,7 +596,7 @@ std::pair<Leaf*, size_t> FindLCPLeaf(NodePtr* place, std::string_view data) {
     }
 
     uint8_t ch = ReadString(data, node->depth);
-    NodePtr* new_place = node->FindChild(ch, nullptr);
+    NodePtr* new_place = node->FindChild(ch);
     if (!new_place) {
       // Entire subtree at node has common prefix, but we don't know
       // what is that prefix exactly (because successive down-ward
@@ -316,11 +656,10 @@ void Insert(NodePtr* root_place, std::string_view data) {
     }
 
     uint8_t ch = ReadString(data, node->depth);
-    uint8_t pos;
-    NodePtr* new_place = node->FindChild(ch, &pos);
+    NodePtr* new_place = node->FindChild(ch);
     if (node->depth == lcp) {
       assert(!new_place);
-      *place = NodePtr{Node::MakeInserting(node, ch, pos, new Leaf(data))};
+      Node::AddChild(place, node, ch, NodePtr{new Leaf(data)});
       return;
     }
 
@@ -328,6 +667,104 @@ void Insert(NodePtr* root_place, std::string_view data) {
   }
 }
 
+#else  // USE_STORED_PREFIXES
+Leaf* SmallestLeaf(Node* node) {
+  Leaf* leaf;
+  do {
+    node->GetSmallestChild()->Unpack(&leaf, &node);
+  } while (leaf == nullptr);
+  return leaf;
+}
+
+// SkippedChar returns char at pos (start <= pos < node->depth) that
+// all keys under node share. start is where node's skipped chars
+// begin. Chars beyond stored prefix are read from some leaf, which
+// we find once and remember in *leaf.
+static uint8_t SkippedChar(const Node* node, size_t start, size_t pos, Leaf** leaf) {
+  assert(start <= pos && pos < node->depth);
+  if (pos - start < detail::StoredPrefix::kBytes) {
+    return node->prefix.bytes[pos - start];
+  }
+  if (*leaf == nullptr) {
+    *leaf = SmallestLeaf(const_cast<Node*>(node));
+  }
+  return ReadString((*leaf)->data, pos);
+}
+
+// MatchSkipped returns how many of node's skipped chars (i.e. chars
+// from start up to node->depth) data matches.
+static size_t MatchSkipped(const Node* node, std::string_view data, size_t start, Leaf** leaf) {
+  size_t i = start;
+  while (i < node->depth && SkippedChar(node, start, i, leaf) == ReadString(data, i)) {
+    i++;
+  }
+  return i - start;
+}
+
+void Insert(NodePtr* root_place, std::string_view data) {
+  if (root_place->IsEmpty()) {
+    *root_place = NodePtr{new Leaf(data)};
+    return;
+  }
+
+  NodePtr* place = root_place;
+  // All keys under place share first start chars with data.
+  size_t start = 0;
+
+  for (;;) {
+    Leaf* leaf;
+    Node* node;
+
+    place->Unpack(&leaf, &node);
+    if (leaf) {
+      size_t lcp = start + (std::mismatch(data.begin() + start, data.end(),
+                                          leaf->data.begin() + start, leaf->data.end()).first
+                            - (data.begin() + start));
+      // See the comment in the other Insert.
+      assert(lcp < data.size());
+      Node* n = Node::MakeFrom2(lcp,
+                                ReadString(leaf->data, lcp), std::move(*place),
+                                ReadString(data, lcp), NodePtr{new Leaf(data)});
+      n->prefix.Set(data.substr(start, lcp - start));
+      *place = NodePtr{n};
+      return;
+    }
+
+    Leaf* example = nullptr;
+    size_t lcp = start + MatchSkipped(node, data, start, &example);
+    if (lcp < node->depth) {
+      // data diverges from node's keys in the middle of node's
+      // skip. So new node goes at lcp, and node now skips only chars
+      // after lcp.
+      uint8_t example_char = SkippedChar(node, start, lcp, &example);
+      uint8_t rest[detail::StoredPrefix::kBytes];
+      size_t rest_size = std::min<size_t>(node->depth - lcp - 1, detail::StoredPrefix::kBytes);
+      for (size_t i = 0; i < rest_size; i++) {
+        rest[i] = SkippedChar(node, start, lcp + 1 + i, &example);
+      }
+      node->prefix.Set({reinterpret_cast<const char*>(rest), rest_size});
+
+      Node* n = Node::MakeFrom2(lcp,
+                                example_char, std::move(*place),
+                                ReadString(data, lcp), NodePtr{new Leaf(data)});
+      n->prefix.Set(data.substr(start, lcp - start));
+      *place = NodePtr{n};
+      return;
+    }
+
+    uint8_t ch = ReadString(data, node->depth);
+    NodePtr* new_place = node->FindChild(ch);
+    if (!new_place) {
+      Node::AddChild(place, node, ch, NodePtr{new Leaf(data)});
+      return;
+    }
+
+    place = new_place;
+    start = node->depth + 1;
+  }
+}
+#endif  // USE_STORED_PREFIXES
+
 struct ValidationState {
   size_t leaf_count = 0;
   size_t node_count = 0;
@@ -395,6 +832,11 @@ std::string_view DoValidate(ValidationState* state, const NodePtr& ptr, uint32_t
 
   validation_assert(seen_children == n->size);
 
+#if USE_STORED_PREFIXES
+  size_t stored = std::min<size_t>(n->depth - min_depth, detail::StoredPrefix::kBytes);
+  validation_assert(memcmp(n->prefix.bytes, my_lcp.data() + min_depth, stored) == 0);
+#endif
+
   return my_lcp;
 }
 
@@ -414,71 +856,345 @@ void ValidateTrie(NodePtr* root) {
   }
 }
 
-Leaf* LowerBound(NodePtr* root_place, std::string_view data) {
-  if (root_place == nullptr) {
-    return nullptr;
+void AccountMemory(const NodePtr& ptr, MemoryStats* stats) {
+  Leaf* l;
+  Node* n;
+  ptr.Unpack(&l, &n);
+
+  if (l) {
+    stats->AddKeys(1);
+    stats->AddNode(sizeof(Leaf));
+    return;
+  }
+  if (!n) {
+    return;
   }
 
-  struct R {
-    std::string_view data;
+  stats->AddNode(n->AllocSize());
+  n->EnumChildren(
+    [&] (uint8_t, const NodePtr& ptr) -> void {
+      AccountMemory(ptr, stats);
+    });
+}
+
+// Cursor walks leafs of trie (or of any subtree of it) in
+// order. It keeps path from it's root down to current leaf. So Next
+// only goes up to the nearest node that has next child, and finds
+// that child with FindNextChild (i.e. bitmap scan), rather than
+// probing chars one by one.
+class Cursor {
+public:
+  explicit Cursor(NodePtr* root) : root_(root) {}
+
+  // leaf is current leaf, or nullptr if we've went past the end.
+  Leaf* leaf() const {
+    return leaf_;
+  }
+
+  void SeekFirst() {
+    path_.clear();
+    leaf_ = nullptr;
+    if (!root_->IsEmpty()) {
+      Descend(root_);
+    }
+  }
+
+  // SeekAfter positions cursor at smallest leaf that is > data.
+  void SeekAfter(std::string_view data) {
+    path_.clear();
+    leaf_ = nullptr;
+    if (root_->IsEmpty()) {
+      return;
+    }
+
+#if USE_STORED_PREFIXES
+    // All keys under place share first start chars with data.
+    size_t start = 0;
+#else
     Leaf* other_leaf;
     size_t lcp;
+    std::tie(other_leaf, lcp) = FindLCPLeaf(root_, data);
+#endif
 
-    Leaf* Rec(NodePtr* place) {
-      Leaf* leaf;
+    NodePtr* place = root_;
+    for (;;) {
       Node* node;
-      place->Unpack(&leaf, &node);
-      if (leaf) {
-        if (leaf->data > data) {
-          return leaf;
+      place->Unpack(&leaf_, &node);
+      if (leaf_) {
+        if (leaf_->data > data) {
+          return;
         }
-        return nullptr;
+        break;
       }
 
-      // Note, we can do tighter but this is correct.
-      uint8_t ch = (node->depth > lcp) ? 0 : ReadString(data, node->depth);
-      NodePtr* child_place = node->FindChild(ch, nullptr);
-      if (child_place) {
-        leaf = Rec(child_place);
-        if (leaf) {
-          return leaf;
+      // If data diverges from keys under node above node's depth,
+      // then entire subtree is either greater or smaller than data.
+#if USE_STORED_PREFIXES
+      Leaf* example = nullptr;
+      size_t diverge = start + MatchSkipped(node, data, start, &example);
+      if (diverge < node->depth) {
+        if (SkippedChar(node, start, diverge, &example) > ReadString(data, diverge)) {
+          Descend(place);
+          return;
         }
+        break;
       }
-
-      for (uint32_t i = ch + 1; i < 256; i++) {
-        child_place = node->FindChild(i, nullptr);
-        if (child_place) {
-          break;
+#else
+      if (node->depth > lcp) {
+        if (ReadString(other_leaf->data, lcp) > ReadString(data, lcp)) {
+          Descend(place);
+          return;
         }
+        break;
       }
-      if (!child_place) {
-        return nullptr;
-      }
+#endif
 
-      for (;;) {
-        child_place->Unpack(&leaf, &node);
-        if (leaf) {
+      uint8_t ch = ReadString(data, node->depth);
+      NodePtr* child = node->FindChild(ch);
+      if (!child) {
+        child = node->FindNextChild(uint32_t{ch} + 1, &ch);
+        if (!child) {
           break;
         }
-        child_place = node->GetSmallestChild();
+        path_.push_back({node, ch});
+        Descend(child);
+        return;
       }
+      path_.push_back({node, ch});
+      place = child;
+#if USE_STORED_PREFIXES
+      start = node->depth + 1;
+#endif
+    }
 
-      if (leaf->data > data) {
-        return leaf;
+    // Everything under the last place we've reached is smaller than
+    // data.
+    Advance();
+  }
+
+  void Next() {
+    assert(leaf_ != nullptr);
+    Advance();
+  }
+
+private:
+  // Frame is node on our path and char of child we went to.
+  struct Frame {
+    Node* node;
+    uint8_t ch;
+  };
+
+  // Descend goes to smallest leaf under place.
+  void Descend(NodePtr* place) {
+    for (;;) {
+      Node* node;
+      place->Unpack(&leaf_, &node);
+      if (leaf_) {
+        return;
       }
-      return nullptr;
+      uint8_t ch = 0;
+      place = node->FindNextChild(0, &ch);
+      path_.push_back({node, ch});
+    }
+  }
+
+  // Advance goes to smallest leaf after subtree at the end of path_.
+  void Advance() {
+    while (!path_.empty()) {
+      Frame& f = path_.back();
+      uint8_t ch;
+      NodePtr* child = f.node->FindNextChild(uint32_t{f.ch} + 1, &ch);
+      if (child) {
+        f.ch = ch;
+        Descend(child);
+        return;
+      }
+      path_.pop_back();
+    }
+    leaf_ = nullptr;
+  }
+
+  NodePtr* const root_;
+  std::vector<Frame> path_;
+  Leaf* leaf_ = nullptr;
+};
+
+Leaf* LowerBound(NodePtr* root_place, std::string_view data) {
+  if (root_place == nullptr) {
+    return nullptr;
+  }
+  Cursor c(root_place);
+  c.SeekAfter(data);
+  return c.leaf();
+}
+
+// ForEachWithPrefix calls fn (with const std::string_view& of the
+// leaf's data) for every key that starts with prefix, in increasing
+// order. Keys with given prefix are exactly keys of some subtree, so
+// we descend once to find it and then walk it with Cursor.
+template <typename Fn>
+void ForEachWithPrefix(NodePtr* root_place, std::string_view prefix, Fn&& fn) {
+  if (root_place->IsEmpty()) {
+    return;
+  }
+  NodePtr* place = root_place;
+  for (;;) {
+    Leaf* leaf;
+    Node* node;
+    place->Unpack(&leaf, &node);
+    if (leaf || node->depth >= prefix.size()) {
+      break;
+    }
+    place = node->FindChild(prefix[node->depth]);
+    if (!place) {
+      return;
+    }
+  }
+
+  // We only checked prefix chars where nodes branch. But keys under
+  // place agree on everything else up to the prefix's end, so any one
+  // of them tells whether they all match.
+  Cursor c(place);
+  c.SeekFirst();
+  if (!c.leaf()->data.starts_with(prefix)) {
+    return;
+  }
+  for (; c.leaf(); c.Next()) {
+    fn(c.leaf()->data);
+  }
+}
+
+// Stitch returns trie that has all given subtries. Keys of all of
+// them agree on first depth chars, and each part's keys have given
+// char at depth. Parts are in increasing order of chars.
+NodePtr Stitch(uint32_t depth, std::vector<std::pair<uint8_t, NodePtr>>* parts) {
+  assert(!parts->empty());
+  if (parts->size() == 1) {
+    return std::move((*parts)[0].second);
+  }
+#if USE_STORED_PREFIXES
+  // Subtries were built on their own, so their top nodes think they
+  // skip everything from the start of the key.
+  for (auto& [ch, part] : *parts) {
+    Leaf* leaf;
+    Node* node;
+    part.Unpack(&leaf, &node);
+    if (node) {
+      node->prefix.Set(SmallestLeaf(node)->data.substr(depth + 1, node->depth - depth - 1));
     }
+  }
+#endif
+  NodePtr rv{Node::MakeFrom2(depth,
+                             (*parts)[0].first, std::move((*parts)[0].second),
+                             (*parts)[1].first, std::move((*parts)[1].second))};
+  for (size_t i = 2; i < parts->size(); i++) {
+    Leaf* leaf;
+    Node* node;
+    rv.Unpack(&leaf, &node);
+    Node::AddChild(&rv, node, (*parts)[i].first, std::move((*parts)[i].second));
+  }
+  return rv;
+}
+
+// BuildParallel builds the same trie as inserting every suffix of s
+// one by one, but on num_threads threads. Suffixes that start with
+// different chars never touch the same subtree. So we bucket
+// suffixes by their first 2 chars (just 1st char would leave us with
+// few huge buckets, e.g. for ' ' and 'e'), build trie of each bucket
+// without any locking, and then stitch them together under (at most)
+// 2 levels of nodes.
+void BuildParallel(NodePtr* root_place, std::string_view s, int num_threads, const AtomicFlag& stop_req) {
+  assert(s.size() < (size_t{1} << 32));
+  constexpr size_t kBuckets = 256 * 256;
+  auto bucket_of = [s] (size_t pos) -> size_t {
+    return ReadString(s, pos) * 256 + ReadString(s, pos + 1);
   };
 
-  R r;
-  std::tie(r.other_leaf, r.lcp) = FindLCPLeaf(root_place, data);
-  r.data = data;
+  // Counting sort of positions by bucket. Within bucket positions go
+  // from the end of text, like in the serial build.
+  std::vector<uint32_t> bucket_start(kBuckets + 1);
+  for (size_t pos = 0; pos < s.size(); pos++) {
+    bucket_start[bucket_of(pos) + 1]++;
+  }
+  for (size_t i = 0; i < kBuckets; i++) {
+    bucket_start[i + 1] += bucket_start[i];
+  }
+  std::vector<uint32_t> positions(s.size());
+  {
+    std::vector<uint32_t> fill(bucket_start.begin(), bucket_start.end() - 1);
+    for (size_t pos = s.size(); pos-- > 0;) {
+      positions[fill[bucket_of(pos)]++] = pos;
+    }
+  }
 
-  return r.Rec(root_place);
+  // Biggest buckets go first, so that threads finish at about the
+  // same time.
+  std::vector<uint32_t> order;
+  for (size_t i = 0; i < kBuckets; i++) {
+    if (bucket_start[i] != bucket_start[i + 1]) {
+      order.push_back(i);
+    }
+  }
+  std::sort(order.begin(), order.end(), [&] (uint32_t a, uint32_t b) {
+    return bucket_start[a + 1] - bucket_start[a] > bucket_start[b + 1] - bucket_start[b];
+  });
+
+  std::vector<NodePtr> subtries(kBuckets);
+  std::atomic<size_t> next_bucket{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&] () {
+      for (;;) {
+        size_t i = next_bucket.fetch_add(1, std::memory_order_relaxed);
+        if (i >= order.size()) {
+          return;
+        }
+        uint32_t b = order[i];
+        for (uint32_t j = bucket_start[b]; j < bucket_start[b + 1]; j++) {
+          if (stop_req) {
+            return;
+          }
+          Insert(&subtries[b], s.substr(positions[j]));
+        }
+      }
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
 
+  std::vector<std::pair<uint8_t, NodePtr>> firsts;
+  for (uint32_t c = 0; c < 256; c++) {
+    std::vector<std::pair<uint8_t, NodePtr>> seconds;
+    for (uint32_t c2 = 0; c2 < 256; c2++) {
+      NodePtr& subtrie = subtries[c * 256 + c2];
+      if (!subtrie.IsEmpty()) {
+        seconds.emplace_back(c2, std::move(subtrie));
+      }
+    }
+    if (!seconds.empty()) {
+      firsts.emplace_back(c, Stitch(1, &seconds));
+    }
+  }
+  if (firsts.empty()) {
+    return;
+  }
+  *root_place = Stitch(0, &firsts);
+
+#if USE_STORED_PREFIXES
+  Leaf* leaf;
+  Node* node;
+  root_place->Unpack(&leaf, &node);
+  if (node) {
+    node->prefix.Set(SmallestLeaf(node)->data.substr(0, node->depth));
+  }
+#endif
 }
 
 int main(int argc, char** argv) {
+  std::optional<std::string_view> threads_flag = ConsumeFlag(&argc, &argv, "--threads");
+  int num_threads = threads_flag ? std::max(atoi(std::string{*threads_flag}.c_str()), 1) : 0;
+
   // NOTE, we want this to be destroyed after heap sample dump we
   // setup just below.
   NodePtr locations;
@@ -491,39 +1207,78 @@ int main(int argc, char** argv) {
   AtomicFlag stop_req;
   auto sigint_cleanup = SignalHelper::OnSIGINT(&stop_req);
 
-  for (int pos = s.size() - 1; pos >= 0; pos--) {
-    auto l = std::string_view{s}.substr(pos);
-    Insert(&locations, l);
+  MemoryStats memory_stats;
+  if (num_threads > 0) {
+    BuildParallel(&locations, s, num_threads, stop_req);
     if (stop_req) {
       fprintf(stderr, "interrupted insertions by seeing SIGINT\n");
-      break;
     }
+  } else {
+    for (size_t pos = s.size(); pos-- > 0;) {
+      auto l = std::string_view{s}.substr(pos);
+      Insert(&locations, l);
+      if (stop_req) {
+        fprintf(stderr, "interrupted insertions by seeing SIGINT\n");
+        break;
+      }
 
 #ifndef NDEBUG
-    size_t num_inserted = s.size() - pos;
-    // We want to validate often when we're at small tree, but
-    // otherwise avoid O(N^2) blowup in debug builds.
-    if (num_inserted < 128 || (num_inserted & (num_inserted - 1)) == 0) {
-      ValidateTrie(&locations);
-      printf("inserted %zu suffixes so far\n", num_inserted);
-    }
+      size_t num_inserted = s.size() - pos;
+      // We want to validate often when we're at small tree, but
+      // otherwise avoid O(N^2) blowup in debug builds.
+      if (num_inserted < 128 || (num_inserted & (num_inserted - 1)) == 0) {
+        ValidateTrie(&locations);
+        printf("inserted %zu suffixes so far\n", num_inserted);
+      }
 #endif
+    }
   }
 
 #ifndef NDEBUG
   ValidateTrie(&locations);
 #endif
 
-  auto it = LowerBound(&locations, "the Roman Empire");
-  assert(it != nullptr);
-  if (it == nullptr) {
+  if (MemoryStats::Enabled()) {
+    AccountMemory(locations, &memory_stats);
+    memory_stats.Print("trie");
+  }
+
+  // Like in suffix-map and critbit programs, we look at every
+  // occurrence and report the last one in the text.
+  const std::string_view prefix = "the Roman Empire";
+  const char* farthest_result = nullptr;
+  size_t seen_hits = 0;
+  ForEachWithPrefix(&locations, prefix, [&] (const std::string_view& key) {
+    if (!farthest_result || key.data() > farthest_result) {
+      farthest_result = key.data();
+    }
+    seen_hits++;
+  });
+  if (!farthest_result) {
     printf("failed to find\n");
     abort();
   }
 
-  size_t off = it->data.data() - s.data();
+#ifndef NDEBUG
+  // Cross-check against streaming matches with Cursor from
+  // LowerBound.
+  {
+    Cursor c(&locations);
+    c.SeekAfter(prefix);
+    size_t hits = 0;
+    for (; c.leaf() && c.leaf()->data.starts_with(prefix); c.Next()) {
+      hits++;
+    }
+    assert(hits == seen_hits);
+    assert(LowerBound(&locations, prefix)->data.starts_with(prefix));
+  }
+#endif
+
+  printf("seen_hits: %zu\n", seen_hits);
+
+  size_t off = farthest_result - s.data();
   printf("off = %zu\n", off);
 
-  printf("context of last(ish) occurrence of 'the Roman Empire':\n");
+  printf("context of last occurrence of 'the Roman Empire':\n");
   PrintOccurenceContext(s, off);
 }
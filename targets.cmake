@@ -8,48 +8,79 @@ target_link_libraries(trigram-index PRIVATE gperftools::profiler gperftools::tcm
 add_executable(trigram-index-sysmalloc trigram-index.cc demo-helper.h)
 target_link_libraries(trigram-index-sysmalloc PRIVATE gperftools::profiler Threads::Threads)
 
-add_executable(suffix-map suffix-map.cc demo-helper.h)
+add_executable(suffix-map suffix-map.cc demo-helper.h prefixed-key.h)
 target_compile_definitions(suffix-map PRIVATE WE_HAVE_TCMALLOC)
 target_link_libraries(suffix-map PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
 
-add_executable(suffix-map-sysmalloc suffix-map.cc demo-helper.h)
+add_executable(suffix-map-sysmalloc suffix-map.cc demo-helper.h prefixed-key.h)
 target_link_libraries(suffix-map-sysmalloc PRIVATE gperftools::profiler Threads::Threads)
 
-add_executable(suffix-btree suffix-btree.cc demo-helper.h)
+add_executable(suffix-btree suffix-btree.cc demo-helper.h prefixed-key.h)
 target_compile_definitions(suffix-btree PRIVATE WE_HAVE_TCMALLOC)
 target_link_libraries(suffix-btree PRIVATE gperftools::profiler gperftools::tcmalloc absl::btree Threads::Threads)
 
-add_executable(suffix-btree-sysmalloc suffix-btree.cc demo-helper.h)
+add_executable(suffix-btree-sysmalloc suffix-btree.cc demo-helper.h prefixed-key.h)
 target_link_libraries(suffix-btree-sysmalloc PRIVATE gperftools::profiler absl::btree Threads::Threads)
 
-add_executable(suffix-btree-persistent suffix-btree-persistent.cc demo-helper.h)
+add_executable(suffix-btree-persistent suffix-btree-persistent.cc demo-helper.h epoch.h)
 target_compile_definitions(suffix-btree-persistent PRIVATE WE_HAVE_TCMALLOC)
 target_link_libraries(suffix-btree-persistent PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
 
-add_executable(suffix-btree-persistent-sysmalloc suffix-btree-persistent.cc demo-helper.h)
+add_executable(suffix-btree-persistent-sysmalloc suffix-btree-persistent.cc demo-helper.h epoch.h)
 target_link_libraries(suffix-btree-persistent-sysmalloc PRIVATE gperftools::profiler Threads::Threads)
 
-add_executable(suffix-avl suffix-avl.cc demo-helper.h)
+add_executable(suffix-btree-persistent-concurrent suffix-btree-persistent.cc demo-helper.h epoch.h)
+target_compile_definitions(suffix-btree-persistent-concurrent PRIVATE WE_HAVE_TCMALLOC CONCURRENT_READERS)
+target_link_libraries(suffix-btree-persistent-concurrent PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
+
+add_executable(suffix-btree-persistent-prefixes suffix-btree-persistent.cc demo-helper.h epoch.h)
+target_compile_definitions(suffix-btree-persistent-prefixes PRIVATE WE_HAVE_TCMALLOC USE_BTREE_KEY_PREFIXES)
+if(HAVE_MAVX2_FLAG)
+  target_compile_options(suffix-btree-persistent-prefixes PRIVATE -mavx2)
+endif()
+target_link_libraries(suffix-btree-persistent-prefixes PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
+
+add_executable(suffix-avl suffix-avl.cc demo-helper.h prefixed-key.h frozen-tree.h node-pool.h)
 target_compile_definitions(suffix-avl PRIVATE WE_HAVE_TCMALLOC)
 target_link_libraries(suffix-avl PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
 
-add_executable(suffix-avl-sysmalloc suffix-avl.cc demo-helper.h)
+add_executable(suffix-avl-sysmalloc suffix-avl.cc demo-helper.h prefixed-key.h frozen-tree.h node-pool.h)
 target_link_libraries(suffix-avl-sysmalloc PRIVATE gperftools::profiler Threads::Threads)
 
-add_executable(suffix-avl-persistent suffix-avl-persistent.cc demo-helper.h)
+add_executable(suffix-avl-pool suffix-avl.cc demo-helper.h prefixed-key.h frozen-tree.h node-pool.h)
+target_compile_definitions(suffix-avl-pool PRIVATE WE_HAVE_TCMALLOC USE_NODE_POOL)
+target_link_libraries(suffix-avl-pool PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
+
+add_executable(suffix-avl-persistent suffix-avl-persistent.cc demo-helper.h epoch.h)
 target_compile_definitions(suffix-avl-persistent PRIVATE WE_HAVE_TCMALLOC)
 target_link_libraries(suffix-avl-persistent PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
 
-add_executable(suffix-avl-persistent-sysmalloc suffix-avl-persistent.cc demo-helper.h)
+add_executable(suffix-avl-persistent-sysmalloc suffix-avl-persistent.cc demo-helper.h epoch.h)
 target_link_libraries(suffix-avl-persistent-sysmalloc PRIVATE gperftools::profiler Threads::Threads)
 
-add_executable(suffix-critbit-tree suffix-critbit-tree.cc demo-helper.h critbit-tree.h)
+add_executable(suffix-avl-persistent-concurrent suffix-avl-persistent.cc demo-helper.h epoch.h)
+target_compile_definitions(suffix-avl-persistent-concurrent PRIVATE WE_HAVE_TCMALLOC CONCURRENT_READERS)
+target_link_libraries(suffix-avl-persistent-concurrent PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
+
+add_executable(suffix-critbit-tree suffix-critbit-tree.cc demo-helper.h critbit-tree.h compact-critbit-tree.h node-pool.h)
 target_compile_definitions(suffix-critbit-tree PRIVATE WE_HAVE_TCMALLOC)
 target_link_libraries(suffix-critbit-tree PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
 
-add_executable(suffix-critbit-tree-sysmalloc suffix-critbit-tree.cc demo-helper.h critbit-tree.h)
+add_executable(suffix-critbit-tree-sysmalloc suffix-critbit-tree.cc demo-helper.h critbit-tree.h compact-critbit-tree.h node-pool.h)
 target_link_libraries(suffix-critbit-tree-sysmalloc PRIVATE gperftools::profiler Threads::Threads)
 
+add_executable(suffix-critbit-tree-pool suffix-critbit-tree.cc demo-helper.h critbit-tree.h compact-critbit-tree.h node-pool.h)
+target_compile_definitions(suffix-critbit-tree-pool PRIVATE WE_HAVE_TCMALLOC USE_NODE_POOL)
+target_link_libraries(suffix-critbit-tree-pool PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
+
+add_executable(suffix-critbit-tree-compact suffix-critbit-tree.cc demo-helper.h critbit-tree.h compact-critbit-tree.h node-pool.h)
+target_compile_definitions(suffix-critbit-tree-compact PRIVATE WE_HAVE_TCMALLOC USE_COMPACT_CRITBIT)
+target_link_libraries(suffix-critbit-tree-compact PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
+
+add_executable(suffix-critbit-tree-leaf-counts suffix-critbit-tree.cc demo-helper.h critbit-tree.h compact-critbit-tree.h node-pool.h)
+target_compile_definitions(suffix-critbit-tree-leaf-counts PRIVATE WE_HAVE_TCMALLOC USE_CRITBIT_LEAF_COUNTS)
+target_link_libraries(suffix-critbit-tree-leaf-counts PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
+
 add_executable(suffix-trie suffix-trie.cc demo-helper.h)
 target_compile_definitions(suffix-trie PRIVATE WE_HAVE_TCMALLOC)
 target_link_libraries(suffix-trie PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
@@ -57,27 +88,58 @@ target_link_libraries(suffix-trie PRIVATE gperftools::profiler gperftools::tcmal
 add_executable(suffix-trie-sysmalloc suffix-trie.cc demo-helper.h)
 target_link_libraries(suffix-trie-sysmalloc PRIVATE gperftools::profiler Threads::Threads)
 
-add_executable(suffix-splay suffix-splay.cc demo-helper.h)
+add_executable(suffix-trie-art suffix-trie.cc demo-helper.h)
+target_compile_definitions(suffix-trie-art PRIVATE WE_HAVE_TCMALLOC USE_ART_NODES)
+target_link_libraries(suffix-trie-art PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
+
+add_executable(suffix-trie-prefixes suffix-trie.cc demo-helper.h)
+target_compile_definitions(suffix-trie-prefixes PRIVATE WE_HAVE_TCMALLOC USE_STORED_PREFIXES)
+target_link_libraries(suffix-trie-prefixes PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
+
+add_executable(suffix-trie-art-prefixes suffix-trie.cc demo-helper.h)
+target_compile_definitions(suffix-trie-art-prefixes PRIVATE WE_HAVE_TCMALLOC USE_ART_NODES USE_STORED_PREFIXES)
+target_link_libraries(suffix-trie-art-prefixes PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
+
+add_executable(suffix-trie-concurrent suffix-trie-concurrent.cc demo-helper.h epoch.h)
+target_compile_definitions(suffix-trie-concurrent PRIVATE WE_HAVE_TCMALLOC)
+target_link_libraries(suffix-trie-concurrent PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
+
+add_executable(suffix-trie-concurrent-sysmalloc suffix-trie-concurrent.cc demo-helper.h epoch.h)
+target_link_libraries(suffix-trie-concurrent-sysmalloc PRIVATE gperftools::profiler Threads::Threads)
+
+add_executable(suffix-splay suffix-splay.cc demo-helper.h prefixed-key.h frozen-tree.h node-pool.h)
 target_compile_definitions(suffix-splay PRIVATE WE_HAVE_TCMALLOC)
 target_link_libraries(suffix-splay PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
 
-add_executable(suffix-splay-sysmalloc suffix-splay.cc demo-helper.h)
+add_executable(suffix-splay-sysmalloc suffix-splay.cc demo-helper.h prefixed-key.h frozen-tree.h node-pool.h)
 target_link_libraries(suffix-splay-sysmalloc PRIVATE gperftools::profiler Threads::Threads)
 
-add_executable(suffix-splay-classic suffix-splay-classic.cc demo-helper.h)
+add_executable(suffix-splay-pool suffix-splay.cc demo-helper.h prefixed-key.h frozen-tree.h node-pool.h)
+target_compile_definitions(suffix-splay-pool PRIVATE WE_HAVE_TCMALLOC USE_NODE_POOL)
+target_link_libraries(suffix-splay-pool PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
+
+add_executable(suffix-splay-classic suffix-splay-classic.cc demo-helper.h node-pool.h)
 target_compile_definitions(suffix-splay-classic PRIVATE WE_HAVE_TCMALLOC)
 target_link_libraries(suffix-splay-classic PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
 
-add_executable(suffix-splay-classic-sysmalloc suffix-splay-classic.cc demo-helper.h)
+add_executable(suffix-splay-classic-sysmalloc suffix-splay-classic.cc demo-helper.h node-pool.h)
 target_link_libraries(suffix-splay-classic-sysmalloc PRIVATE gperftools::profiler Threads::Threads)
 
-add_executable(suffix-treap suffix-treap.cc demo-helper.h)
+add_executable(suffix-splay-classic-pool suffix-splay-classic.cc demo-helper.h node-pool.h)
+target_compile_definitions(suffix-splay-classic-pool PRIVATE WE_HAVE_TCMALLOC USE_NODE_POOL)
+target_link_libraries(suffix-splay-classic-pool PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
+
+add_executable(suffix-treap suffix-treap.cc demo-helper.h prefixed-key.h frozen-tree.h node-pool.h)
 target_compile_definitions(suffix-treap PRIVATE WE_HAVE_TCMALLOC)
 target_link_libraries(suffix-treap PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
 
-add_executable(suffix-treap-sysmalloc suffix-treap.cc demo-helper.h)
+add_executable(suffix-treap-sysmalloc suffix-treap.cc demo-helper.h prefixed-key.h frozen-tree.h node-pool.h)
 target_link_libraries(suffix-treap-sysmalloc PRIVATE gperftools::profiler Threads::Threads)
 
+add_executable(suffix-treap-pool suffix-treap.cc demo-helper.h prefixed-key.h frozen-tree.h node-pool.h)
+target_compile_definitions(suffix-treap-pool PRIVATE WE_HAVE_TCMALLOC USE_NODE_POOL)
+target_link_libraries(suffix-treap-pool PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)
+
 add_executable(coloring coloring.cc demo-helper.h coloring-graph-src-inl.h)
 target_compile_definitions(coloring PRIVATE WE_HAVE_TCMALLOC)
 target_link_libraries(coloring PRIVATE gperftools::profiler gperftools::tcmalloc Threads::Threads)